@@ -0,0 +1,252 @@
+#include "cpu_state.h"
+#include "interrupt.h"
+#include "memory.h"
+#include "mmio.h"
+#include "mmu.h"
+
+#include <benchmark/benchmark.h>
+
+#include <cstdint>
+#include <initializer_list>
+#include <vector>
+
+using namespace std;
+using namespace mpce;
+
+namespace
+{
+
+/// Kernel data address of the serial status register at mmio offset 0x01.
+constexpr uint16_t SERIAL_STATUS_ADDR = 0xf001;
+
+/// Kernel data address the load and store benchmarks access.
+constexpr uint16_t DATA_ADDR = 0x0100;
+
+/// Fill all of kernel code memory with copies of pattern, so that PC wraps
+/// around through the same instructions forever.
+/// @param cpu
+/// @param pattern Instruction words, whose count divides 0x1'0000.
+void fill_kern_code(cpu_state_t &cpu, const vector<uint16_t> &pattern)
+{
+    memory_t &code = cpu.mmio().get_code(false);
+
+    for (uint32_t addr = 0; addr < 0x1'0000; addr++)
+    {
+        code.store(addr, pattern[addr % pattern.size()]);
+    }
+}
+
+/// @param opcode
+/// @param x
+/// @param y
+/// @param z
+/// @returns The instruction word of x <- y op z.
+uint16_t inst(const uint16_t opcode, const uint16_t x, const uint16_t y,
+              const uint16_t z)
+{
+    return opcode << 8 | x | y << 3 | z << 6;
+}
+
+// Kernel mode code of each opcode class:
+
+// 00   noop
+const vector<uint16_t> NOOP_CODE = {0x0000};
+
+// 22   r1 <- r2 ^ r3
+const vector<uint16_t> ALU_CODE = {inst(0x22, 1, 2, 3)};
+
+// 32   r1 <- r0 ^ imm
+const vector<uint16_t> ALU_IMM_CODE = {inst(0x32, 1, 0, 7), 0x1234};
+
+// 48   r1 <- mem_w_kern[r0 + imm]
+const vector<uint16_t> LOAD_CODE = {inst(0x48, 1, 0, 7), DATA_ADDR};
+
+// 44   mem_w_kern[r0 + imm] <- r1
+const vector<uint16_t> STORE_CODE = {inst(0x44, 1, 0, 7), DATA_ADDR};
+
+// 48   r1 <- mem_w_kern[r0 + imm], from the serial status register
+const vector<uint16_t> MMIO_LOAD_CODE = {inst(0x48, 1, 0, 7),
+                                         SERIAL_STATUS_ADDR};
+
+/// Report the instructions executed by state as instructions/s.
+/// @param state
+/// @param instructions
+void set_instructions(benchmark::State &state, const int64_t instructions)
+{
+    state.SetItemsProcessed(instructions);
+    state.counters["instructions/s"] =
+        benchmark::Counter(instructions, benchmark::Counter::kIsRate);
+}
+
+/// cycle on a kernel code memory full of one opcode class.
+/// @param state
+/// @param code
+void BM_cycle(benchmark::State &state, const vector<uint16_t> &code)
+{
+    cpu_state_t cpu;
+    fill_kern_code(cpu, code);
+
+    for (auto _ : state)
+    {
+        cpu.cycle();
+    }
+
+    set_instructions(state, state.iterations());
+}
+
+BENCHMARK_CAPTURE(BM_cycle, noop, NOOP_CODE);
+BENCHMARK_CAPTURE(BM_cycle, alu, ALU_CODE);
+BENCHMARK_CAPTURE(BM_cycle, alu_imm, ALU_IMM_CODE);
+BENCHMARK_CAPTURE(BM_cycle, load, LOAD_CODE);
+BENCHMARK_CAPTURE(BM_cycle, store, STORE_CODE);
+BENCHMARK_CAPTURE(BM_cycle, mmio_load, MMIO_LOAD_CODE);
+
+/// run on the same code, for the block and JIT engines. Each iteration runs
+/// state.range(0) instructions.
+/// @param state
+/// @param code
+void BM_run(benchmark::State &state, const vector<uint16_t> &code)
+{
+    cpu_state_t cpu;
+    fill_kern_code(cpu, code);
+
+    for (auto _ : state)
+    {
+        cpu.run(state.range(0));
+    }
+
+    set_instructions(state, state.iterations() * state.range(0));
+}
+
+BENCHMARK_CAPTURE(BM_run, alu, ALU_CODE)->Arg(1 << 16);
+BENCHMARK_CAPTURE(BM_run, alu_imm, ALU_IMM_CODE)->Arg(1 << 16);
+BENCHMARK_CAPTURE(BM_run, load, LOAD_CODE)->Arg(1 << 16);
+BENCHMARK_CAPTURE(BM_run, store, STORE_CODE)->Arg(1 << 16);
+
+/// mmu_t::resolve of data pages, on TLB hits.
+/// @param state
+void BM_mmu_resolve(benchmark::State &state)
+{
+    mmu_t mmu;
+    interrupt_t interrupt;
+    uint16_t virt_addr = 0;
+
+    for (uint32_t page_num = 0; page_num < 0x80; page_num++)
+    {
+        mmu.page_table(true).store(PTE_LOOKUP_INDEX(1, page_num, false),
+                                   page_num);
+    }
+
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(
+            mmu.resolve(virt_addr, 1, true, false, interrupt));
+        virt_addr += 0x0201;
+    }
+
+    state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK(BM_mmu_resolve);
+
+/// byte_addressible_memory_t loads of bytes or words over one page.
+/// @param state
+void BM_memory_load(benchmark::State &state)
+{
+    const bool byte = state.range(0);
+    memory_arena_t arena{0x1'0000};
+    byte_addressible_memory_t memory{arena, "bench", 0x1'0000};
+    uint32_t addr = 0;
+
+    memory.store(0, 1, false);
+
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(memory.load(addr, byte));
+        addr = (addr + 2) & 0x0fff;
+    }
+
+    state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK(BM_memory_load)->ArgName("byte")->Arg(0)->Arg(1);
+
+/// byte_addressible_memory_t stores of bytes or words over one page.
+/// @param state
+void BM_memory_store(benchmark::State &state)
+{
+    const bool byte = state.range(0);
+    memory_arena_t arena{0x1'0000};
+    byte_addressible_memory_t memory{arena, "bench", 0x1'0000};
+    uint32_t addr = 0;
+
+    for (auto _ : state)
+    {
+        memory.store(addr, addr, byte);
+        addr = (addr + 2) & 0x0fff;
+    }
+
+    benchmark::DoNotOptimize(memory.load(0, byte));
+    state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK(BM_memory_store)->ArgName("byte")->Arg(0)->Arg(1);
+
+/// interrupt_t::signal, is_signalled and cause as the cpu uses them.
+/// @param state
+void BM_interrupt(benchmark::State &state)
+{
+    interrupt_t interrupt;
+
+    for (auto _ : state)
+    {
+        interrupt.signal(PG_FAULT);
+        benchmark::DoNotOptimize(
+            interrupt.is_signalled(signal_mask(PG_FAULT, RO_FAULT)));
+        benchmark::DoNotOptimize(interrupt.cause());
+        interrupt.clear();
+    }
+
+    state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK(BM_interrupt);
+
+/// MMIO::io_load of the serial status register, through kernel data memory.
+/// @param state
+void BM_mmio_io_load(benchmark::State &state)
+{
+    MMIO mmio;
+    memory_t &data = mmio.get_data(false);
+
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(data.load(SERIAL_STATUS_ADDR, false));
+    }
+
+    state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK(BM_mmio_io_load);
+
+/// MMIO::io_store to the serial status register, which ignores the value,
+/// through kernel data memory.
+/// @param state
+void BM_mmio_io_store(benchmark::State &state)
+{
+    MMIO mmio;
+    memory_t &data = mmio.get_data(false);
+
+    for (auto _ : state)
+    {
+        data.store(SERIAL_STATUS_ADDR, 0, false);
+    }
+
+    state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK(BM_mmio_io_store);
+
+} // namespace
+
+BENCHMARK_MAIN();
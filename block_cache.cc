@@ -0,0 +1,124 @@
+#include "block_cache.h"
+
+namespace mpce
+{
+
+using namespace std;
+
+/// @param kern_code_capacity
+/// @param user_code_capacity
+block_cache_t::block_cache_t(const uint32_t kern_code_capacity,
+                             const uint32_t user_code_capacity)
+    : kern_code_pages_(DECODE_PAGE_NUM(kern_code_capacity) + 1),
+      user_code_pages_(DECODE_PAGE_NUM(user_code_capacity) + 1)
+{
+}
+
+/// @param block
+block_t *block_cache_t::insert(unique_ptr<block_t> block)
+{
+    if (flush_pending_)
+    {
+        flush_now();
+    }
+
+    code_pages(block->user_mode)[DECODE_PAGE_NUM(block->phys_addr)] = true;
+
+    block_t *cached = block.get();
+    blocks_[block->key] = move(block);
+
+    link(cached);
+
+    return cached;
+}
+
+/// @param user_mode
+/// @param phys_addr
+void block_cache_t::invalidate_code(const bool user_mode,
+                                    const uint32_t phys_addr)
+{
+    const vector<bool> &pages = code_pages(user_mode);
+    const uint32_t page = DECODE_PAGE_NUM(phys_addr);
+
+    if (page < pages.size() && pages[page])
+    {
+        flush();
+    }
+}
+
+/// @param ptb
+bool block_cache_t::invalidate_ptb(const uint8_t ptb)
+{
+    bool erased = false;
+
+    for (auto it = blocks_.begin(); it != blocks_.end();)
+    {
+        const block_t &block = *it->second;
+
+        if (!block.user_mode || static_cast<uint8_t>(block.key >> 16) != ptb)
+        {
+            ++it;
+            continue;
+        }
+
+        if (last_ == &block)
+        {
+            last_ = nullptr;
+        }
+
+        it = blocks_.erase(it);
+        erased = true;
+    }
+
+    // The remaining blocks may link to dropped ones.
+    if (erased)
+    {
+        for (auto &[key, block] : blocks_)
+        {
+            block->successor = nullptr;
+        }
+    }
+
+    return erased;
+}
+
+void block_cache_t::flush()
+{
+    flush_pending_ = true;
+}
+
+uint64_t block_cache_t::generation() const
+{
+    return generation_;
+}
+
+/// @param block
+void block_cache_t::link(block_t *block)
+{
+    if (last_)
+    {
+        last_->successor = block;
+    }
+
+    last_ = block;
+}
+
+void block_cache_t::flush_now()
+{
+    blocks_.clear();
+
+    fill(kern_code_pages_.begin(), kern_code_pages_.end(), false);
+    fill(user_code_pages_.begin(), user_code_pages_.end(), false);
+
+    last_ = nullptr;
+    flush_pending_ = false;
+    generation_++;
+}
+
+/// @param user_mode
+vector<bool> &block_cache_t::code_pages(const bool user_mode)
+{
+    return user_mode ? user_code_pages_ : kern_code_pages_;
+}
+
+}; // namespace mpce
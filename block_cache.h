@@ -0,0 +1,147 @@
+#pragma once
+
+#include "decode_cache.h"
+
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#define BLOCK_MAX_SIZE 64
+#define BLOCK_KEY(user_mode, ptb, pc)                                          \
+    ((static_cast<uint64_t>(user_mode) << 32) |                                \
+     (static_cast<uint64_t>(ptb) << 16) | static_cast<uint64_t>(pc))
+
+namespace mpce
+{
+
+using namespace std;
+
+/// A straight-line run of decoded instructions within one code page. Only the
+/// last instruction may branch, change the mode or address translation, or
+/// store to code memory.
+struct block_t
+{
+    /// BLOCK_KEY of the mode, page table base and PC the block starts at.
+    uint64_t key;
+
+    /// Whether the block runs from user code memory.
+    bool user_mode;
+
+    /// Physical code address of the first instruction.
+    uint32_t phys_addr;
+
+    /// Instructions in execution order, with immediates predecoded where
+    /// possible.
+    vector<decoded_inst_t> insts;
+
+    /// Whether every instruction is reads_only, so that the block may be a
+    /// polling loop.
+    bool reads_only = true;
+
+    /// The block that most recently followed this one, which find checks
+    /// before the hash lookup. Blocks are not chained into superblocks:
+    /// run_until has to evaluate its predicate, due events and interrupt
+    /// requests between any two blocks anyway, so jumping from block to
+    /// block would save little more than this lookup.
+    block_t *successor = nullptr;
+
+    /// Number of interpreted executions, for selecting blocks to compile.
+    uint32_t exec_count = 0;
+
+    /// Native code compiled by jit_t, or nullptr while interpreted.
+    uint64_t (*native)(cpu_state_t *) = nullptr;
+};
+
+/// Translated blocks keyed by BLOCK_KEY. Since the page table base is part of
+/// the key, writing ptb selects a different set of blocks and does not need to
+/// invalidate anything.
+class block_cache_t
+{
+  public:
+    /// @param kern_code_capacity
+    /// @param user_code_capacity
+    block_cache_t(const uint32_t kern_code_capacity,
+                  const uint32_t user_code_capacity);
+
+    /// Look up the block for key, trying the successor of the previously found
+    /// block before the hash lookup. Applies a pending flush first.
+    /// @param key
+    /// @returns The block, or nullptr if it has not been translated.
+    block_t *find(const uint64_t key)
+    {
+        if (flush_pending_)
+        {
+            flush_now();
+        }
+
+        if (last_ && last_->successor && last_->successor->key == key)
+        {
+            last_ = last_->successor;
+            return last_;
+        }
+
+        const auto it = blocks_.find(key);
+
+        if (it == blocks_.end())
+        {
+            return nullptr;
+        }
+
+        link(it->second.get());
+
+        return last_;
+    }
+
+    /// Add a translated block and make it the successor of the previously
+    /// found block.
+    /// @param block
+    /// @returns The cached block.
+    block_t *insert(unique_ptr<block_t> block);
+
+    /// Invalidate blocks after a store to code memory. Only flushes if a block
+    /// was translated from the page of phys_addr.
+    /// @param user_mode
+    /// @param phys_addr
+    void invalidate_code(const bool user_mode, const uint32_t phys_addr);
+
+    /// Drop the user mode blocks of a page table base after a store to its
+    /// code page table, keeping the native code of all other blocks. Unlike
+    /// flush this is immediate, which is safe since only kernel code stores
+    /// page table entries.
+    /// @param ptb
+    /// @returns True if any block was dropped.
+    bool invalidate_ptb(const uint8_t ptb);
+
+    /// Drop all blocks. The flush is deferred to the next find, so a block
+    /// that is being executed stays valid until it finishes.
+    void flush();
+
+    /// @returns The number of flushes applied so far. Native code of blocks
+    /// from an earlier generation is no longer reachable.
+    uint64_t generation() const;
+
+  private:
+    /// @param block
+    void link(block_t *block);
+
+    void flush_now();
+
+    /// @param user_mode
+    vector<bool> &code_pages(const bool user_mode);
+
+    unordered_map<uint64_t, unique_ptr<block_t>> blocks_;
+
+    /// Code pages that blocks were translated from, per code memory.
+    vector<bool> kern_code_pages_;
+    vector<bool> user_code_pages_;
+
+    /// The block returned by the last find or insert.
+    block_t *last_ = nullptr;
+
+    bool flush_pending_ = false;
+
+    uint64_t generation_ = 0;
+};
+
+} // namespace mpce
@@ -5,8 +5,15 @@ namespace mpce
 
 using namespace std;
 
-cpu_state_t::cpu_state_t()
+const array<cpu_state_t::opcode_info_t, OPCODE_MAP_SIZE>
+    cpu_state_t::opcode_mapping_ = cpu_state_t::make_opcode_mapping();
+
+array<cpu_state_t::opcode_info_t, OPCODE_MAP_SIZE> cpu_state_t::
+    make_opcode_mapping()
 {
+    array<opcode_info_t, OPCODE_MAP_SIZE> opcode_mapping;
+    opcode_mapping.fill(basic_op<&cpu_state_t::op_invalid, true>());
+
     // Opcodes appear as multiples of 2 because they are the top 7 bits of
     // the top byte of the instruction word. The lowest bit in the byte is
     // always zero.
@@ -16,305 +23,233 @@ cpu_state_t::cpu_state_t()
     // templated on multiple template parameters.
 
     // 00   noop
-    MAP_OPCODE(0x00, BIND_OP(&cpu_state_t::op_none));
+    MAP_OPCODE(0x00, (basic_op<&cpu_state_t::op_none, false>()));
 
     // Arithmetic:
 
     // 22   x <- y ^ z
-    MAP_OPCODE(0x22, BIND_OP((&cpu_state_t::op_alu<0, false, false>)));
+    MAP_OPCODE(0x22, (alu_op<0, false, false>()));
 
     // 24   x <- y - z
-    MAP_OPCODE(0x24, BIND_OP((&cpu_state_t::op_alu<1, false, false>)));
+    MAP_OPCODE(0x24, (alu_op<1, false, false>()));
 
     // c4   x <- y - z, carry
-    MAP_OPCODE(0xc4, BIND_OP((&cpu_state_t::op_alu<1, true, false>)));
+    MAP_OPCODE(0xc4, (alu_op<1, true, false>()));
 
     // 26   x <- y & z
-    MAP_OPCODE(0x26, BIND_OP((&cpu_state_t::op_alu<2, false, false>)));
+    MAP_OPCODE(0x26, (alu_op<2, false, false>()));
 
     // 2a   x <- y | z
-    MAP_OPCODE(0x2a, BIND_OP((&cpu_state_t::op_alu<3, false, false>)));
+    MAP_OPCODE(0x2a, (alu_op<3, false, false>()));
 
     // 2c   x <- y + z
-    MAP_OPCODE(0x2c, BIND_OP((&cpu_state_t::op_alu<4, false, false>)));
+    MAP_OPCODE(0x2c, (alu_op<4, false, false>()));
 
     // cc   x <- y + z, carry
-    MAP_OPCODE(0xcc, BIND_OP((&cpu_state_t::op_alu<4, true, false>)));
+    MAP_OPCODE(0xcc, (alu_op<4, true, false>()));
 
     // 32   x <- y ^ z, imm
-    MAP_OPCODE(0x32, BIND_OP((&cpu_state_t::op_alu<0, false, true>)));
+    MAP_OPCODE(0x32, (alu_op<0, false, true>()));
 
     // 34   x <- y - z, imm
-    MAP_OPCODE(0x34, BIND_OP((&cpu_state_t::op_alu<1, false, true>)));
+    MAP_OPCODE(0x34, (alu_op<1, false, true>()));
 
     // 36   x <- y & z, imm
-    MAP_OPCODE(0x36, BIND_OP((&cpu_state_t::op_alu<2, false, true>)));
+    MAP_OPCODE(0x36, (alu_op<2, false, true>()));
 
     // 3a   x <- y | z, imm
-    MAP_OPCODE(0x3a, BIND_OP((&cpu_state_t::op_alu<3, false, true>)));
+    MAP_OPCODE(0x3a, (alu_op<3, false, true>()));
 
     // 3c   x <- y + z, imm
-    MAP_OPCODE(0x3c, BIND_OP((&cpu_state_t::op_alu<4, false, true>)));
+    MAP_OPCODE(0x3c, (alu_op<4, false, true>()));
 
     // memory_t and IO:
 
     // b2   mem_b_kern[y + z] <- x
-    MAP_OPCODE(
-        0xb2,
-        BIND_OP((&cpu_state_t::op_mem<true, false, true, true, false, true>)));
+    MAP_OPCODE(0xb2, (mem_op<true, false, true, true, false, true>()));
 
     // b4   mem_b_kern[y + z] <- x, imm
-    MAP_OPCODE(
-        0xb4,
-        BIND_OP((&cpu_state_t::op_mem<true, false, true, true, true, true>)));
+    MAP_OPCODE(0xb4, (mem_op<true, false, true, true, true, true>()));
 
     // b6   x <- mem_bu_kern[y + z]
-    MAP_OPCODE(
-        0xb6,
-        BIND_OP((&cpu_state_t::op_mem<true, false, true, true, false, false>)));
+    MAP_OPCODE(0xb6, (mem_op<true, false, true, true, false, false>()));
 
     // b8   x <- mem_bu_kern[y + z], imm
-    MAP_OPCODE(
-        0xb8,
-        BIND_OP((&cpu_state_t::op_mem<true, false, true, false, true, false>)));
+    MAP_OPCODE(0xb8, (mem_op<true, false, true, false, true, false>()));
 
     // ba   x <- mem_bs_kern[y + z]
-    MAP_OPCODE(
-        0xba,
-        BIND_OP((&cpu_state_t::op_mem<true, false, true, false, false, true>)));
+    MAP_OPCODE(0xba, (mem_op<true, false, true, false, false, true>()));
 
     // bc   x <- mem_bs_kern[y + z], imm
-    MAP_OPCODE(
-        0xbc,
-        BIND_OP((&cpu_state_t::op_mem<true, false, true, false, true, true>)));
+    MAP_OPCODE(0xbc, (mem_op<true, false, true, false, true, true>()));
 
     // 42   mem_w_kern[y + z] <- x
-    MAP_OPCODE(
-        0x42,
-        BIND_OP(
-            (&cpu_state_t::op_mem<false, false, true, true, false, false>)));
+    MAP_OPCODE(0x42, (mem_op<false, false, true, true, false, false>()));
 
     // 44   mem_w_kern[y + z] <- x, imm
-    MAP_OPCODE(
-        0x44,
-        BIND_OP((&cpu_state_t::op_mem<false, false, true, true, true, false>)));
+    MAP_OPCODE(0x44, (mem_op<false, false, true, true, true, false>()));
 
     // 46   x <- mem_w_kern[y + z]
-    MAP_OPCODE(
-        0x46,
-        BIND_OP(
-            (&cpu_state_t::op_mem<false, false, true, false, false, false>)));
+    MAP_OPCODE(0x46, (mem_op<false, false, true, false, false, false>()));
 
     // 48   x <- mem_w_kern[y+ z], imm
-    MAP_OPCODE(
-        0x48,
-        BIND_OP(
-            (&cpu_state_t::op_mem<false, false, true, false, true, false>)));
+    MAP_OPCODE(0x48, (mem_op<false, false, true, false, true, false>()));
 
     // 4a   mem_t_kern[y + z] <- x
-    MAP_OPCODE(
-        0x4a,
-        BIND_OP(
-            (&cpu_state_t::op_mem<false, false, false, true, false, false>)));
+    MAP_OPCODE(0x4a, (mem_op<false, false, false, true, false, false>()));
 
     // 4c   mem_t_kern[y + z] <- x, imm
-    MAP_OPCODE(
-        0x4c,
-        BIND_OP(
-            (&cpu_state_t::op_mem<false, false, false, true, true, false>)));
+    MAP_OPCODE(0x4c, (mem_op<false, false, false, true, true, false>()));
 
     // 4e   x <- mem_t_kern[y + z]
-    MAP_OPCODE(
-        0x4e,
-        BIND_OP(
-            (&cpu_state_t::op_mem<false, false, false, false, false, false>)));
+    MAP_OPCODE(0x4e, (mem_op<false, false, false, false, false, false>()));
 
     // 6c   x <- mem_bs_user[y + z], mem_bs_user[y + z] <- imm
-    MAP_OPCODE(0x6c, BIND_OP((&cpu_state_t::op_ats)));
+    MAP_OPCODE(0x6c, ats_op());
 
     // 6e   x <- mem_t_kern[y + z], imm
-    MAP_OPCODE(
-        0x6e,
-        BIND_OP(
-            (&cpu_state_t::op_mem<false, false, false, false, true, false>)));
+    MAP_OPCODE(0x6e, (mem_op<false, false, false, false, true, false>()));
 
     // 72   mem_b_user[y + z] <- x
-    MAP_OPCODE(
-        0x72,
-        BIND_OP((&cpu_state_t::op_mem<true, true, true, true, false, true>)));
+    MAP_OPCODE(0x72, (mem_op<true, true, true, true, false, true>()));
 
     // 74   mem_b_user[y + z] <- x, imm
-    MAP_OPCODE(
-        0x74,
-        BIND_OP((&cpu_state_t::op_mem<true, true, true, true, true, true>)));
+    MAP_OPCODE(0x74, (mem_op<true, true, true, true, true, true>()));
 
     // 76   x <- mem_bu_user[y + z]
-    MAP_OPCODE(
-        0x76,
-        BIND_OP((&cpu_state_t::op_mem<true, true, true, true, true, false>)));
+    MAP_OPCODE(0x76, (mem_op<true, true, true, true, true, false>()));
 
     // 78   x <- mem_bu_user[y + z], imm
-    MAP_OPCODE(
-        0x78,
-        BIND_OP((&cpu_state_t::op_mem<true, true, true, false, true, false>)));
+    MAP_OPCODE(0x78, (mem_op<true, true, true, false, true, false>()));
 
     // 7a   x <- mem_bs_user[y + z]
-    MAP_OPCODE(
-        0x7a,
-        BIND_OP((&cpu_state_t::op_mem<true, true, true, false, false, true>)));
+    MAP_OPCODE(0x7a, (mem_op<true, true, true, false, false, true>()));
 
     // 7c   x <- mem_bs_user[y + z], imm
-    MAP_OPCODE(
-        0x7c,
-        BIND_OP((&cpu_state_t::op_mem<true, true, true, false, true, true>)));
+    MAP_OPCODE(0x7c, (mem_op<true, true, true, false, true, true>()));
 
     // 7e   mem_w_user[y + z] <- x
-    MAP_OPCODE(
-        0x7e,
-        BIND_OP((&cpu_state_t::op_mem<false, true, true, true, false, false>)));
+    MAP_OPCODE(0x7e, (mem_op<false, true, true, true, false, false>()));
 
     // 82   mem_w_user[y + z] <- x, imm
-    MAP_OPCODE(
-        0x82,
-        BIND_OP((&cpu_state_t::op_mem<false, true, true, true, true, false>)));
+    MAP_OPCODE(0x82, (mem_op<false, true, true, true, true, false>()));
 
     // 84   x <- mem_w_user[y + z]
-    MAP_OPCODE(
-        0x84,
-        BIND_OP(
-            (&cpu_state_t::op_mem<false, true, true, false, false, false>)));
+    MAP_OPCODE(0x84, (mem_op<false, true, true, false, false, false>()));
 
     // 86   x <- mem_w_user[y + z], imm
-    MAP_OPCODE(
-        0x86,
-        BIND_OP((&cpu_state_t::op_mem<false, true, true, false, true, false>)));
+    MAP_OPCODE(0x86, (mem_op<false, true, true, false, true, false>()));
 
     // 88   mem_t_user[y + z] <- x
-    MAP_OPCODE(
-        0x88,
-        BIND_OP(
-            (&cpu_state_t::op_mem<false, true, false, true, false, false>)));
+    MAP_OPCODE(0x88, (mem_op<false, true, false, true, false, false>()));
 
     // 8a   mem_t_user[y + z] <- x, imm
-    MAP_OPCODE(
-        0x8a,
-        BIND_OP((&cpu_state_t::op_mem<false, true, false, true, true, false>)));
+    MAP_OPCODE(0x8a, (mem_op<false, true, false, true, true, false>()));
 
     // 8c   x <- mem_t_user[y + z]
-    MAP_OPCODE(
-        0x8c,
-        BIND_OP(
-            (&cpu_state_t::op_mem<false, true, false, false, false, false>)));
+    MAP_OPCODE(0x8c, (mem_op<false, true, false, false, false, false>()));
 
     // 8e   x <- mem_t_user[y + z], imm
-    MAP_OPCODE(
-        0x8e,
-        BIND_OP(
-            (&cpu_state_t::op_mem<false, true, false, false, true, false>)));
+    MAP_OPCODE(0x8e, (mem_op<false, true, false, false, true, false>()));
 
     // Special registers:
 
     // e0   x <- status
-    MAP_OPCODE(0xe0, (op_special_reg_read<true, false, false>(status_)));
+    MAP_OPCODE(
+        0xe0,
+        (special_reg_read_op<true, false, false, &cpu_state_t::status_>()));
 
     // e2   x <- cause
-    MAP_OPCODE(0xe2, (op_special_reg_read<true, false, false>(cause_)));
+    MAP_OPCODE(
+        0xe2,
+        (special_reg_read_op<true, false, false, &cpu_state_t::cause_>()));
 
     // e4   x <- exc_addr
-    MAP_OPCODE(0xe4, (op_special_reg_read<true, false, false>(exc_addr_)));
+    MAP_OPCODE(
+        0xe4,
+        (special_reg_read_op<true, false, false, &cpu_state_t::exc_addr_>()));
 
     // e6   x <- eret
-    MAP_OPCODE(0xe6, (op_special_reg_read<true, false, false>(eret_)));
+    MAP_OPCODE(
+        0xe6,
+        (special_reg_read_op<true, false, false, &cpu_state_t::eret_>()));
 
     // e8   x <- eret, mode <- !mode
-    MAP_OPCODE(0xe8, (op_special_reg_read<true, false, true>(eret_)));
+    MAP_OPCODE(0xe8,
+               (special_reg_read_op<true, false, true, &cpu_state_t::eret_>()));
 
     // ea   x <- y + z, mode <- !mode
-    MAP_OPCODE(0xea, (op_special_reg_read<true, false, true>(eret_)));
+    MAP_OPCODE(0xea,
+               (special_reg_read_op<true, false, true, &cpu_state_t::eret_>()));
 
     // ec   x <- y + z, imm, mode <- !mode
-    MAP_OPCODE(
-        0xec,
-        BIND_OP((&cpu_state_t::op_alu<4, false, true, 0xff, false, true>)));
+    MAP_OPCODE(0xec, (alu_op<4, false, true, 0xff, false, true>()));
 
     // f0   mode <- 1
-    MAP_OPCODE(0xf0, BIND_OP(&cpu_state_t::op_set_mode));
+    MAP_OPCODE(0xf0, (basic_op<&cpu_state_t::op_set_mode, true>()));
 
     // f2   ptb <- y + z
-    MAP_OPCODE(0xf2, op_special_reg_write<false>(ptb_));
+    MAP_OPCODE(0xf2, (special_reg_write_op<false, &cpu_state_t::ptb_>()));
 
     // f4   timer <- y + z, imm
-    MAP_OPCODE(0xf4, op_special_reg_write<true>(timer_));
+    MAP_OPCODE(0xf4, (basic_op<&cpu_state_t::op_set_timer, true, true>()));
 
     // f6   isr <- y + z
-    MAP_OPCODE(0xf6, op_special_reg_write<false>(isr_));
+    MAP_OPCODE(0xf6, (special_reg_write_op<false, &cpu_state_t::isr_>()));
 
     // f8   status <- y + z
-    MAP_OPCODE(0xf8, op_special_reg_write<false>(status_));
+    MAP_OPCODE(0xf8, (special_reg_write_op<false, &cpu_state_t::status_>()));
 
     // fa   mmu_t[y + z] <- x
-    MAP_OPCODE(0xfa, BIND_OP(&cpu_state_t::op_store_page_table_entry<false>));
+    MAP_OPCODE(
+        0xfa,
+        (basic_op<&cpu_state_t::op_store_page_table_entry<false>, true>()));
 
     // fc   mmu_d[y + z] <- x
-    MAP_OPCODE(0xfc, BIND_OP(&cpu_state_t::op_store_page_table_entry<true>));
+    MAP_OPCODE(
+        0xfc,
+        (basic_op<&cpu_state_t::op_store_page_table_entry<true>, true>()));
 
     // Conditional branching:
 
     // 20   x <- y + z if zero
-    MAP_OPCODE(0x20,
-               BIND_OP((&cpu_state_t::op_alu<4, false, false, STATUS_ZERO>)));
+    MAP_OPCODE(0x20, (alu_op<4, false, false, STATUS_ZERO>()));
 
     // 30   x <- y + z if zero, imm
-    MAP_OPCODE(0x30,
-               BIND_OP((&cpu_state_t::op_alu<4, false, true, STATUS_ZERO>)));
+    MAP_OPCODE(0x30, (alu_op<4, false, true, STATUS_ZERO>()));
 
     // 40   x <- y + z if not zero
-    MAP_OPCODE(
-        0x40,
-        BIND_OP((&cpu_state_t::op_alu<4, false, false, STATUS_ZERO, true>)));
+    MAP_OPCODE(0x40, (alu_op<4, false, false, STATUS_ZERO, true>()));
 
     // 50   x <- y + z if not zero, imm
-    MAP_OPCODE(
-        0x50,
-        BIND_OP((&cpu_state_t::op_alu<4, false, true, STATUS_ZERO, true>)));
+    MAP_OPCODE(0x50, (alu_op<4, false, true, STATUS_ZERO, true>()));
 
     // 60   x <- y + z if neg
-    MAP_OPCODE(
-        0x60,
-        BIND_OP((&cpu_state_t::op_alu<4, false, false, STATUS_NEGATIVE>)));
+    MAP_OPCODE(0x60, (alu_op<4, false, false, STATUS_NEGATIVE>()));
 
     // 70   x <- y + z if neg, imm
-    MAP_OPCODE(
-        0x70, BIND_OP((&cpu_state_t::op_alu<4, false, true, STATUS_NEGATIVE>)));
+    MAP_OPCODE(0x70, (alu_op<4, false, true, STATUS_NEGATIVE>()));
 
     // 80   x <- y + z if pos
     MAP_OPCODE(
         0x80,
-        BIND_OP((&cpu_state_t::op_alu<4, false, false,
-                                      STATUS_NEGATIVE | STATUS_ZERO, true>)));
+        (alu_op<4, false, false, STATUS_NEGATIVE | STATUS_ZERO, true>()));
 
     // 90   x <- y + z if pos, imm
-    MAP_OPCODE(
-        0x90,
-        BIND_OP((&cpu_state_t::op_alu<4, false, true,
-                                      STATUS_NEGATIVE | STATUS_ZERO, true>)));
+    MAP_OPCODE(0x90,
+               (alu_op<4, false, true, STATUS_NEGATIVE | STATUS_ZERO, true>()));
 
     // a0   x <- y + z if carry
-    MAP_OPCODE(0xa0,
-               BIND_OP((&cpu_state_t::op_alu<4, false, false, STATUS_CARRY>)));
+    MAP_OPCODE(0xa0, (alu_op<4, false, false, STATUS_CARRY>()));
 
     // b0   x <- y + z if carry, imm
-    MAP_OPCODE(0xb0,
-               BIND_OP((&cpu_state_t::op_alu<4, false, true, STATUS_CARRY>)));
+    MAP_OPCODE(0xb0, (alu_op<4, false, true, STATUS_CARRY>()));
 
     // c0   x <- y + z if overflow
-    MAP_OPCODE(
-        0xc0,
-        BIND_OP((&cpu_state_t::op_alu<4, false, false, STATUS_OVERFLOW>)));
+    MAP_OPCODE(0xc0, (alu_op<4, false, false, STATUS_OVERFLOW>()));
 
     // d0   x <- y + z if overflow, imm
-    MAP_OPCODE(
-        0xd0, BIND_OP((&cpu_state_t::op_alu<4, false, true, STATUS_OVERFLOW>)));
+    MAP_OPCODE(0xd0, (alu_op<4, false, true, STATUS_OVERFLOW>()));
 
     // Todo: Adding the following instructions:
     //   1) Load immediate into any destination register (user and kern).
@@ -326,35 +261,251 @@ cpu_state_t::cpu_state_t()
     //   6) The ability to execute code (including protected instructions)
     //   from a virtual page while in kern mode (branch and toggle virtual
     //   memory).
+
+    return opcode_mapping;
+}
+
+cpu_state_t::cpu_state_t() : own_mmio_(make_unique<MMIO>()), mmio_(*own_mmio_)
+{
+    mmio_.attach_cpu(mmu_);
+}
+
+/// @param mmio
+/// @param core_id
+cpu_state_t::cpu_state_t(MMIO &mmio, const uint16_t core_id) : mmio_(mmio)
+{
+    mmio_.attach_cpu(mmu_);
+    register_file_.get(R1).write(core_id);
 }
 
 void cpu_state_t::cycle()
 {
-    static int cycle_num = 0;
-    LOG(INFO) << endl
-              << " -------------------------------- "
-              << "cycle " << ++cycle_num << " -------------------------------- "
-              << endl;
+    step<false>(true);
+}
+
+uint64_t cpu_state_t::run(const uint64_t max_cycles)
+{
+    return run_until([] { return false; }, max_cycles);
+}
+
+uint64_t cpu_state_t::cycle_count() const
+{
+    return cycle_count_;
+}
+
+void cpu_state_t::flush_code_caches()
+{
+    kern_decode_cache_.flush();
+    user_decode_cache_.flush();
+    block_cache_.flush();
+    mmu_.flush_tlb();
+}
+
+/// @param path
+bool cpu_state_t::load_image(const string &path)
+{
+    image_t image;
 
-    LOG(INFO) << "mode=" << (mode_.read() ? "USER" : "KERN");
+    if (!image.open(path))
+    {
+        return false;
+    }
+
+    for (const image_section_t &section : image.sections())
+    {
+        memory_t *memory = image_memory(section.kind);
+
+        if (!memory || !memory->map_file(section.load_addr, section.words,
+                                         image.fd(), section.file_offset))
+        {
+            LOG(WARNING) << "image: cannot load section of kind "
+                         << section.kind << " at " << section.load_addr;
+            return false;
+        }
+    }
+
+    register_file_.get(PC).write(image.entry_pc());
+    flush_code_caches();
+
+    return true;
+}
+
+void cpu_state_t::take_snapshot()
+{
+    snapshot_ = snapshot_t{register_values(),
+                           status_.read(),
+                           cause_.read(),
+                           eret_.read(),
+                           context_.read(),
+                           timer_.read(),
+                           isr_.read(),
+                           ptb_.read(),
+                           exc_addr_.read(),
+                           inst_.read(),
+                           mode_.read(),
+                           interrupt_.pending_signals(),
+                           decoded_inst_,
+                           cycle_count_,
+                           timer_deadline_,
+                           timer_expired_};
+
+    for (const bool user_mode : {false, true})
+    {
+        mmio_.get_code(user_mode).take_snapshot();
+        mmio_.get_data(user_mode).take_snapshot();
+    }
+
+    mmu_.page_table(false).take_snapshot();
+    mmu_.page_table(true).take_snapshot();
+}
+
+/// @returns
+bool cpu_state_t::restore_snapshot()
+{
+    if (!snapshot_)
+    {
+        return false;
+    }
+
+    for (uint8_t i = 0; i < REGISTER_FILE_SIZE; i++)
+    {
+        register_file_.get(i).write(snapshot_->registers[i]);
+    }
+
+    status_.write(snapshot_->status);
+    cause_.write(snapshot_->cause);
+    eret_.write(snapshot_->eret);
+    context_.write(snapshot_->context);
+    timer_.write(snapshot_->timer);
+    isr_.write(snapshot_->isr);
+    ptb_.write(snapshot_->ptb);
+    exc_addr_.write(snapshot_->exc_addr);
+    inst_.write(snapshot_->inst);
+    mode_.write(snapshot_->mode);
+    interrupt_.set_pending_signals(snapshot_->pending_signals);
+    decoded_inst_ = snapshot_->decoded_inst;
+    cycle_count_ = snapshot_->cycle_count;
+    set_timer_deadline(snapshot_->timer_deadline);
+    timer_expired_ = snapshot_->timer_expired;
+    schedule_profile_sample();
+
+    uint32_t restored_code_pages = 0;
+
+    for (const bool user_mode : {false, true})
+    {
+        mmio_.get_data(user_mode).restore_snapshot();
+        restored_code_pages += mmio_.get_code(user_mode).restore_snapshot();
+    }
+
+    restored_code_pages += mmu_.page_table(false).restore_snapshot();
+    restored_code_pages += mmu_.page_table(true).restore_snapshot();
+
+    // Translations of restored code or page tables may be stale.
+    if (restored_code_pages)
+    {
+        flush_code_caches();
+    }
+
+    return true;
+}
+
+/// @param threshold
+void cpu_state_t::set_jit_threshold(const uint32_t threshold)
+{
+    jit_threshold_ = jit_t::supported() ? threshold : 0;
+    block_cache_.flush();
+}
+
+/// @param recorder
+void cpu_state_t::set_trace_recorder(trace_recorder_t *recorder)
+{
+    recorder_ = recorder;
+}
+
+/// @param profiler
+void cpu_state_t::set_profiler(profiler_t *profiler)
+{
+    profiler_ = profiler;
+    schedule_profile_sample();
+}
+
+/// @param word
+decoded_inst_t cpu_state_t::decode(const uint16_t word)
+{
+    decoded_inst_t decoded;
+
+    decoded.handler = opcode_mapping_[OPCODE(word)].handler;
+    decoded.word = word;
+    decoded.x = REG_SEL_X(word);
+    decoded.y = REG_SEL_Y(word);
+    decoded.z = REG_SEL_Z(word);
+
+    return decoded;
+}
+
+template <bool predecoded> void cpu_state_t::step(const bool poll_devices)
+{
+    if (cycle_count_ >= events_.next_cycle())
+    {
+        events_.run_due(cycle_count_);
+    }
+
+    cycle_count_++;
+
+    TRACE << endl
+          << " -------------------------------- "
+          << "cycle " << cycle_count_
+          << " -------------------------------- " << endl;
+
+    TRACE << "mode=" << (mode_.read() ? "USER" : "KERN");
 
     const bool cycle_began_as_user = is_user_mode();
 
-    if (cycle_began_as_user)
+    if (COUNTERS_ENABLED)
+    {
+        counters_.mode_cycles[cycle_began_as_user]++;
+    }
+
+    array<uint16_t, REGISTER_FILE_SIZE> traced_registers;
+
+    if (recorder_)
+    {
+        traced_registers = register_values();
+    }
+
+    if (cycle_began_as_user && poll_devices)
     {
         mmio_.irq_notify(interrupt_);
-        context_switch_to_isr_if({IRQ0, IRQ1, IRQ2, IRQ3, TIME_OUT});
+
+        if (timer_expired_)
+        {
+            interrupt_.signal(TIME_OUT);
+        }
+
+        // TIME_OUT is reported in cause along with any device request.
+        if (context_switch_to_isr_if(IRQ_SIGNALS))
+        {
+            timer_expired_ = false;
+        }
     }
 
-    load_inst_word(inst_);
-    LOG(INFO) << "inst=" << inst_.read();
+    fetch_inst<predecoded>();
+    TRACE << "inst=" << inst_.read();
 
-    if (cycle_began_as_user)
+    if (cycle_began_as_user &&
+        context_switch_to_isr_if(signal_mask(PG_FAULT)))
     {
-        context_switch_to_isr_if({PG_FAULT});
         return;
     }
 
+    if (recorder_)
+    {
+        const uint8_t flags = cycle_began_as_user ? TRACE_FLAG_USER : 0;
+
+        recorder_->record({cycle_count_, traced_registers[PC], inst_.read(),
+                           TRACE_INST, flags});
+    }
+
     // Note: Interrupts are not checked in kernel mode. Kernel mode cannot
     // handle interrupts recursively. If an interrupt occurs in kernel mode,
     // the the system will either crash, or enter an undefined state, or the
@@ -371,20 +522,392 @@ void cpu_state_t::cycle()
         eret_.write(register_file_.get(PC).read());
     }
 
-    const uint16_t inst_word = inst_.read();
-    const Operation inst_op = opcode_mapping_[OPCODE(inst_word)];
-
     // Perform the operation.
-    LOG(INFO) << endl << " ---------- inst_op ---------";
-    inst_op();
+    TRACE << endl << " ---------- inst_op ---------";
+    decoded_inst_.handler(*this);
+
+    if (COUNTERS_ENABLED)
+    {
+        counters_.retired[OPCODE(decoded_inst_.word)]++;
+    }
 
     if (cycle_began_as_user)
     {
-        mmio_.irq_notify(interrupt_);
-        context_switch_to_isr_if(
-            {IRQ0, IRQ1, IRQ2, IRQ3, TIME_OUT, PG_FAULT, RO_FAULT, ILL_INST});
+        if (poll_devices)
+        {
+            mmio_.irq_notify(interrupt_);
+        }
+
+        context_switch_to_isr_if(ALL_SIGNALS);
+    }
+
+    if (recorder_)
+    {
+        trace_register_writes(traced_registers);
+    }
+}
+
+template void cpu_state_t::step<false>(const bool poll_devices);
+template void cpu_state_t::step<true>(const bool poll_devices);
+
+template <bool predecoded> void cpu_state_t::fetch_inst()
+{
+    if (!predecoded)
+    {
+        load_inst_word(inst_);
+        decoded_inst_ = decode(inst_.read());
+        return;
+    }
+
+    const bool user_mode = is_user_mode();
+    const uint16_t pc_addr = register_file_.get(PC).read();
+    const uint32_t a_phys_bus =
+        user_mode ? mmu_.resolve(pc_addr, ptb_.read(), false, false, interrupt_)
+                  : pc_addr;
+
+    if (interrupt_.is_signalled(signal_mask(PG_FAULT)))
+    {
+        // Keep the previous instruction, as load_inst_word keeps inst_, but
+        // make it fetch its immediate from memory again.
+        decoded_inst_.has_imm = false;
         return;
     }
+
+    const decoded_inst_t *decoded =
+        decode_cache(user_mode).fetch(a_phys_bus);
+
+    decoded_inst_ = decoded
+                        ? *decoded
+                        : decode(mmio_.get_code(user_mode).load(a_phys_bus));
+
+    register_file_.get(PC).write(pc_addr + 1);
+
+    if (user_mode)
+    {
+        exc_addr_.write(pc_addr);
+    }
+
+    inst_.write(decoded_inst_.word);
+}
+
+/// @param user_mode
+decode_cache_t &cpu_state_t::decode_cache(const bool user_mode)
+{
+    return user_mode ? user_decode_cache_ : kern_decode_cache_;
+}
+
+/// @param user_mode
+block_t *cpu_state_t::lookup_block(const bool user_mode)
+{
+    // A pending signal changes how the next fetch behaves, leave it to step.
+    if (interrupt_.pending())
+    {
+        return nullptr;
+    }
+
+    const uint16_t pc_addr = register_file_.get(PC).read();
+    const uint64_t key =
+        BLOCK_KEY(user_mode, user_mode ? ptb_.read() : 0, pc_addr);
+
+    block_t *block = block_cache_.find(key);
+
+    return block ? block : translate_block(user_mode, key);
+}
+
+/// @param user_mode
+/// @param key
+block_t *cpu_state_t::translate_block(const bool user_mode,
+                                      const uint64_t key)
+{
+    const uint16_t pc_addr = register_file_.get(PC).read();
+    uint32_t phys_addr = pc_addr;
+
+    if (user_mode &&
+        !mmu_.lookup(pc_addr, ptb_.read(), false, false, phys_addr))
+    {
+        return nullptr;
+    }
+
+    unique_ptr<block_t> block = make_unique<block_t>();
+    block->key = key;
+    block->user_mode = user_mode;
+    block->phys_addr = phys_addr;
+
+    decode_cache_t &cache = decode_cache(user_mode);
+    uint32_t inst_addr = phys_addr;
+
+    while (block->insts.size() < BLOCK_MAX_SIZE)
+    {
+        const decoded_inst_t *inst = cache.fetch(inst_addr);
+
+        if (!inst)
+        {
+            break;
+        }
+
+        block->insts.push_back(*inst);
+
+        const opcode_info_t &info = opcode_mapping_[OPCODE(inst->word)];
+
+        inst_addr += info.loads_imm ? 2 : 1;
+        block->reads_only = block->reads_only && info.reads_only;
+
+        // Writing PC branches, so also ends the block.
+        if (info.ends_block || inst->x == PC ||
+            DECODE_PAGE_NUM(inst_addr) != DECODE_PAGE_NUM(phys_addr))
+        {
+            break;
+        }
+    }
+
+    if (block->insts.empty())
+    {
+        return nullptr;
+    }
+
+    TRACE << "translated block at pc=" << pc_addr << " of "
+          << block->insts.size() << " instructions";
+
+    return block_cache_.insert(move(block));
+}
+
+/// @param block
+uint64_t cpu_state_t::exec_block(block_t &block)
+{
+    if (block.native)
+    {
+        const uint64_t executed = block.native(this);
+
+        if (jit_exception_)
+        {
+            rethrow_exception(exchange(jit_exception_, nullptr));
+        }
+
+        return executed;
+    }
+
+    if (jit_threshold_ && ++block.exec_count == jit_threshold_)
+    {
+        compile_block(block);
+    }
+
+    uint64_t executed = 0;
+
+    for (const decoded_inst_t &inst : block.insts)
+    {
+        executed++;
+
+        if (exec_block_inst(inst, block.user_mode))
+        {
+            break;
+        }
+    }
+
+    return executed;
+}
+
+/// @param block
+/// @param max_cycles
+uint64_t cpu_state_t::exec_polling_block(block_t &block,
+                                         const uint64_t max_cycles)
+{
+    const array<uint16_t, REGISTER_FILE_SIZE> registers = register_values();
+    const uint64_t device_events = mmio_.device_event_count();
+    const uint64_t executed = exec_block(block);
+    const uint64_t size = block.insts.size();
+
+    if (executed != size || interrupt_.pending() || mmio_.cpu_count() > 1 ||
+        register_values() != registers)
+    {
+        return executed;
+    }
+
+    // Every further iteration reads the same memory and devices, so does the
+    // same until one of them changes or the next event is due.
+    uint64_t idle_cycles =
+        min(max_cycles - executed, events_.next_cycle() - cycle_count_);
+
+    if (idle_cycles < size)
+    {
+        return executed;
+    }
+
+    if (mmio_.devices_may_raise_event())
+    {
+        const uint64_t park_cycles = min<uint64_t>(idle_cycles, IDLE_PARK_MAX);
+        const uint64_t park_ns =
+            park_cycles * 1'000'000'000 / IDLE_CYCLES_PER_SECOND;
+        const auto parked = chrono::steady_clock::now();
+
+        mmio_.wait_device_event(device_events, chrono::nanoseconds(park_ns));
+
+        const uint64_t parked_ns = chrono::duration_cast<chrono::nanoseconds>(
+                                       chrono::steady_clock::now() - parked)
+                                       .count();
+
+        idle_cycles = min(park_cycles,
+                          parked_ns * IDLE_CYCLES_PER_SECOND / 1'000'000'000);
+    }
+
+    const uint64_t skipped = idle_cycles / size * size;
+
+    TRACE << "idle loop at pc=" << register_file_.get(PC).read()
+          << " skipped " << skipped << " instructions";
+
+    cycle_count_ += skipped;
+
+    if (COUNTERS_ENABLED)
+    {
+        counters_.mode_cycles[block.user_mode] += skipped;
+        counters_.idle_cycles += skipped;
+    }
+
+    return executed + skipped;
+}
+
+/// @param inst
+/// @param user_mode
+bool cpu_state_t::exec_block_inst(const decoded_inst_t &inst,
+                                  const bool user_mode)
+{
+    register_t<uint16_t> &pc = register_file_.get(PC);
+
+    cycle_count_++;
+
+    if (COUNTERS_ENABLED)
+    {
+        counters_.mode_cycles[user_mode]++;
+    }
+
+    TRACE << "block cycle " << cycle_count_;
+
+    // The block was translated with the current page table entry, so the
+    // fetch needs neither translation nor a fault check.
+    const uint16_t pc_addr = pc.read();
+
+    decoded_inst_ = inst;
+    pc.write(pc_addr + 1);
+
+    if (user_mode)
+    {
+        exc_addr_.write(pc_addr);
+    }
+
+    inst_.write(inst.word);
+
+    interrupt_.clear();
+
+    if (user_mode)
+    {
+        eret_.write(pc.read());
+    }
+
+    inst.handler(*this);
+
+    if (COUNTERS_ENABLED)
+    {
+        counters_.retired[OPCODE(inst.word)]++;
+    }
+
+    if (user_mode)
+    {
+        return context_switch_to_isr_if(ALL_SIGNALS);
+    }
+
+    return interrupt_.pending();
+}
+
+/// @param cpu
+/// @param inst
+bool cpu_state_t::jit_exec_inst(cpu_state_t &cpu, const decoded_inst_t &inst)
+{
+    try
+    {
+        return cpu.exec_block_inst(inst, cpu.is_user_mode());
+    }
+    catch (...)
+    {
+        cpu.jit_exception_ = current_exception();
+        return true;
+    }
+}
+
+/// @param block
+void cpu_state_t::compile_block(block_t &block)
+{
+    // Code of flushed blocks is unreachable, so its space can be reused.
+    if (jit_generation_ != block_cache_.generation())
+    {
+        jit_.reset();
+        jit_generation_ = block_cache_.generation();
+        jit_stale_code_ = false;
+    }
+
+    vector<jit_op_t> ops;
+
+    for (const decoded_inst_t &inst : block.insts)
+    {
+        const opcode_info_t &info = opcode_mapping_[OPCODE(inst.word)];
+        jit_op_t op = info.jit;
+
+        // Instructions left to the interpreter still move PC past their
+        // immediate, which the generated code tracks.
+        op.load_imm = info.loads_imm;
+
+        // An immediate that is not predecoded may fault when fetched.
+        if (op.load_imm && !inst.has_imm)
+        {
+            op.inline_alu = false;
+            op.inline_mem = false;
+            op.inline_ats = false;
+        }
+
+        ops.push_back(op);
+    }
+
+    const auto offset = [this](const void *member) {
+        return static_cast<const char *>(member) -
+               reinterpret_cast<const char *>(this);
+    };
+
+    jit_layout_t layout;
+    layout.cycle_count = offset(&cycle_count_);
+
+    for (uint8_t i = 0; i < REGISTER_FILE_SIZE; i++)
+    {
+        layout.registers[i] = offset(register_file_.get(i).data());
+    }
+
+    layout.status = offset(status_.data());
+    layout.exc_addr = offset(exc_addr_.data());
+    layout.eret = offset(eret_.data());
+    layout.inst = offset(inst_.data());
+    layout.decoded_inst = offset(&decoded_inst_);
+    layout.exec_inst = &cpu_state_t::jit_exec_inst;
+
+    for (const bool is_data : {false, true})
+    {
+        layout.tlb[is_data] = offset(mmu_.tlb(is_data));
+
+        for (const bool inst_mode : {false, true})
+        {
+            const memory_t &memory = is_data ? mmio_.get_data(inst_mode)
+                                             : mmio_.get_code(inst_mode);
+
+            layout.memories[inst_mode][is_data] = {memory.page_descriptors(),
+                                                   memory.page_count(),
+                                                   memory.byte_addressible()};
+        }
+    }
+
+    block.native = jit_.compile(block, ops, layout);
+
+    // The code of blocks dropped by invalidate_ptb is only released by a
+    // flush. Without such code the blocks in use just do not all fit.
+    if (!block.native && jit_.full() && jit_stale_code_)
+    {
+        block_cache_.flush();
+    }
 }
 
 MMIO &cpu_state_t::mmio()
@@ -392,16 +915,115 @@ MMIO &cpu_state_t::mmio()
     return mmio_;
 }
 
-void cpu_state_t::context_switch_to_isr_if(
-    const vector<interrupt_signal_t> signals)
+const mmu_t &cpu_state_t::mmu() const
+{
+    return mmu_;
+}
+
+/// @returns
+perf_counters_t cpu_state_t::perf_counters() const
+{
+    perf_counters_t counters = counters_;
+    mmu_.add_perf_counters(counters);
+
+    return counters;
+}
+
+/// @param kind
+memory_t *cpu_state_t::image_memory(const image_section_kind_t kind)
+{
+    switch (kind)
+    {
+    case IMAGE_KERN_CODE:
+        return &mmio_.get_code(false);
+
+    case IMAGE_KERN_DATA:
+        return &mmio_.get_data(false);
+
+    case IMAGE_USER_CODE:
+        return &mmio_.get_code(true);
+
+    case IMAGE_USER_DATA:
+        return &mmio_.get_data(true);
+
+    case IMAGE_PAGE_TABLE_CODE:
+        return &mmu_.page_table(false);
+
+    case IMAGE_PAGE_TABLE_DATA:
+        return &mmu_.page_table(true);
+
+    default:
+        return nullptr;
+    }
+}
+
+/// @returns
+array<uint16_t, REGISTER_FILE_SIZE> cpu_state_t::register_values()
+{
+    array<uint16_t, REGISTER_FILE_SIZE> values;
+
+    for (uint8_t i = 0; i < REGISTER_FILE_SIZE; i++)
+    {
+        values[i] = register_file_.get(i).read();
+    }
+
+    return values;
+}
+
+/// @param before
+void cpu_state_t::trace_register_writes(
+    const array<uint16_t, REGISTER_FILE_SIZE> &before)
+{
+    for (uint8_t i = 0; i < REGISTER_FILE_SIZE; i++)
+    {
+        const uint16_t value = register_file_.get(i).read();
+
+        if (i != PC && value != before[i])
+        {
+            recorder_->record({cycle_count_, i, value, TRACE_REG_WRITE, 0});
+        }
+    }
+}
+
+/// @param is_store
+/// @param flags
+/// @param phys_addr
+/// @param value
+void cpu_state_t::trace_mem_access(const bool is_store, const uint8_t flags,
+                                   const uint32_t phys_addr,
+                                   const uint16_t value)
+{
+    recorder_->record({cycle_count_, phys_addr, value,
+                       is_store ? TRACE_MEM_STORE : TRACE_MEM_LOAD, flags});
+}
+
+bool cpu_state_t::context_switch_to_isr_if(const uint8_t signals)
 {
     if (!interrupt_.is_signalled(signals))
     {
-        return;
+        return false;
     }
 
     cause_.write(interrupt_.cause());
 
+    if (COUNTERS_ENABLED)
+    {
+        const uint8_t taken = interrupt_.pending_signals() & signals;
+
+        for (size_t signal = 0; signal < counters_.interrupts.size(); signal++)
+        {
+            counters_.interrupts[signal] += (taken >> signal) & 1;
+        }
+    }
+
+    if (recorder_)
+    {
+        const uint8_t flags = is_user_mode() ? TRACE_FLAG_USER : 0;
+
+        recorder_->record({cycle_count_, register_file_.get(PC).read(),
+                           cause_.read(), TRACE_INTERRUPT, flags});
+    }
+
     // Save a general purpose register in the context special register,
     // so that the general purpose register is free to hold an address
     // value. This is needed for storing the rest of the cpu context
@@ -412,6 +1034,8 @@ void cpu_state_t::context_switch_to_isr_if(
     // kernel mode.
     register_file_.get(PC).write(isr_.read());
     mode_.write(0);
+
+    return true;
 }
 
 /// @param reg_x
@@ -423,14 +1047,14 @@ void cpu_state_t::load_inst_word(register_t<uint16_t> &reg_x)
         user_mode ? mmu_.resolve(pc_addr, ptb_.read(), false, false, interrupt_)
                   : pc_addr;
 
-    if (interrupt_.is_signalled({PG_FAULT}))
+    if (interrupt_.is_signalled(signal_mask(PG_FAULT)))
     {
         return;
     }
 
-    LOG(INFO) << "incrementing pc then loading from "
-              << (user_mode ? "user" : "kern") << " code to " << reg_x.name()
-              << endl;
+    TRACE << "incrementing pc then loading from "
+          << (user_mode ? "user" : "kern") << " code to " << reg_x.name()
+          << endl;
 
     const uint16_t word = mmio_.get_code(user_mode).load(a_phys_bus);
 
@@ -444,6 +1068,86 @@ void cpu_state_t::load_inst_word(register_t<uint16_t> &reg_x)
     reg_x.write(word);
 }
 
+void cpu_state_t::load_imm_word()
+{
+    register_t<uint16_t> &imm = register_file_.get(IMM);
+
+    if (!decoded_inst_.has_imm)
+    {
+        load_inst_word(imm);
+        return;
+    }
+
+    // The immediate shares a page with the instruction, so it cannot fault.
+    const uint16_t pc_addr = register_file_.get(PC).read();
+
+    register_file_.get(PC).write(pc_addr + 1);
+
+    if (is_user_mode())
+    {
+        exc_addr_.write(pc_addr);
+    }
+
+    imm.write(decoded_inst_.imm);
+}
+
+void cpu_state_t::op_set_timer()
+{
+    op_special_reg_write<true, &cpu_state_t::timer_>();
+
+    if (interrupt_.pending())
+    {
+        return;
+    }
+
+    // Writing the timer also acknowledges an expiry not taken yet.
+    timer_expired_ = false;
+
+    set_timer_deadline(timer_.read() ? cycle_count_ + timer_.read() : 0);
+}
+
+/// @param deadline
+void cpu_state_t::set_timer_deadline(const uint64_t deadline)
+{
+    events_.cancel(timer_event_);
+    timer_event_ = 0;
+    timer_deadline_ = deadline;
+
+    if (!deadline)
+    {
+        return;
+    }
+
+    timer_event_ = events_.schedule(deadline, [this] {
+        TRACE << "timer expired";
+        timer_event_ = 0;
+        timer_deadline_ = 0;
+        timer_expired_ = true;
+    });
+}
+
+void cpu_state_t::schedule_profile_sample()
+{
+    events_.cancel(profile_event_);
+    profile_event_ = 0;
+
+    if (!profiler_)
+    {
+        return;
+    }
+
+    const uint64_t period = profiler_->period();
+
+    profile_event_ =
+        events_.schedule((cycle_count_ / period + 1) * period, [this] {
+            // PC is the next instruction to execute.
+            profiler_->sample(is_user_mode(), ptb_.read(),
+                              register_file_.get(PC).read());
+            profile_event_ = 0;
+            schedule_profile_sample();
+        });
+}
+
 /// Enable user mode by setting the mode register to 1.
 void cpu_state_t::op_set_mode()
 {
@@ -459,46 +1163,56 @@ void cpu_state_t::op_set_mode()
 /// @brief Atomic test and set.
 void cpu_state_t::op_ats()
 {
-    LOG(INFO) << "atomic test and set";
-    // Instruction word to decode register parameters.
-    const uint16_t inst_word = inst_.read();
-
+    TRACE << "atomic test and set";
     // User data memory.
     memory_t &memory = mmio_.get_data(true);
 
     // Various registers and values.
     register_t<uint16_t> &imm = register_file_.get(IMM);
-    register_t<uint16_t> &reg_x = register_file_.get(REG_SEL_X(inst_word));
-    uint16_t y = register_file_.get(REG_SEL_Y(inst_word)).read();
-    uint16_t z = register_file_.get(REG_SEL_Z(inst_word)).read();
+    register_t<uint16_t> &reg_x = register_file_.get(decoded_inst_.x);
+    uint16_t y = register_file_.get(decoded_inst_.y).read();
+    uint16_t z = register_file_.get(decoded_inst_.z).read();
 
     // Load immediate value, incrementing PC.
-    load_inst_word(imm);
+    load_imm_word();
 
     const uint32_t phys_addr =
         mmu_.resolve(y + z, ptb_.read(), true, true, interrupt_);
 
-    if (interrupt_.is_signalled({PG_FAULT, RO_FAULT}))
+    if (interrupt_.is_signalled(signal_mask(PG_FAULT, RO_FAULT)))
     {
         return;
     }
 
-    // rx <- mem[ry + rz]
-    reg_x.write(memory.load(phys_addr, true));
+    // rx <- mem[ry + rz], mem[ry + rz] <- imm as one atomic exchange, which
+    // orders all memory accesses of the other cores around it.
+    const uint16_t value = memory.exchange(phys_addr, imm.read(), true);
+    reg_x.write(value);
 
-    // mem[ry + rz] <- imm
-    memory.store(phys_addr, imm.read(), true);
+    if (COUNTERS_ENABLED)
+    {
+        counters_.memory_accesses[MEMORY_REGION(true, true)][0]++;
+        counters_.memory_accesses[MEMORY_REGION(true, true)][1]++;
+    }
+
+    if (recorder_)
+    {
+        const uint8_t flags = TRACE_FLAG_USER | TRACE_FLAG_BYTE;
+
+        trace_mem_access(false, flags, phys_addr, value);
+        trace_mem_access(true, flags, phys_addr, imm.read());
+    }
 }
 
 void cpu_state_t::op_invalid()
 {
-    cerr << "invalid operation." << endl;
+    TRACE << "invalid operation";
     interrupt_.signal(ILL_INST);
 }
 
 void cpu_state_t::op_none()
 {
-    LOG(INFO) << " * * * * op_none * * * *\n";
+    TRACE << " * * * * op_none * * * *\n";
 }
 
 bool cpu_state_t::is_user_mode() const
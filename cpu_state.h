@@ -1,20 +1,33 @@
 #pragma once
 
+#include "block_cache.h"
+#include "decode_cache.h"
+#include "event_queue.h"
+#include "image.h"
 #include "interrupt.h"
+#include "jit.h"
 #include "memory.h"
 #include "mmio.h"
 #include "mmu.h"
+#include "perf_counters.h"
+#include "profiler.h"
 #include "register.h"
+#include "trace_recorder.h"
 
+#include <algorithm>
+#include <array>
 #include <cstdint>
-#include <functional>
+#include <exception>
+#include <memory>
+#include <optional>
+#include <utility>
 
 #define OPCODE(inst) (((inst) >> 9) & 0x007f)
 #define REG_SEL_X(inst) ((inst)&0x0007)
 #define REG_SEL_Y(inst) (((inst) >> 3) & 0x0007)
 #define REG_SEL_Z(inst) (((inst) >> 6) & 0x0007)
-#define BIND_OP(op) (bind((op), this))
-#define MAP_OPCODE(opcode, op) opcode_mapping_.at((opcode) >> 1) = (op)
+#define BIND_OP(op) (&cpu_state_t::invoke<op>)
+#define MAP_OPCODE(opcode, op) opcode_mapping.at((opcode) >> 1) = (op)
 
 #define STATUS_NEGATIVE 0x08
 #define STATUS_ZERO 0x04
@@ -23,6 +36,14 @@
 
 #define OPCODE_MAP_SIZE 0x80
 
+/// Nominal instruction rate at which time passes while the host thread is
+/// parked in an idle loop.
+#define IDLE_CYCLES_PER_SECOND 100'000'000
+
+/// Instructions of the longest single park, so that run_until predicates are
+/// still polled.
+#define IDLE_PARK_MAX 10'000'000
+
 namespace mpce
 {
 
@@ -31,12 +52,41 @@ using namespace std;
 struct cpu_state_t
 {
   private:
-    using Operation = function<void()>;
+    /// Compares the internal state of two cpus.
+    friend class validator_t;
+
+    /// A plain function pointer to an opcode handler. Handlers are generated
+    /// from the op_* member templates by invoke, so dispatch is a single
+    /// indirect call with no heap allocation or type erasure.
+    using Operation = void (*)(cpu_state_t &);
+
+    /// An opcode handler and the properties of its instruction that the
+    /// block translator needs.
+    struct opcode_info_t
+    {
+        Operation handler = nullptr;
+
+        /// Whether an immediate word follows the instruction.
+        bool loads_imm = false;
+
+        /// Whether the instruction may change the mode, address translation,
+        /// code memory or pending interrupt state, so must end a basic block.
+        bool ends_block = false;
+
+        /// How the JIT implements the instruction, by default through the
+        /// interpreter.
+        jit_op_t jit = {};
+
+        /// Whether the instruction writes nothing but general purpose
+        /// registers. A loop of such instructions that leaves the registers
+        /// unchanged repeats until memory or device state changes.
+        bool reads_only = false;
+    };
 
-    /// Map a 7-bit opcode to one of 128 Operation functions. Initialize entries
-    /// to op_invalid.
-    vector<Operation> opcode_mapping_{OPCODE_MAP_SIZE,
-                                      BIND_OP(&cpu_state_t::op_invalid)};
+    /// Map a 7-bit opcode to one of 128 opcode_info_t entries. The table is
+    /// shared by all instances and built once by make_opcode_mapping, with
+    /// entries defaulting to op_invalid.
+    static const array<opcode_info_t, OPCODE_MAP_SIZE> opcode_mapping_;
 
     /// Main architectural registers, including program counter.
     RegisterFile register_file_;
@@ -45,8 +95,11 @@ struct cpu_state_t
     /// user mode.
     mmu_t mmu_;
 
-    /// memory_t-mapped IO.
-    MMIO mmio_;
+    /// The MMIO of a cpu constructed without one.
+    unique_ptr<MMIO> own_mmio_;
+
+    /// memory_t-mapped IO, possibly shared with other cpus.
+    MMIO &mmio_;
 
     /// Special registers.
     register_t<uint8_t> status_{"status", 0xf0};
@@ -62,21 +115,440 @@ struct cpu_state_t
 
     interrupt_t interrupt_;
 
+    /// The instruction being executed, as decoded from inst_.
+    decoded_inst_t decoded_inst_;
+
+    /// Predecoded instructions for run_until, one cache per code memory.
+    decode_cache_t kern_decode_cache_{mmio_.get_code(false), &decode};
+    decode_cache_t user_decode_cache_{mmio_.get_code(true), &decode};
+
+    /// Basic blocks translated by run_until.
+    block_cache_t block_cache_{mmio_.get_code(false).capacity(),
+                               mmio_.get_code(true).capacity()};
+
+    /// Native code for hot blocks.
+    jit_t jit_;
+
+    /// Interpreted executions after which a block is compiled, 0 if the JIT
+    /// is disabled. Trace and counter builds default to 0, since generated
+    /// code neither traces nor counts.
+    uint32_t jit_threshold_ =
+        jit_t::supported() && !TRACE_ENABLED && !COUNTERS_ENABLED
+            ? JIT_DEFAULT_THRESHOLD
+            : 0;
+
+    /// block_cache_ generation of the code in jit_.
+    uint64_t jit_generation_ = 0;
+
+    /// Whether jit_ holds code of blocks dropped since the generation began.
+    bool jit_stale_code_ = false;
+
+    /// Exception of an instruction run by generated code, which cannot
+    /// unwind through it. Rethrown once the generated code returns.
+    exception_ptr jit_exception_;
+
+    /// Timed events of this cpu.
+    event_queue_t events_;
+
+    /// Instruction count at which the timer expires, 0 if it is stopped.
+    uint64_t timer_deadline_ = 0;
+
+    /// events_ id of the timer expiry, 0 if not scheduled.
+    uint64_t timer_event_ = 0;
+
+    /// Whether the timer expired and TIME_OUT was not taken yet. It is taken
+    /// at the next instruction in user mode.
+    bool timer_expired_ = false;
+
+    /// mmio_ code generation that the caches of this cpu reflect.
+    uint64_t code_generation_ = 0;
+
+    /// Number of instructions executed by this cpu.
+    uint64_t cycle_count_ = 0;
+
+    /// Binary trace of executed instructions, nullptr if not recording.
+    trace_recorder_t *recorder_ = nullptr;
+
+    /// Sampling profiler, nullptr if not profiling.
+    profiler_t *profiler_ = nullptr;
+
+    /// events_ id of the next profiler sample, 0 if not scheduled.
+    uint64_t profile_event_ = 0;
+
+    /// Events of this cpu, counted if COUNTERS_ENABLED.
+    perf_counters_t counters_;
+
+    /// Cpu state saved by take_snapshot. Memories keep their own snapshots.
+    struct snapshot_t
+    {
+        array<uint16_t, REGISTER_FILE_SIZE> registers;
+        uint8_t status;
+        uint8_t cause;
+        uint16_t eret;
+        uint16_t context;
+        uint16_t timer;
+        uint16_t isr;
+        uint16_t ptb;
+        uint16_t exc_addr;
+        uint16_t inst;
+        uint8_t mode;
+        uint8_t pending_signals;
+        decoded_inst_t decoded_inst;
+        uint64_t cycle_count;
+        uint64_t timer_deadline;
+        bool timer_expired;
+    };
+
+    /// The snapshot to restore, if one was taken.
+    optional<snapshot_t> snapshot_;
+
   public:
+    /// A single cpu with its own MMIO.
     cpu_state_t();
 
+    /// A core of a multi-core machine, sharing the memories and devices of
+    /// mmio with the other cores. Code stored by one core is seen by the
+    /// others at their next block boundary.
+    /// @param mmio Must outlive the cpu.
+    /// @param core_id Initial value of R1, so that guest code can tell the
+    /// cores apart.
+    cpu_state_t(MMIO &mmio, const uint16_t core_id);
+
+    cpu_state_t(const cpu_state_t &) = delete;
+
+    cpu_state_t &operator=(const cpu_state_t &) = delete;
+
+    /// Execute a single instruction, polling every interrupt source.
     void cycle();
 
+    /// Execute up to max_cycles instructions in a tight loop. Devices are only
+    /// polled for interrupt requests after they raised an event or the cpu
+    /// entered user mode; faults are still checked after every instruction.
+    /// @param max_cycles
+    /// @returns The number of instructions executed.
+    uint64_t run(const uint64_t max_cycles);
+
+    /// Execute instructions like run, stopping once predicate returns true.
+    /// Translated basic blocks run to completion, so predicate is evaluated
+    /// between blocks rather than between instructions.
+    /// @tparam predicate_t Callable as bool().
+    /// @param predicate
+    /// @param max_cycles
+    /// @returns The number of instructions executed.
+    template <typename predicate_t>
+    uint64_t run_until(predicate_t predicate,
+                       const uint64_t max_cycles = UINT64_MAX)
+    {
+        uint64_t cycles = 0;
+        bool was_user_mode = false;
+
+        while (cycles < max_cycles && !predicate())
+        {
+            // Another cpu sharing the MMIO stored to code memory.
+            if (mmio_.code_generation() != code_generation_)
+            {
+                code_generation_ = mmio_.code_generation();
+                flush_code_caches();
+            }
+
+            // Device polls and timed events only happen between single
+            // steps, so that a block never has to take an interrupt request
+            // before its first instruction. Recording also single steps.
+            const bool event_due = cycle_count_ >= events_.next_cycle();
+
+            // A due event may expire the timer, which step then takes at
+            // once like cycle does.
+            const bool user_mode = is_user_mode();
+            const bool poll_devices =
+                user_mode && (!was_user_mode || timer_expired_ || event_due ||
+                              mmio_.take_device_event());
+
+            was_user_mode = user_mode;
+
+            block_t *block = poll_devices || event_due || recorder_
+                                 ? nullptr
+                                 : lookup_block(user_mode);
+
+            // Blocks run straight up to the next event.
+            if (block &&
+                block->insts.size() <=
+                    min(max_cycles - cycles,
+                        events_.next_cycle() - cycle_count_))
+            {
+                cycles += block->reads_only
+                              ? exec_polling_block(*block, max_cycles - cycles)
+                              : exec_block(*block);
+            }
+            else
+            {
+                step<true>(poll_devices);
+                cycles++;
+            }
+        }
+
+        return cycles;
+    }
+
+    /// @returns The number of instructions executed since construction.
+    uint64_t cycle_count() const;
+
+    /// Drop all predecoded instructions, translated blocks and cached page
+    /// table entries. Must be called after storing to code memory or page
+    /// tables from outside the cpu once it has started running.
+    void flush_code_caches();
+
+    /// Load a guest image file into memory and the page tables, and set PC to
+    /// its entry point. Page aligned sections are mapped from the file
+    /// copy-on-write, so loading takes the same time for any image size and
+    /// pages are read on first touch.
+    /// @param path
+    /// @returns False if the image cannot be read or a section does not fit
+    /// its memory.
+    bool load_image(const string &path);
+
+    /// Snapshot the registers, pending interrupts, page tables and all
+    /// memories, replacing any previous snapshot. Memory is not copied;
+    /// pages are saved on their first store afterwards. Other cores sharing
+    /// the MMIO must not run while snapshots are taken or restored.
+    void take_snapshot();
+
+    /// Return to the state at take_snapshot, copying back only the pages
+    /// stored to since. The snapshot can be restored again. Device state,
+    /// such as console buffers, is not part of the snapshot.
+    /// @returns False if no snapshot was taken.
+    bool restore_snapshot();
+
+    /// Set how many times a block is interpreted before it is compiled to
+    /// native code. 0 disables the JIT. Drops all translated blocks.
+    /// @param threshold
+    void set_jit_threshold(const uint32_t threshold);
+
+    /// Record every executed instruction, general purpose register write
+    /// except to PC, data memory access and interrupt into recorder, or stop
+    /// recording if recorder is nullptr. run_until single steps while
+    /// recording.
+    /// @param recorder Must outlive recording.
+    void set_trace_recorder(trace_recorder_t *recorder);
+
+    /// Sample PC, mode and ptb into profiler whenever the instruction count
+    /// reaches a multiple of its period, or stop profiling if profiler is
+    /// nullptr. Samples are timed events, so a cpu that is not profiling
+    /// spends nothing on them.
+    /// @param profiler Must outlive profiling.
+    void set_profiler(profiler_t *profiler);
+
     MMIO &mmio();
 
+    /// @returns The memory management unit, for its TLB counters.
+    const mmu_t &mmu() const;
+
+    /// @returns The events counted by this cpu and its mmu_t so far, all
+    /// zero unless COUNTERS_ENABLED. Mapped io is counted by the MMIO.
+    perf_counters_t perf_counters() const;
+
   private:
+    /// @returns The opcode table, with every implemented opcode mapped.
+    static array<opcode_info_t, OPCODE_MAP_SIZE> make_opcode_mapping();
+
+    /// Adapts a member operation to an Operation pointer. The member call is
+    /// resolved at compile time and inlined into the handler.
+    /// @tparam op
+    /// @param cpu
+    template <void (cpu_state_t::*op)()> static void invoke(cpu_state_t &cpu)
+    {
+        (cpu.*op)();
+    }
+
+    /// @tparam op
+    /// @tparam ends_block
+    /// @tparam loads_imm
+    /// @returns Table entry for a plain member operation.
+    template <void (cpu_state_t::*op)(), bool ends_block,
+              bool loads_imm = false>
+    static opcode_info_t basic_op()
+    {
+        return {BIND_OP(op), loads_imm, ends_block};
+    }
+
+    /// @returns Table entry for an op_alu instantiation. Toggling the mode
+    /// ends a block.
+    template <uint32_t alu_sel, bool carry_in, bool load_imm,
+              uint8_t cond = 0xff, bool status_invert = false,
+              bool toggle_mode = false>
+    static opcode_info_t alu_op()
+    {
+        return {BIND_OP((&cpu_state_t::op_alu<alu_sel, carry_in, load_imm,
+                                             cond, status_invert,
+                                             toggle_mode>)),
+                load_imm,
+                toggle_mode,
+                {!toggle_mode, alu_sel == 0, load_imm, cond, status_invert},
+                !toggle_mode};
+    }
+
+    /// @returns Table entry for an op_mem instantiation. Stores to code
+    /// memory end a block, and are left to the interpreter to invalidate the
+    /// caches.
+    template <bool byte, bool inst_mode, bool is_data, bool is_store,
+              bool load_imm, bool sign_extend_byte>
+    static opcode_info_t mem_op()
+    {
+        jit_op_t jit;
+        jit.load_imm = load_imm;
+        jit.inline_mem = is_data || !is_store;
+        jit.byte = byte;
+        jit.inst_mode = inst_mode;
+        jit.is_data = is_data;
+        jit.is_store = is_store;
+
+        return {BIND_OP((&cpu_state_t::op_mem<byte, inst_mode, is_data,
+                                             is_store, load_imm,
+                                             sign_extend_byte>)),
+                load_imm, is_store && !is_data, jit, !is_store};
+    }
+
+    /// @returns Table entry for op_ats, which ends a block.
+    static opcode_info_t ats_op()
+    {
+        opcode_info_t info = basic_op<&cpu_state_t::op_ats, true, true>();
+        info.jit.load_imm = true;
+        info.jit.inline_ats = true;
+
+        return info;
+    }
+
+    /// @returns Table entry for an op_special_reg_read instantiation.
+    template <bool protected_inst, bool load_imm, bool toggle_mode,
+              auto special_reg>
+    static opcode_info_t special_reg_read_op()
+    {
+        return {BIND_OP((&cpu_state_t::op_special_reg_read<
+                         protected_inst, load_imm, toggle_mode, special_reg>)),
+                load_imm, true};
+    }
+
+    /// @returns Table entry for an op_special_reg_write instantiation.
+    template <bool load_imm, auto special_reg>
+    static opcode_info_t special_reg_write_op()
+    {
+        return {BIND_OP((&cpu_state_t::op_special_reg_write<load_imm,
+                                                           special_reg>)),
+                load_imm, true};
+    }
+
+    /// @param word
+    /// @returns word split into its handler and register operands.
+    static decoded_inst_t decode(const uint16_t word);
+
+    /// Fetch and execute one instruction.
+    /// @tparam predecoded Whether to fetch through the decode caches instead
+    /// of loading and decoding the instruction word.
+    /// @param poll_devices Whether to collect device interrupt requests
+    /// before and after the instruction. Only meaningful in user mode.
+    template <bool predecoded> void step(const bool poll_devices);
+
+    /// Load the instruction at PC into inst_ and decoded_inst_, incrementing
+    /// PC.
+    /// @tparam predecoded
+    template <bool predecoded> void fetch_inst();
+
+    /// @param user_mode
+    /// @returns The decode cache for the code memory of user_mode.
+    decode_cache_t &decode_cache(const bool user_mode);
+
+    /// Find or translate the block starting at PC.
+    /// @param user_mode
+    /// @returns The block, or nullptr if none can be translated at PC or an
+    /// interrupt signal is still pending from the previous instruction.
+    block_t *lookup_block(const bool user_mode);
+
+    /// @param user_mode
+    /// @param key
+    /// @returns A new block starting at PC, or nullptr if PC is unmapped or
+    /// outside of code memory.
+    block_t *translate_block(const bool user_mode, const uint64_t key);
+
+    /// Execute block like consecutive step calls without device polling,
+    /// leaving the block early if an instruction raises an interrupt signal.
+    /// Runs native code once the block is hot.
+    /// @param block
+    /// @returns The number of instructions executed.
+    uint64_t exec_block(block_t &block);
+
+    /// exec_block for a block of reads_only instructions. If the block
+    /// branched back to its start leaving all registers unchanged, the guest
+    /// spins until memory, a device or an event changes something. Then the
+    /// host thread parks until a device raises an event, bounded by the next
+    /// event and max_cycles, and the instruction count advances by the whole
+    /// iterations that would have run meanwhile. Without devices that raise
+    /// events on their own, it advances immediately. Other cores may store
+    /// to the memory the loop reads, so only single cpus park.
+    /// @param block
+    /// @param max_cycles At least the size of block.
+    /// @returns The number of instructions executed or skipped.
+    uint64_t exec_polling_block(block_t &block, const uint64_t max_cycles);
+
+    /// Execute one instruction of a block.
+    /// @param inst
+    /// @param user_mode
+    /// @returns True if the block must be left.
+    bool exec_block_inst(const decoded_inst_t &inst, const bool user_mode);
+
+    /// exec_block_inst for generated code. Exceptions are stored in
+    /// jit_exception_ and leave the block.
+    /// @param cpu
+    /// @param inst
+    static bool jit_exec_inst(cpu_state_t &cpu, const decoded_inst_t &inst);
+
+    /// Compile block to native code, leaving it interpreted on failure.
+    /// @param block
+    void compile_block(block_t &block);
+
+    /// @param kind
+    /// @returns The memory that image sections of kind are loaded into, or
+    /// nullptr for an unknown kind.
+    memory_t *image_memory(const image_section_kind_t kind);
+
+    /// @returns The general purpose register values.
+    array<uint16_t, REGISTER_FILE_SIZE> register_values();
+
+    /// Record the general purpose registers, except PC, that differ from
+    /// before.
+    /// @param before
+    void trace_register_writes(
+        const array<uint16_t, REGISTER_FILE_SIZE> &before);
+
+    /// @param is_store
+    /// @param flags
+    /// @param phys_addr
+    /// @param value
+    void trace_mem_access(const bool is_store, const uint8_t flags,
+                          const uint32_t phys_addr, const uint16_t value);
+
     /// @brief
-    /// @param signals
-    void context_switch_to_isr_if(const vector<interrupt_signal_t> signals);
+    /// @param signals A signal mask.
+    /// @returns True if one of signals was pending and the cpu switched to the
+    /// isr.
+    bool context_switch_to_isr_if(const uint8_t signals);
 
     /// @param reg_x
     void load_inst_word(register_t<uint16_t> &reg_x);
 
+    /// Write timer_ and make the timer expire after that many instructions,
+    /// or stop it if written 0.
+    void op_set_timer();
+
+    /// Schedule the timer expiry, replacing any scheduled one.
+    /// @param deadline Instruction count, 0 to stop the timer.
+    void set_timer_deadline(const uint64_t deadline);
+
+    /// Schedule the next profiler sample, replacing any scheduled one.
+    void schedule_profile_sample();
+
+    /// Load the immediate word following the instruction into IMM,
+    /// incrementing PC. Uses the predecoded immediate when available.
+    void load_imm_word();
+
     /// Enable user mode by setting the mode register to 1.
     void op_set_mode();
 
@@ -101,89 +573,82 @@ struct cpu_state_t
             return;
         }
 
-        const uint16_t inst_word = inst_.read();
-
-        const uint16_t x = register_file_.get(REG_SEL_X(inst_word)).read();
-        const uint16_t y = register_file_.get(REG_SEL_Y(inst_word)).read();
-        const uint16_t z = register_file_.get(REG_SEL_Z(inst_word)).read();
+        const uint16_t x = register_file_.get(decoded_inst_.x).read();
+        const uint16_t y = register_file_.get(decoded_inst_.y).read();
+        const uint16_t z = register_file_.get(decoded_inst_.z).read();
 
         const uint16_t phys_addr = y + z;
 
-        mmu_.page_table(is_data).store(phys_addr, x);
+        mmu_.store_page_table_entry(is_data, phys_addr, x);
+
+        // Blocks are translated through the code page table only, data
+        // accesses go through the TLB when executed.
+        if (!is_data &&
+            block_cache_.invalidate_ptb(static_cast<uint8_t>(phys_addr >> 7)))
+        {
+            jit_stale_code_ = true;
+        }
     }
 
     /// @tparam protected_inst
     /// @tparam load_imm
     /// @tparam toggle_mode
-    /// @tparam register_type_t
-    /// @param special_reg
-    /// @returns An Operation object that can be called like a function.
+    /// @tparam special_reg Pointer to the special register member to read.
     template <bool protected_inst, bool load_imm, bool toggle_mode,
-              typename register_type_t>
-    Operation op_special_reg_read(
-        const register_t<register_type_t> &special_reg)
+              auto special_reg>
+    void op_special_reg_read()
     {
-        return [&]() {
-            if (load_imm)
-            {
-                load_inst_word(register_file_.get(IMM));
-            }
-
-            if (interrupt_.is_signalled({PG_FAULT}))
-            {
-                return;
-            }
-            else if (protected_inst && is_user_mode())
-            {
-                interrupt_.signal(ILL_INST);
-                return;
-            }
+        if (load_imm)
+        {
+            load_imm_word();
+        }
 
-            const uint16_t inst_word = inst_.read();
+        if (interrupt_.is_signalled(signal_mask(PG_FAULT)))
+        {
+            return;
+        }
+        else if (protected_inst && is_user_mode())
+        {
+            interrupt_.signal(ILL_INST);
+            return;
+        }
 
-            register_t<uint16_t> &reg_x =
-                register_file_.get(REG_SEL_X(inst_word));
+        register_t<uint16_t> &reg_x = register_file_.get(decoded_inst_.x);
 
-            reg_x.write(special_reg.read());
+        reg_x.write((this->*special_reg).read());
 
-            if (toggle_mode)
-            {
-                mode_.write(mode_.read() ^ 1);
-            }
-        };
+        if (toggle_mode)
+        {
+            mode_.write(mode_.read() ^ 1);
+        }
     }
 
     /// @tparam load_imm
-    /// @tparam register_type_t
-    /// @param special_reg
-    template <bool load_imm, typename register_type_t>
-    Operation op_special_reg_write(register_t<register_type_t> &special_reg)
+    /// @tparam special_reg Pointer to the special register member to write.
+    template <bool load_imm, auto special_reg> void op_special_reg_write()
     {
-        return [&]() {
-            if (is_user_mode())
-            {
-                interrupt_.signal(ILL_INST);
-                return;
-            }
+        if (is_user_mode())
+        {
+            interrupt_.signal(ILL_INST);
+            return;
+        }
 
-            if (load_imm)
-            {
-                load_inst_word(register_file_.get(IMM));
+        if (load_imm)
+        {
+            load_imm_word();
 
-                if (interrupt_.is_signalled({PG_FAULT}))
-                {
-                    return;
-                }
+            if (interrupt_.is_signalled(signal_mask(PG_FAULT)))
+            {
+                return;
             }
+        }
 
-            const uint16_t inst_word = inst_.read();
-            const uint16_t y = register_file_.get(REG_SEL_Y(inst_word)).read();
-            const uint16_t z = register_file_.get(REG_SEL_Z(inst_word)).read();
+        const uint16_t y = register_file_.get(decoded_inst_.y).read();
+        const uint16_t z = register_file_.get(decoded_inst_.z).read();
 
-            const uint16_t value = y + z;
+        const uint16_t value = y + z;
 
-            special_reg.write(value);
-        };
+        (this->*special_reg).write(value);
     }
 
     /// @tparam alu_sel
@@ -200,7 +665,7 @@ struct cpu_state_t
     {
         const bool user_mode = is_user_mode();
 
-        LOG(INFO) << "op_alu";
+        TRACE << "op_alu";
 
         if (user_mode && toggle_mode)
         {
@@ -210,9 +675,10 @@ struct cpu_state_t
 
         if (load_imm)
         {
-            load_inst_word(register_file_.get(IMM));
+            load_imm_word();
 
-            if (user_mode && interrupt_.is_signalled({PG_FAULT}))
+            if (user_mode &&
+                interrupt_.is_signalled(signal_mask(PG_FAULT)))
             {
                 return;
             }
@@ -224,12 +690,10 @@ struct cpu_state_t
             return;
         }
 
-        const uint16_t inst_word = inst_.read();
-
-        const uint16_t y = register_file_.get(REG_SEL_Y(inst_word)).read();
-        const uint16_t z = register_file_.get(REG_SEL_Z(inst_word)).read();
+        const uint16_t y = register_file_.get(decoded_inst_.y).read();
+        const uint16_t z = register_file_.get(decoded_inst_.z).read();
 
-        register_t<uint16_t> &reg_x = register_file_.get(REG_SEL_X(inst_word));
+        register_t<uint16_t> &reg_x = register_file_.get(decoded_inst_.x);
 
         uint16_t x = 0;
 
@@ -290,10 +754,9 @@ struct cpu_state_t
     {
         const bool user_mode = is_user_mode();
 
-        LOG(INFO) << "mem data byte=" << byte << " mode=" << inst_mode
-                  << " data=" << is_data << " store=" << is_store
-                  << " imm=" << load_imm << " extend=" << sign_extend_byte
-                  << "\n";
+        TRACE << "mem data byte=" << byte << " mode=" << inst_mode << " data="
+              << is_data << " store=" << is_store << " imm=" << load_imm
+              << " extend=" << sign_extend_byte << "\n";
 
         if (user_mode && !inst_mode)
         {
@@ -303,15 +766,13 @@ struct cpu_state_t
 
         if (load_imm)
         {
-            load_inst_word(register_file_.get(IMM));
+            load_imm_word();
         }
 
-        const uint16_t inst_word = inst_.read();
+        register_t<uint16_t> &reg_x = register_file_.get(decoded_inst_.x);
 
-        register_t<uint16_t> &reg_x = register_file_.get(REG_SEL_X(inst_word));
-
-        const uint16_t y = register_file_.get(REG_SEL_Y(inst_word)).read();
-        const uint16_t z = register_file_.get(REG_SEL_Z(inst_word)).read();
+        const uint16_t y = register_file_.get(decoded_inst_.y).read();
+        const uint16_t z = register_file_.get(decoded_inst_.z).read();
 
         mmu_.reset_fault();
 
@@ -321,7 +782,7 @@ struct cpu_state_t
                                      interrupt_)
                       : virt_addr;
 
-        if (interrupt_.is_signalled({PG_FAULT, RO_FAULT}))
+        if (interrupt_.is_signalled(signal_mask(PG_FAULT, RO_FAULT)))
         {
             return;
         }
@@ -329,13 +790,46 @@ struct cpu_state_t
         memory_t &memory =
             is_data ? mmio_.get_data(inst_mode) : mmio_.get_code(inst_mode);
 
+        const uint16_t value =
+            is_store ? reg_x.read() : memory.load(phys_addr, byte);
+
         if (is_store)
         {
-            memory.store(phys_addr, reg_x.read(), byte);
+            memory.store(phys_addr, value, byte);
+
+            if (!is_data)
+            {
+                decode_cache(inst_mode).invalidate(phys_addr);
+                block_cache_.invalidate_code(inst_mode, phys_addr);
+
+                // The caches are still current unless another cpu stored to
+                // code memory since they were last flushed.
+                const uint64_t generation = mmio_.code_stored();
+
+                if (generation == code_generation_ + 1)
+                {
+                    code_generation_ = generation;
+                }
+            }
         }
         else
         {
-            reg_x.write(memory.load(phys_addr, byte));
+            reg_x.write(value);
+        }
+
+        if (COUNTERS_ENABLED)
+        {
+            counters_.memory_accesses[MEMORY_REGION(inst_mode, is_data)]
+                                     [is_store]++;
+        }
+
+        if (recorder_)
+        {
+            trace_mem_access(is_store,
+                             (inst_mode ? TRACE_FLAG_USER : 0) |
+                                 (byte ? TRACE_FLAG_BYTE : 0) |
+                                 (is_data ? 0 : TRACE_FLAG_CODE),
+                             phys_addr, value);
         }
     }
 };
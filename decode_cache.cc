@@ -0,0 +1,67 @@
+#include "decode_cache.h"
+
+namespace mpce
+{
+
+using namespace std;
+
+/// @param code
+/// @param decode
+decode_cache_t::decode_cache_t(const memory_t &code, const Decoder decode)
+    : code_(code), decoder_(decode),
+      pages_(DECODE_PAGE_NUM(code.capacity() + DECODE_PAGE_SIZE - 1))
+{
+}
+
+/// @param phys_addr
+void decode_cache_t::invalidate(const uint32_t phys_addr)
+{
+    invalidate_entry(phys_addr);
+
+    // The previous word may hold a copy of this word as its immediate.
+    if (DECODE_PAGE_OFFSET(phys_addr))
+    {
+        invalidate_entry(phys_addr - 1);
+    }
+}
+
+void decode_cache_t::flush()
+{
+    for (unique_ptr<decoded_page_t> &page : pages_)
+    {
+        page.reset();
+    }
+}
+
+/// @param entry
+/// @param phys_addr
+void decode_cache_t::decode(decoded_inst_t &entry, const uint32_t phys_addr)
+{
+    entry = decoder_(code_.load(phys_addr));
+
+    const uint32_t imm_addr = phys_addr + 1;
+
+    if (DECODE_PAGE_OFFSET(imm_addr) && imm_addr < code_.capacity())
+    {
+        entry.imm = code_.load(imm_addr);
+        entry.has_imm = true;
+    }
+}
+
+/// @param phys_addr
+void decode_cache_t::invalidate_entry(const uint32_t phys_addr)
+{
+    if (phys_addr >= code_.capacity())
+    {
+        return;
+    }
+
+    unique_ptr<decoded_page_t> &page = pages_[DECODE_PAGE_NUM(phys_addr)];
+
+    if (page)
+    {
+        (*page)[DECODE_PAGE_OFFSET(phys_addr)].handler = nullptr;
+    }
+}
+
+}; // namespace mpce
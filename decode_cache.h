@@ -0,0 +1,107 @@
+#pragma once
+
+#include "memory.h"
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#define DECODE_PAGE_SIZE 0x200
+#define DECODE_PAGE_NUM(a) ((a) >> 9)
+#define DECODE_PAGE_OFFSET(a) ((a)&0x01ff)
+
+namespace mpce
+{
+
+using namespace std;
+
+struct cpu_state_t;
+
+/// An instruction word with its operands split out and its opcode handler
+/// resolved.
+struct decoded_inst_t
+{
+    /// Opcode handler. A null handler marks an empty cache entry.
+    void (*handler)(cpu_state_t &) = nullptr;
+
+    /// The raw instruction word.
+    uint16_t word = 0;
+
+    /// The word following the instruction, used when it loads an immediate.
+    uint16_t imm = 0;
+
+    /// Register file indices selected by the instruction.
+    uint8_t x = 0;
+    uint8_t y = 0;
+    uint8_t z = 0;
+
+    /// Whether imm is valid. It is only cached when the following word is in
+    /// the same page, so the immediate fetch cannot fault or map elsewhere.
+    bool has_imm = false;
+};
+
+/// Lazily filled cache of decoded instructions for one code memory, indexed by
+/// physical address and allocated one page at a time.
+class decode_cache_t
+{
+  public:
+    using Decoder = decoded_inst_t (*)(const uint16_t);
+
+    /// @param code The code memory that backs this cache.
+    /// @param decode Decodes an instruction word, leaving has_imm unset.
+    decode_cache_t(const memory_t &code, const Decoder decode);
+
+    /// @param phys_addr
+    /// @returns The decoded instruction at phys_addr, decoding it on first
+    /// use, or nullptr if phys_addr is outside of the code memory.
+    const decoded_inst_t *fetch(const uint32_t phys_addr)
+    {
+        if (phys_addr >= code_.capacity())
+        {
+            return nullptr;
+        }
+
+        unique_ptr<decoded_page_t> &page = pages_[DECODE_PAGE_NUM(phys_addr)];
+
+        if (!page)
+        {
+            page = make_unique<decoded_page_t>();
+        }
+
+        decoded_inst_t &entry = (*page)[DECODE_PAGE_OFFSET(phys_addr)];
+
+        if (!entry.handler)
+        {
+            decode(entry, phys_addr);
+        }
+
+        return &entry;
+    }
+
+    /// Drop the cached entries that depend on the word at phys_addr. Must be
+    /// called for every store into the code memory.
+    /// @param phys_addr
+    void invalidate(const uint32_t phys_addr);
+
+    /// Drop all cached entries.
+    void flush();
+
+  private:
+    using decoded_page_t = array<decoded_inst_t, DECODE_PAGE_SIZE>;
+
+    /// @param entry
+    /// @param phys_addr
+    void decode(decoded_inst_t &entry, const uint32_t phys_addr);
+
+    /// @param phys_addr
+    void invalidate_entry(const uint32_t phys_addr);
+
+    const memory_t &code_;
+
+    const Decoder decoder_;
+
+    vector<unique_ptr<decoded_page_t>> pages_;
+};
+
+} // namespace mpce
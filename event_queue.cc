@@ -0,0 +1,66 @@
+#include "event_queue.h"
+
+#include <algorithm>
+#include <utility>
+
+namespace mpce
+{
+
+using namespace std;
+
+/// @param cycle
+/// @param handler
+uint64_t event_queue_t::schedule(const uint64_t cycle,
+                                 function<void()> handler)
+{
+    const uint64_t id = next_id_++;
+
+    queue_.push({cycle, id});
+    handlers_.emplace(id, move(handler));
+    next_cycle_ = min(next_cycle_, cycle);
+
+    return id;
+}
+
+/// @param id
+void event_queue_t::cancel(const uint64_t id)
+{
+    if (handlers_.erase(id))
+    {
+        update_next_cycle();
+    }
+}
+
+/// @param cycle
+void event_queue_t::run_due(const uint64_t cycle)
+{
+    while (!queue_.empty() && queue_.top().cycle <= cycle)
+    {
+        const auto handler = handlers_.find(queue_.top().id);
+        queue_.pop();
+
+        if (handler == handlers_.end())
+        {
+            continue;
+        }
+
+        // The handler may schedule events, which can rehash handlers_.
+        function<void()> run = move(handler->second);
+        handlers_.erase(handler);
+        run();
+    }
+
+    update_next_cycle();
+}
+
+void event_queue_t::update_next_cycle()
+{
+    while (!queue_.empty() && !handlers_.count(queue_.top().id))
+    {
+        queue_.pop();
+    }
+
+    next_cycle_ = queue_.empty() ? UINT64_MAX : queue_.top().cycle;
+}
+
+}; // namespace mpce
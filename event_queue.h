@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <queue>
+#include <unordered_map>
+#include <vector>
+
+namespace mpce
+{
+
+using namespace std;
+
+/// Timed events of one cpu, such as its timer expiring, kept in a min-heap
+/// keyed on the instruction count at which they are due. The run loop only
+/// compares the instruction count against next_cycle, and executes blocks
+/// straight up to it.
+class event_queue_t
+{
+  private:
+    struct event_t
+    {
+        uint64_t cycle;
+        uint64_t id;
+
+        bool operator>(const event_t &other) const
+        {
+            return cycle != other.cycle ? cycle > other.cycle : id > other.id;
+        }
+    };
+
+    priority_queue<event_t, vector<event_t>, greater<event_t>> queue_;
+
+    /// Handlers of events not yet run or cancelled, by id. Cancelled events
+    /// stay in queue_ until they reach the top.
+    unordered_map<uint64_t, function<void()>> handlers_;
+
+    uint64_t next_id_ = 1;
+
+    /// Cycle of the earliest event, UINT64_MAX if there is none.
+    uint64_t next_cycle_ = UINT64_MAX;
+
+  public:
+    /// Run handler once the instruction count reaches cycle. Events due at
+    /// the same cycle run in the order they were scheduled.
+    /// @param cycle
+    /// @param handler May schedule and cancel events.
+    /// @returns An id for cancel, never 0.
+    uint64_t schedule(const uint64_t cycle, function<void()> handler);
+
+    /// Drop an event that has not run yet. Ids of events that already ran,
+    /// and 0, are ignored.
+    /// @param id
+    void cancel(const uint64_t id);
+
+    /// @returns The instruction count at which the earliest event is due,
+    /// UINT64_MAX if there is none.
+    uint64_t next_cycle() const
+    {
+        return next_cycle_;
+    }
+
+    /// Run the handlers of all events due at or before cycle.
+    /// @param cycle
+    void run_due(const uint64_t cycle);
+
+  private:
+    /// Drop cancelled events from the top of queue_ and update next_cycle_.
+    void update_next_cycle();
+};
+
+} // namespace mpce
@@ -0,0 +1,224 @@
+#include "farm.h"
+#include "cpu_state.h"
+#include "validator.h"
+
+#include <algorithm>
+#include <chrono>
+#include <exception>
+#include <memory>
+#include <optional>
+#include <sstream>
+
+namespace mpce
+{
+
+using namespace std;
+
+/// @param threads
+farm_t::farm_t(const uint32_t threads)
+    : threads_(max(threads, 1u)), queues_(threads_), stats_()
+{
+}
+
+/// @param jobs
+vector<farm_result_t> farm_t::run(const vector<farm_job_t> &jobs)
+{
+    const auto begin = chrono::steady_clock::now();
+
+    vector<farm_result_t> results(jobs.size());
+
+    stats_ = farm_stats_t();
+    stats_.jobs.resize(threads_);
+    stats_.steals.resize(threads_);
+
+    for (size_t i = 0; i < jobs.size(); i++)
+    {
+        queues_[i % threads_].jobs.push_back(i);
+    }
+
+    vector<thread> workers;
+
+    for (uint32_t worker = 0; worker < threads_; worker++)
+    {
+        workers.emplace_back(&farm_t::work, this, worker, cref(jobs),
+                             ref(results));
+    }
+
+    for (thread &worker : workers)
+    {
+        worker.join();
+    }
+
+    for (const farm_result_t &result : results)
+    {
+        stats_.cycles += result.cycles;
+    }
+
+    stats_.seconds =
+        chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+
+    return results;
+}
+
+/// @returns
+const farm_stats_t &farm_t::stats() const
+{
+    return stats_;
+}
+
+/// @param job
+farm_result_t farm_t::run_job(const farm_job_t &job)
+{
+    if (job.validate)
+    {
+        return validate_job(job);
+    }
+
+    const auto begin = chrono::steady_clock::now();
+
+    farm_result_t result;
+
+    // Instances are large, keep them off the worker stacks.
+    unique_ptr<cpu_state_t> cpu = make_unique<cpu_state_t>();
+    io_serial_interface_t &serial = cpu->mmio().serial_interface();
+
+    if (!cpu->load_image(job.image))
+    {
+        result.error = "cannot load image " + job.image;
+    }
+    else
+    {
+        try
+        {
+            size_t input_queued = 0;
+
+            while (result.cycles < job.max_cycles)
+            {
+                input_queued += serial.queue_input(
+                    reinterpret_cast<const uint8_t *>(job.input.data()) +
+                        input_queued,
+                    job.input.size() - input_queued);
+
+                result.cycles += cpu->run(
+                    min<uint64_t>(FARM_SLICE_CYCLES,
+                                  job.max_cycles - result.cycles));
+
+                serial.take_output(result.output);
+            }
+
+            result.ok = true;
+        }
+        catch (const exception &e)
+        {
+            result.error = e.what();
+        }
+
+        result.cycles = cpu->cycle_count();
+        serial.take_output(result.output);
+    }
+
+    result.seconds =
+        chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+
+    return result;
+}
+
+/// @param job
+farm_result_t farm_t::validate_job(const farm_job_t &job)
+{
+    const auto begin = chrono::steady_clock::now();
+
+    farm_result_t result;
+    validator_t validator;
+
+    if (!validator.load_image(job.image))
+    {
+        result.error = "cannot load image " + job.image;
+    }
+    else
+    {
+        try
+        {
+            validator.set_input(job.input);
+
+            const optional<validator_divergence_t> divergence =
+                validator.run(job.max_cycles);
+
+            if (divergence)
+            {
+                ostringstream report;
+                divergence->write(report);
+                result.error = report.str();
+            }
+            else
+            {
+                result.ok = true;
+            }
+        }
+        catch (const exception &e)
+        {
+            result.error = e.what();
+        }
+
+        result.cycles = validator.fast().cycle_count();
+        result.output = validator.output();
+    }
+
+    result.seconds =
+        chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+
+    return result;
+}
+
+/// @param worker
+/// @param jobs
+/// @param results
+void farm_t::work(const uint32_t worker, const vector<farm_job_t> &jobs,
+                  vector<farm_result_t> &results)
+{
+    size_t job_index;
+
+    while (take_job(worker, job_index))
+    {
+        results[job_index] = run_job(jobs[job_index]);
+        results[job_index].worker = worker;
+        stats_.jobs[worker]++;
+    }
+}
+
+/// @param worker
+/// @param job_index
+bool farm_t::take_job(const uint32_t worker, size_t &job_index)
+{
+    {
+        worker_queue_t &queue = queues_[worker];
+        lock_guard<mutex> guard(queue.lock);
+
+        if (!queue.jobs.empty())
+        {
+            job_index = queue.jobs.back();
+            queue.jobs.pop_back();
+            return true;
+        }
+    }
+
+    // No job is ever added during a run, so once every queue was seen empty
+    // the worker is done.
+    for (uint32_t i = 1; i < threads_; i++)
+    {
+        worker_queue_t &victim = queues_[(worker + i) % threads_];
+        lock_guard<mutex> guard(victim.lock);
+
+        if (!victim.jobs.empty())
+        {
+            job_index = victim.jobs.front();
+            victim.jobs.pop_front();
+            stats_.steals[worker]++;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+}; // namespace mpce
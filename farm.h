@@ -0,0 +1,137 @@
+#pragma once
+
+#include "io_serial.h"
+
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/// Cycles run between draining the console output of a job, so that its
+/// output buffer never overflows.
+#define FARM_SLICE_CYCLES SERIAL_OUT_RING_SIZE
+
+namespace mpce
+{
+
+using namespace std;
+
+/// One guest program to run in a farm_t.
+struct farm_job_t
+{
+    /// Guest image file, see cpu_state_t::load_image.
+    string image;
+
+    /// Console input, fed as the guest reads it.
+    string input;
+
+    /// Instructions to execute.
+    uint64_t max_cycles = 0;
+
+    /// Run on a validator_t instead, failing at the first divergence between
+    /// the fast engine and the reference interpreter.
+    bool validate = false;
+};
+
+struct farm_result_t
+{
+    /// False if the image could not be loaded, the guest raised an exception
+    /// in the emulator or validation found a divergence, described by
+    /// error.
+    bool ok = false;
+
+    string error;
+
+    /// Instructions executed.
+    uint64_t cycles = 0;
+
+    /// Console output.
+    string output;
+
+    /// Wall time of the job.
+    double seconds = 0;
+
+    /// Index of the worker thread that ran the job.
+    uint32_t worker = 0;
+};
+
+struct farm_stats_t
+{
+    /// Jobs run by each worker.
+    vector<uint64_t> jobs;
+
+    /// Jobs each worker took from the queue of another worker.
+    vector<uint64_t> steals;
+
+    /// Instructions executed by all jobs.
+    uint64_t cycles = 0;
+
+    /// Wall time of the batch.
+    double seconds = 0;
+};
+
+/// Runs batches of independent guests in parallel, each on its own
+/// cpu_state_t. Jobs are dealt to per-worker queues up front; a worker takes
+/// jobs from the back of its own queue and, once that is empty, steals from
+/// the front of the others, so uneven job lengths still keep every worker
+/// busy. Workers share nothing but the queues.
+class farm_t
+{
+  private:
+    struct worker_queue_t
+    {
+        mutex lock;
+
+        /// Indices of jobs not yet taken.
+        deque<size_t> jobs;
+    };
+
+    uint32_t threads_;
+
+    vector<worker_queue_t> queues_;
+
+    farm_stats_t stats_;
+
+  public:
+    /// @param threads Worker threads, at least 1.
+    explicit farm_t(const uint32_t threads = thread::hardware_concurrency());
+
+    farm_t(const farm_t &) = delete;
+
+    farm_t &operator=(const farm_t &) = delete;
+
+    /// Run all jobs and wait for them.
+    /// @param jobs
+    /// @returns One result per job, in the order of jobs.
+    vector<farm_result_t> run(const vector<farm_job_t> &jobs);
+
+    /// @returns Statistics of the last run.
+    const farm_stats_t &stats() const;
+
+    /// Run a single job on the calling thread.
+    /// @param job
+    /// @returns
+    static farm_result_t run_job(const farm_job_t &job);
+
+  private:
+    /// run_job of a job to validate.
+    /// @param job
+    /// @returns
+    static farm_result_t validate_job(const farm_job_t &job);
+
+    /// Take jobs until all queues are empty.
+    /// @param worker
+    /// @param jobs
+    /// @param results
+    void work(const uint32_t worker, const vector<farm_job_t> &jobs,
+              vector<farm_result_t> &results);
+
+    /// @param worker
+    /// @param job_index Set to the taken job.
+    /// @returns False if all queues are empty.
+    bool take_job(const uint32_t worker, size_t &job_index);
+};
+
+} // namespace mpce
@@ -0,0 +1,96 @@
+#include "farm.h"
+
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+using namespace std;
+
+DEFINE_uint64(cycles, 1'000'000, "Instructions to execute per image.");
+DEFINE_uint32(threads, 0, "Worker threads, 0 for one per core.");
+DEFINE_string(input, "", "File fed to the console input of every image.");
+DEFINE_bool(print_output, false, "Print the console output of every image.");
+DEFINE_bool(validate, false,
+            "Run every image on the fast engine and the reference "
+            "interpreter side by side, comparing them at every block "
+            "boundary, and fail it at the first divergence.");
+
+int main(int argc, char *argv[])
+{
+    gflags::SetUsageMessage("mpce_farm [flags] <image>...");
+    gflags::ParseCommandLineFlags(&argc, &argv, true);
+    google::InitGoogleLogging(argv[0]);
+
+    FLAGS_logtostderr = 1;
+
+    if (argc < 2)
+    {
+        gflags::ShowUsageWithFlags(argv[0]);
+        return 2;
+    }
+
+    string input;
+
+    if (!FLAGS_input.empty())
+    {
+        ifstream file(FLAGS_input, ios::binary);
+
+        if (!file)
+        {
+            fprintf(stderr, "cannot open %s\n", FLAGS_input.c_str());
+            return 1;
+        }
+
+        input.assign(istreambuf_iterator<char>(file),
+                     istreambuf_iterator<char>());
+    }
+
+    vector<mpce::farm_job_t> jobs;
+
+    for (int i = 1; i < argc; i++)
+    {
+        jobs.push_back({argv[i], input, FLAGS_cycles, FLAGS_validate});
+    }
+
+    mpce::farm_t farm(FLAGS_threads ? FLAGS_threads
+                                    : thread::hardware_concurrency());
+
+    const vector<mpce::farm_result_t> results = farm.run(jobs);
+    int failed = 0;
+
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const mpce::farm_result_t &result = results[i];
+
+        printf("%s: %s cycles=%lu output=%zu seconds=%.3f worker=%u\n",
+               jobs[i].image.c_str(),
+               result.ok ? "ok" : result.error.c_str(), result.cycles,
+               result.output.size(), result.seconds, result.worker);
+
+        if (FLAGS_print_output)
+        {
+            fwrite(result.output.data(), 1, result.output.size(), stdout);
+        }
+
+        failed += !result.ok;
+    }
+
+    const mpce::farm_stats_t &stats = farm.stats();
+
+    printf("%zu images, %lu instructions in %.3f s, %.1f MIPS\n",
+           results.size(), stats.cycles, stats.seconds,
+           stats.cycles / stats.seconds / 1e6);
+
+    for (size_t worker = 0; worker < stats.jobs.size(); worker++)
+    {
+        printf("worker %zu: %lu jobs, %lu stolen\n", worker,
+               stats.jobs[worker], stats.steals[worker]);
+    }
+
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,100 @@
+#include "image.h"
+
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <glog/logging.h>
+
+namespace mpce
+{
+
+using namespace std;
+
+image_t::~image_t()
+{
+    if (fd_ >= 0)
+    {
+        close(fd_);
+    }
+}
+
+/// @param path
+bool image_t::open(const string &path)
+{
+    fd_ = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+    if (fd_ < 0)
+    {
+        LOG(WARNING) << "image: cannot open " << path;
+        return false;
+    }
+
+    if (pread(fd_, &header_, sizeof(header_), 0) != sizeof(header_) ||
+        strncmp(header_.magic, IMAGE_FILE_MAGIC, sizeof(header_.magic)) ||
+        header_.version != IMAGE_FILE_VERSION ||
+        header_.section_count > IMAGE_MAX_SECTIONS)
+    {
+        LOG(WARNING) << "image: " << path << " is not a version "
+                     << IMAGE_FILE_VERSION << " image";
+        return false;
+    }
+
+    sections_.resize(header_.section_count);
+
+    const ssize_t table_size = sections_.size() * sizeof(image_section_t);
+
+    if (pread(fd_, sections_.data(), table_size, sizeof(header_)) !=
+        table_size)
+    {
+        LOG(WARNING) << "image: " << path << " has a truncated section table";
+        return false;
+    }
+
+    struct stat file_stat;
+
+    if (fstat(fd_, &file_stat) < 0)
+    {
+        LOG(WARNING) << "image: cannot stat " << path;
+        return false;
+    }
+
+    // Mapped pages past the end of the file fault with SIGBUS on first
+    // touch, so sections must lie within it.
+    const uint64_t file_size = file_stat.st_size;
+
+    for (const image_section_t &section : sections_)
+    {
+        if (section.words > file_size / sizeof(uint16_t) ||
+            section.file_offset > file_size - section.words * sizeof(uint16_t))
+        {
+            LOG(WARNING) << "image: " << path
+                         << " has a section past the end of the file";
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/// @returns
+int image_t::fd() const
+{
+    return fd_;
+}
+
+/// @returns
+uint16_t image_t::entry_pc() const
+{
+    return header_.entry_pc;
+}
+
+/// @returns
+const vector<image_section_t> &image_t::sections() const
+{
+    return sections_;
+}
+
+}; // namespace mpce
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#define IMAGE_FILE_MAGIC "MPCEIMG"
+#define IMAGE_FILE_VERSION 1
+#define IMAGE_MAX_SECTIONS 0x100
+
+namespace mpce
+{
+
+using namespace std;
+
+/// The memory an image section is loaded into.
+enum image_section_kind_t : uint32_t
+{
+    IMAGE_KERN_CODE,
+    IMAGE_KERN_DATA,
+    IMAGE_USER_CODE,
+    IMAGE_USER_DATA,
+    IMAGE_PAGE_TABLE_CODE,
+    IMAGE_PAGE_TABLE_DATA
+};
+
+/// Start of a guest image file. It is followed by section_count
+/// image_section_t entries; section contents are at their file offsets. All
+/// fields and words are little-endian.
+struct image_header_t
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t section_count;
+
+    /// PC to start executing at, in kernel mode.
+    uint16_t entry_pc;
+    uint16_t reserved[3];
+};
+
+static_assert(sizeof(image_header_t) == 24);
+
+struct image_section_t
+{
+    image_section_kind_t kind;
+
+    /// First word of the memory to load, a word address even for the byte
+    /// addressible data memories.
+    uint32_t load_addr;
+
+    /// Words in the section.
+    uint64_t words;
+
+    /// Position of the section contents in the file, in bytes. Sections are
+    /// loaded without copying when both load_addr and file_offset are host
+    /// page aligned, i.e. multiples of 2048 words and 4096 bytes.
+    uint64_t file_offset;
+};
+
+static_assert(sizeof(image_section_t) == 24);
+
+/// An open guest image file. See cpu_state_t::load_image.
+class image_t
+{
+  private:
+    int fd_ = -1;
+
+    image_header_t header_ = {};
+
+    vector<image_section_t> sections_;
+
+  public:
+    image_t() = default;
+
+    ~image_t();
+
+    image_t(const image_t &) = delete;
+
+    image_t &operator=(const image_t &) = delete;
+
+    /// Open path and read its header and section table.
+    /// @param path
+    /// @returns False if path cannot be read or is not an image.
+    bool open(const string &path);
+
+    /// @returns The image file, to map section contents from.
+    int fd() const;
+
+    /// @returns
+    uint16_t entry_pc() const;
+
+    /// @returns
+    const vector<image_section_t> &sections() const;
+};
+
+} // namespace mpce
@@ -1,98 +1,51 @@
 #include "interrupt.h"
 
-#pragma once
-
-#include <cstdint>
-#include <mutex>
-#include <unordered_set>
-#include <vector>
+#include <array>
 
 namespace mpce
 {
 
 using namespace std;
 
-uint8_t interrupt_t::cause()
-{
-    uint8_t status_byte = 0;
-
-    scoped_lock<mutex> lock(mutex_);
-
-    set_bit_if_signalled(status_byte, 0, IRQ0);
-    set_bit_if_signalled(status_byte, 1, IRQ1);
-    set_bit_if_signalled(status_byte, 2, IRQ2);
-    set_bit_if_signalled(status_byte, 3, IRQ3);
-
-    set_signal_priority(status_byte);
-
-    return status_byte;
-}
-
-void interrupt_t::signal(const interrupt_signal_t signal)
+namespace
 {
-    scoped_lock<mutex> lock(mutex_);
-
-    pending_interrupts_.insert(signal);
-}
 
-/// @brief
-/// @param signals
-/// @return
-bool interrupt_t::is_signalled(const vector<interrupt_signal_t> signals)
+/// @returns cause for every combination of pending signals.
+constexpr array<uint8_t, 0x100> make_cause_table()
 {
-    scoped_lock<mutex> lock(mutex_);
+    array<uint8_t, 0x100> table = {};
 
-    for (const interrupt_signal_t signal : signals)
+    for (uint32_t pending = 0; pending < table.size(); pending++)
     {
-        if (pending_interrupts_.count(signal))
+        uint8_t priority = 0;
+        uint8_t i = 1;
+
+        // Later signals take priority.
+        for (const interrupt_signal_t signal :
+             {TIME_OUT, RO_FAULT, PG_FAULT, ILL_INST})
         {
-            return true;
+            if (pending & signal_mask(signal))
+            {
+                priority = i;
+            }
+
+            i++;
         }
+
+        table[pending] =
+            (pending & signal_mask(IRQ0, IRQ1, IRQ2, IRQ3)) | priority << 4;
     }
 
-    return false;
+    return table;
 }
 
-/// @brief
-void interrupt_t::clear()
-{
-    scoped_lock<mutex> lock(mutex_);
+constexpr array<uint8_t, 0x100> CAUSE_TABLE = make_cause_table();
 
-    pending_interrupts_.clear();
-}
+} // namespace
 
-/// @brief
-/// @param byte
-/// @param bit
-/// @param signal
-void interrupt_t::set_bit_if_signalled(uint8_t &byte, const uint8_t bit,
-                                     const interrupt_signal_t signal) const
+uint8_t interrupt_t::cause() const
 {
-    if (pending_interrupts_.count(signal))
-    {
-        byte |= 1 << bit;
-    }
-}
-
-/// @brief
-/// @param byte
-void interrupt_t::set_signal_priority(uint8_t &byte) const
-{
-    uint8_t priority = 0;
-    uint8_t i = 1;
-
-    for (const interrupt_signal_t signal :
-         {TIME_OUT, RO_FAULT, PG_FAULT, ILL_INST})
-    {
-        if (pending_interrupts_.count(signal))
-        {
-            priority = i;
-        }
-
-        i++;
-    }
-
-    byte |= priority << 4;
+    return CAUSE_TABLE[pending_.load(memory_order_acquire)];
 }
 
-}; // namespace mpce
\ No newline at end of file
+}; // namespace mpce
@@ -1,9 +1,7 @@
 #pragma once
 
+#include <atomic>
 #include <cstdint>
-#include <mutex>
-#include <unordered_set>
-#include <vector>
 
 namespace mpce
 {
@@ -22,40 +20,81 @@ enum interrupt_signal_t
     ILL_INST
 };
 
+/// @param signal
+/// @returns The bit of signal in a signal mask.
+constexpr uint8_t signal_mask(const interrupt_signal_t signal)
+{
+    return static_cast<uint8_t>(1 << signal);
+}
+
+/// @param signal
+/// @param signals
+/// @returns A signal mask with the bits of all given signals.
+template <typename... signals_t>
+constexpr uint8_t signal_mask(const interrupt_signal_t signal,
+                              const signals_t... signals)
+{
+    return signal_mask(signal) | signal_mask(signals...);
+}
+
+/// Signals that a device or the timer requests.
+constexpr uint8_t IRQ_SIGNALS = signal_mask(IRQ0, IRQ1, IRQ2, IRQ3, TIME_OUT);
+
+/// Every signal.
+constexpr uint8_t ALL_SIGNALS = 0xff;
+
+/// Pending interrupt signals as a bit mask, one bit per interrupt_signal_t.
+/// Any thread may raise a signal without locking.
 class interrupt_t
 {
   public:
     /// @brief
-    /// @return
-    uint8_t cause();
+    /// @return The cause register encoding of the pending signals: IRQ0 to
+    /// IRQ3 in bits 0 to 3, and the highest priority of TIME_OUT, RO_FAULT,
+    /// PG_FAULT and ILL_INST as 1 to 4 in bits 4 to 6.
+    uint8_t cause() const;
 
-    void signal(const interrupt_signal_t signal);
+    void signal(const interrupt_signal_t signal)
+    {
+        pending_.fetch_or(signal_mask(signal), memory_order_release);
+    }
 
     /// @brief
-    /// @param signals
-    /// @return
-    bool is_signalled(const vector<interrupt_signal_t> signals);
+    /// @param signals A signal mask.
+    /// @return True if any of signals is pending.
+    bool is_signalled(const uint8_t signals) const
+    {
+        return pending_.load(memory_order_acquire) & signals;
+    }
 
-    /// @brief
-    void clear();
+    /// @return True if any signal is pending.
+    bool pending() const
+    {
+        return pending_.load(memory_order_acquire);
+    }
 
-  private:
     /// @brief
-    /// @param byte
-    /// @param bit
-    /// @param signal
-    void set_bit_if_signalled(uint8_t &byte, const uint8_t bit,
-                              const interrupt_signal_t signal) const;
+    void clear()
+    {
+        pending_.store(0, memory_order_release);
+    }
 
-    /// @brief
-    /// @param byte
-    void set_signal_priority(uint8_t &byte) const;
+    /// @return The signal mask of all pending signals.
+    uint8_t pending_signals() const
+    {
+        return pending_.load(memory_order_acquire);
+    }
 
-    /// @brief
-    unordered_set<interrupt_signal_t> pending_interrupts_;
+    /// Replace all pending signals.
+    /// @param signals A signal mask.
+    void set_pending_signals(const uint8_t signals)
+    {
+        pending_.store(signals, memory_order_release);
+    }
 
+  private:
     /// @brief
-    mutex mutex_;
+    atomic<uint8_t> pending_{0};
 };
 
-} // namespace mpce
\ No newline at end of file
+} // namespace mpce
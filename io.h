@@ -1,22 +1,114 @@
 #pragma once
 
 #include "interrupt.h"
-#include "io_serial.h"
-#include "memory.h"
 
-#include <functional>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
 
 namespace mpce
 {
 
+using namespace std;
+
+/// Lets a cpu sleep until a device raises an event. Events are counted, so
+/// that one raised between sampling count and calling wait is not missed.
+class device_waiter_t
+{
+  private:
+    mutex lock_;
+
+    condition_variable raised_;
+
+    /// Modified under lock_.
+    atomic<uint64_t> count_{0};
+
+  public:
+    /// @returns The number of events raised so far.
+    uint64_t count() const
+    {
+        return count_.load(memory_order_acquire);
+    }
+
+    /// Count an event and wake all waiting cpus. Safe to call from any
+    /// thread.
+    void notify()
+    {
+        {
+            lock_guard<mutex> guard(lock_);
+            count_.fetch_add(1, memory_order_release);
+        }
+
+        raised_.notify_all();
+    }
+
+    /// Block until an event is raised after count returned seen.
+    /// @param seen
+    /// @param timeout
+    /// @returns False if timeout passed first.
+    bool wait(const uint64_t seen, const chrono::nanoseconds timeout)
+    {
+        unique_lock<mutex> guard(lock_);
+
+        return raised_.wait_for(guard, timeout,
+                                [&] { return count() != seen; });
+    }
+};
+
+/// A device on an io_bus_t. Its registers are accessed through the member
+/// handlers it maps on the bus; the virtual members are only called when
+/// the cpu polls for interrupt requests.
 class io_interface_t
 {
   public:
-    virtual uint16_t mmio_read() = 0;
+    virtual ~io_interface_t() = default;
+
+    /// @returns Whether the interrupt request line of the device is raised.
+    virtual bool irq_requested() const
+    {
+        return false;
+    }
+
+    /// Consume the device event flag. The cpu only polls a device for
+    /// interrupt requests after it has raised an event.
+    /// @returns True if the device state changed since the last call.
+    bool take_event()
+    {
+        return event_.exchange(false, memory_order_acq_rel);
+    }
+
+    /// @returns Whether the device can change state while the cpu does not
+    /// access it, such as a console thread queueing input.
+    virtual bool may_raise_event() const
+    {
+        return false;
+    }
+
+    /// Also notify waiter of every event raised from now on.
+    /// @param waiter Must outlive the device.
+    void set_waiter(device_waiter_t *waiter)
+    {
+        waiter_ = waiter;
+    }
+
+  protected:
+    /// Flag a device state change that may affect its interrupt request line.
+    /// Safe to call from any thread.
+    void raise_event()
+    {
+        event_.store(true, memory_order_release);
+
+        if (waiter_)
+        {
+            waiter_->notify();
+        }
+    }
 
-    virtual void mmio_write(const uint16_t) = 0;
+  private:
+    atomic<bool> event_{false};
 
-    virtual void mmio_irq_notify(interrupt_t &) = 0;
+    device_waiter_t *waiter_ = nullptr;
 };
 
 } // namespace mpce
\ No newline at end of file
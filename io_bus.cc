@@ -0,0 +1,116 @@
+#include "io_bus.h"
+
+#include <algorithm>
+
+namespace mpce
+{
+
+using namespace std;
+
+io_bus_t::io_bus_t()
+    : load_counts_(COUNTERS_ENABLED ? IO_BUS_SIZE : 0),
+      store_counts_(COUNTERS_ENABLED ? IO_BUS_SIZE : 0)
+{
+}
+
+/// @param device
+/// @param irq
+void io_bus_t::attach(io_interface_t &device,
+                      const optional<interrupt_signal_t> irq)
+{
+    devices_.push_back({&device, irq});
+    device.set_waiter(&waiter_);
+}
+
+/// @param range
+void io_bus_t::map_range(const io_range_t &range)
+{
+    const auto next = upper_bound(
+        ranges_.begin(), ranges_.end(), range.begin,
+        [](const uint32_t begin, const io_range_t &other) {
+            return begin < other.begin;
+        });
+
+    if (range.begin >= range.end || range.end > IO_BUS_SIZE ||
+        (next != ranges_.end() && range.end > next->begin) ||
+        (next != ranges_.begin() && prev(next)->end > range.begin))
+    {
+        LOG(FATAL) << "cannot map io range " << range.begin << " to "
+                   << range.end;
+        return;
+    }
+
+    ranges_.insert(next, range);
+}
+
+/// @param shared
+void io_bus_t::set_shared(const bool shared)
+{
+    shared_ = shared;
+}
+
+/// @param interrupt
+void io_bus_t::irq_notify(interrupt_t &interrupt)
+{
+    for (const attached_t &attached : devices_)
+    {
+        if (attached.irq && attached.device->irq_requested())
+        {
+            interrupt.signal(*attached.irq);
+        }
+    }
+}
+
+/// @returns
+bool io_bus_t::take_event()
+{
+    bool raised = false;
+
+    // Take every flag, so that none is left for the next call.
+    for (const attached_t &attached : devices_)
+    {
+        raised |= attached.device->take_event();
+    }
+
+    return raised;
+}
+
+/// @returns
+bool io_bus_t::may_raise_event() const
+{
+    return any_of(devices_.begin(), devices_.end(),
+                  [](const attached_t &attached) {
+                      return attached.device->may_raise_event();
+                  });
+}
+
+/// @param seen
+/// @param timeout
+bool io_bus_t::wait_event(const uint64_t seen,
+                          const chrono::nanoseconds timeout)
+{
+    return waiter_.wait(seen, timeout);
+}
+
+/// @returns
+perf_counters_t io_bus_t::perf_counters() const
+{
+    perf_counters_t counters;
+
+    for (uint32_t offset = 0; offset < load_counts_.size(); offset++)
+    {
+        if (load_counts_[offset])
+        {
+            counters.io_loads[offset] = load_counts_[offset];
+        }
+
+        if (store_counts_[offset])
+        {
+            counters.io_stores[offset] = store_counts_[offset];
+        }
+    }
+
+    return counters;
+}
+
+}; // namespace mpce
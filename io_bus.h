@@ -0,0 +1,226 @@
+#pragma once
+
+#include "interrupt.h"
+#include "io.h"
+#include "perf_counters.h"
+#include "trace.h"
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+/// Offsets of the mapped io region, which starts at kernel data address
+/// 0xf000.
+#define IO_BUS_SIZE 0x1000
+
+namespace mpce
+{
+
+using namespace std;
+
+/// The registers of one device on an io_bus_t: a range of offsets and the
+/// handlers that access them.
+struct io_range_t
+{
+    /// Handlers take the register offset from begin.
+    using load_t = uint16_t (*)(io_interface_t &, const uint32_t);
+    using store_t = void (*)(io_interface_t &, const uint32_t, const uint16_t);
+
+    /// First offset.
+    uint32_t begin;
+
+    /// Offset after the last.
+    uint32_t end;
+
+    io_interface_t *device;
+
+    load_t load;
+
+    store_t store;
+};
+
+/// The devices of the mapped io region. Devices map ranges of offsets to
+/// member handlers, which are called through plain function pointers
+/// generated by map, and attach to raise events and request an interrupt
+/// line. Loads of unmapped offsets read 0, stores to them are dropped.
+class io_bus_t
+{
+  private:
+    /// An attached device and the interrupt it requests, if any.
+    struct attached_t
+    {
+        io_interface_t *device;
+
+        optional<interrupt_signal_t> irq;
+    };
+
+    /// Sorted by begin, not overlapping. Buses hold a few devices, so a
+    /// linear scan beats a table of every offset.
+    vector<io_range_t> ranges_;
+
+    vector<attached_t> devices_;
+
+    /// Notified of the events of all devices.
+    device_waiter_t waiter_;
+
+    /// Serializes device accesses once several cpus share the bus.
+    mutex lock_;
+
+    bool shared_ = false;
+
+    /// Loads and stores by offset, counted if COUNTERS_ENABLED. Device
+    /// accesses are serialized, so plain counters suffice.
+    vector<uint64_t> load_counts_;
+
+    vector<uint64_t> store_counts_;
+
+  public:
+    io_bus_t();
+
+    io_bus_t(const io_bus_t &) = delete;
+
+    io_bus_t &operator=(const io_bus_t &) = delete;
+
+    /// Poll device for its interrupt request line and events.
+    /// @param device Must outlive the bus.
+    /// @param irq The interrupt that device requests, nullopt if none.
+    void attach(io_interface_t &device,
+                const optional<interrupt_signal_t> irq = nullopt);
+
+    /// Route size offsets from begin to the load and store members of
+    /// device, which take the offset from begin.
+    /// @tparam device_t An io_interface_t.
+    /// @tparam load
+    /// @tparam store
+    /// @param device Must outlive the bus.
+    /// @param begin
+    /// @param size
+    template <typename device_t, uint16_t (device_t::*load)(const uint32_t),
+              void (device_t::*store)(const uint32_t, const uint16_t)>
+    void map(device_t &device, const uint32_t begin, const uint32_t size)
+    {
+        map_range({begin, begin + size, &device, &invoke_load<device_t, load>,
+                   &invoke_store<device_t, store>});
+    }
+
+    /// Serialize device accesses, for buses shared by several cpus.
+    /// @param shared
+    void set_shared(const bool shared);
+
+    /// @param offset
+    /// @returns The register at offset, 0 if unmapped.
+    uint16_t load(const uint32_t offset)
+    {
+        TRACE << "io_bus load: offset=" << offset;
+        unique_lock<mutex> guard(lock_, defer_lock);
+
+        if (shared_)
+        {
+            guard.lock();
+        }
+
+        if (COUNTERS_ENABLED && offset < IO_BUS_SIZE)
+        {
+            load_counts_[offset]++;
+        }
+
+        const io_range_t *range = find(offset);
+
+        return range ? range->load(*range->device, offset - range->begin) : 0;
+    }
+
+    /// @param offset
+    /// @param value Dropped if offset is unmapped.
+    void store(const uint32_t offset, const uint16_t value)
+    {
+        TRACE << "io_bus store: offset=" << offset << ", value=" << value;
+        unique_lock<mutex> guard(lock_, defer_lock);
+
+        if (shared_)
+        {
+            guard.lock();
+        }
+
+        if (COUNTERS_ENABLED && offset < IO_BUS_SIZE)
+        {
+            store_counts_[offset]++;
+        }
+
+        const io_range_t *range = find(offset);
+
+        if (range)
+        {
+            range->store(*range->device, offset - range->begin, value);
+        }
+    }
+
+    /// Signal the interrupts that attached devices request.
+    /// @param interrupt
+    void irq_notify(interrupt_t &interrupt);
+
+    /// @returns True if any device raised an event since the last call.
+    bool take_event();
+
+    /// @returns The number of device events so far, for wait_event.
+    uint64_t event_count() const
+    {
+        return waiter_.count();
+    }
+
+    /// @returns Whether an attached device can raise an event while no cpu
+    /// accesses it.
+    bool may_raise_event() const;
+
+    /// Block until a device raises an event after event_count returned seen.
+    /// @param seen
+    /// @param timeout
+    /// @returns False if timeout passed first.
+    bool wait_event(const uint64_t seen, const chrono::nanoseconds timeout);
+
+    /// @returns The loads and stores by offset so far.
+    perf_counters_t perf_counters() const;
+
+  private:
+    /// @param range Must fit IO_BUS_SIZE and not overlap mapped ranges.
+    void map_range(const io_range_t &range);
+
+    /// @param offset
+    /// @returns The range containing offset, nullptr if unmapped.
+    const io_range_t *find(const uint32_t offset) const
+    {
+        for (const io_range_t &range : ranges_)
+        {
+            if (offset < range.begin)
+            {
+                break;
+            }
+
+            if (offset < range.end)
+            {
+                return &range;
+            }
+        }
+
+        return nullptr;
+    }
+
+    /// Adapts a device member to an io_range_t::load_t.
+    template <typename device_t, uint16_t (device_t::*load)(const uint32_t)>
+    static uint16_t invoke_load(io_interface_t &device, const uint32_t reg)
+    {
+        return (static_cast<device_t &>(device).*load)(reg);
+    }
+
+    /// Adapts a device member to an io_range_t::store_t.
+    template <typename device_t,
+              void (device_t::*store)(const uint32_t, const uint16_t)>
+    static void invoke_store(io_interface_t &device, const uint32_t reg,
+                             const uint16_t value)
+    {
+        (static_cast<device_t &>(device).*store)(reg, value);
+    }
+};
+
+} // namespace mpce
@@ -0,0 +1,259 @@
+#include "io_disk.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace mpce
+{
+
+using namespace std;
+
+/// @param kern_data
+/// @param user_data
+io_disk_interface_t::io_disk_interface_t(memory_t &kern_data,
+                                         memory_t &user_data)
+    : kern_data_(kern_data), user_data_(user_data)
+{
+}
+
+io_disk_interface_t::~io_disk_interface_t()
+{
+    {
+        lock_guard<mutex> guard(lock_);
+        stopping_ = true;
+    }
+
+    requested_.notify_one();
+
+    if (worker_.joinable())
+    {
+        worker_.join();
+    }
+
+    if (fd_ >= 0)
+    {
+        close(fd_);
+    }
+}
+
+/// @param path
+bool io_disk_interface_t::open(const string &path)
+{
+    if (fd_ >= 0)
+    {
+        LOG(WARNING) << "disk: an image is already open";
+        return false;
+    }
+
+    fd_ = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+
+    if (fd_ < 0)
+    {
+        LOG(WARNING) << "disk: cannot open " << path;
+        return false;
+    }
+
+    struct stat file_stat;
+
+    if (fstat(fd_, &file_stat) == 0)
+    {
+        // The guest sees the size through two 16-bit registers.
+        sector_count_ = min<uint64_t>(file_stat.st_size / DISK_SECTOR_SIZE,
+                                      UINT32_MAX);
+    }
+
+    worker_ = thread(&io_disk_interface_t::loop, this);
+
+    return true;
+}
+
+/// @param reg
+uint16_t io_disk_interface_t::mmio_load(const uint32_t reg)
+{
+    switch (reg)
+    {
+    case DISK_REG_SECTOR_LOW:
+        return sector_ & 0xffff;
+    case DISK_REG_SECTOR_HIGH:
+        return sector_ >> 16;
+    case DISK_REG_ADDR_LOW:
+        return addr_ & 0xffff;
+    case DISK_REG_ADDR_HIGH:
+        return addr_ >> 16;
+    case DISK_REG_COUNT:
+        return count_;
+    case DISK_REG_STATUS:
+        return status_.load(memory_order_acquire);
+    case DISK_REG_SIZE_LOW:
+        return sector_count_ & 0xffff;
+    case DISK_REG_SIZE_HIGH:
+        return sector_count_ >> 16;
+    default:
+        return 0;
+    }
+}
+
+/// @param reg
+/// @param value
+void io_disk_interface_t::mmio_store(const uint32_t reg, const uint16_t value)
+{
+    TRACE << "io_disk store: reg=" << reg << ", value=" << value;
+
+    switch (reg)
+    {
+    case DISK_REG_SECTOR_LOW:
+        sector_ = (sector_ & 0xffff'0000) | value;
+        break;
+    case DISK_REG_SECTOR_HIGH:
+        sector_ = (sector_ & 0xffff) | value << 16;
+        break;
+    case DISK_REG_ADDR_LOW:
+        addr_ = (addr_ & 0xffff'0000) | value;
+        break;
+    case DISK_REG_ADDR_HIGH:
+        addr_ = (addr_ & 0xffff) | value << 16;
+        break;
+    case DISK_REG_COUNT:
+        count_ = value;
+        break;
+    case DISK_REG_COMMAND:
+        start(value);
+        break;
+    case DISK_REG_STATUS:
+        // Acknowledge the completion, which lowers the request line.
+        if (!(status_.load(memory_order_acquire) & DISK_STATUS_BUSY))
+        {
+            status_.store(0, memory_order_release);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+/// @returns
+bool io_disk_interface_t::irq_requested() const
+{
+    return status_.load(memory_order_acquire) & DISK_STATUS_DONE;
+}
+
+/// @returns
+bool io_disk_interface_t::may_raise_event() const
+{
+    return status_.load(memory_order_acquire) & DISK_STATUS_BUSY;
+}
+
+/// @param command
+void io_disk_interface_t::start(const uint16_t command)
+{
+    // Commands stored while busy are dropped.
+    if (status_.load(memory_order_acquire) & DISK_STATUS_BUSY)
+    {
+        return;
+    }
+
+    const uint16_t operation = command & ~DISK_COMMAND_USER;
+    const bool is_write = operation == DISK_COMMAND_WRITE;
+
+    if ((operation != DISK_COMMAND_READ && !is_write) || fd_ < 0 ||
+        (addr_ & 1) || uint64_t{sector_} + count_ > sector_count_)
+    {
+        finish(false);
+        return;
+    }
+
+    // Data memories are byte addressed. Reads from the disk store to memory,
+    // which saves and logs the buffer now, on the cpu thread.
+    memory_t &memory = command & DISK_COMMAND_USER ? user_data_ : kern_data_;
+    uint16_t *words =
+        memory.dma_words(addr_ >> 1, count_ * DISK_SECTOR_WORDS, !is_write);
+
+    if (!words)
+    {
+        finish(false);
+        return;
+    }
+
+    status_.store(DISK_STATUS_BUSY, memory_order_release);
+
+    {
+        lock_guard<mutex> guard(lock_);
+        request_ = request_t{is_write, words,
+                             uint64_t{sector_} * DISK_SECTOR_SIZE,
+                             uint64_t{count_} * DISK_SECTOR_SIZE};
+    }
+
+    requested_.notify_one();
+}
+
+/// @param ok
+void io_disk_interface_t::finish(const bool ok)
+{
+    // Release the transferred words to the cpu that sees the status.
+    status_.store(DISK_STATUS_DONE | (ok ? 0 : DISK_STATUS_ERROR),
+                  memory_order_release);
+    raise_event();
+}
+
+void io_disk_interface_t::loop()
+{
+    unique_lock<mutex> guard(lock_);
+
+    while (true)
+    {
+        requested_.wait(guard, [&] { return request_ || stopping_; });
+
+        // A transfer requested before stopping still completes.
+        if (!request_)
+        {
+            return;
+        }
+
+        const request_t request = *request_;
+        request_.reset();
+
+        guard.unlock();
+        finish(transfer(request));
+        guard.lock();
+    }
+}
+
+/// @param request
+bool io_disk_interface_t::transfer(const request_t &request)
+{
+    // Words are little-endian, so memory holds the bytes in file order.
+    static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__);
+
+    uint8_t *bytes = reinterpret_cast<uint8_t *>(request.words);
+    uint64_t done = 0;
+
+    while (done < request.bytes)
+    {
+        const ssize_t count =
+            request.is_write
+                ? pwrite(fd_, bytes + done, request.bytes - done,
+                         request.offset + done)
+                : pread(fd_, bytes + done, request.bytes - done,
+                        request.offset + done);
+
+        if (count < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        else if (count <= 0)
+        {
+            return false;
+        }
+
+        done += count;
+    }
+
+    return true;
+}
+
+}; // namespace mpce
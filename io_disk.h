@@ -0,0 +1,150 @@
+#pragma once
+
+#include "interrupt.h"
+#include "io.h"
+#include "memory.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+
+#define DISK_SECTOR_SIZE 512
+#define DISK_SECTOR_WORDS (DISK_SECTOR_SIZE / 2)
+
+// Registers, by offset from the start of the disk range. Sector and address
+// are split into 16-bit halves.
+#define DISK_REG_SECTOR_LOW 0x0
+#define DISK_REG_SECTOR_HIGH 0x1
+#define DISK_REG_ADDR_LOW 0x2
+#define DISK_REG_ADDR_HIGH 0x3
+#define DISK_REG_COUNT 0x4
+#define DISK_REG_COMMAND 0x5
+#define DISK_REG_STATUS 0x6
+#define DISK_REG_SIZE_LOW 0x7
+#define DISK_REG_SIZE_HIGH 0x8
+#define DISK_REG_NUM 0x9
+
+// Commands, stored to DISK_REG_COMMAND.
+#define DISK_COMMAND_READ 0x01
+#define DISK_COMMAND_WRITE 0x02
+
+/// Flag of a command that transfers to or from user data memory instead of
+/// kernel data memory.
+#define DISK_COMMAND_USER 0x80
+
+// Status bits, loaded from DISK_REG_STATUS. Any store to it clears DONE and
+// ERROR.
+#define DISK_STATUS_BUSY 0x01
+#define DISK_STATUS_DONE 0x02
+#define DISK_STATUS_ERROR 0x04
+
+namespace mpce
+{
+
+using namespace std;
+
+/// Virtual block device backed by a host image file. The guest sets the
+/// first sector, the physical byte address of a word aligned buffer in
+/// kernel or user data memory and the sector count, then stores a command.
+/// A worker thread transfers the sectors with pread or pwrite straight
+/// between the file and data memory, and the device requests its interrupt
+/// until the guest acknowledges completion. One transfer runs at a time;
+/// the guest must not access the buffer while the device is busy.
+class io_disk_interface_t : public io_interface_t
+{
+  private:
+    /// A transfer for the worker.
+    struct request_t
+    {
+        bool is_write;
+
+        /// The buffer in data memory.
+        uint16_t *words;
+
+        /// Byte offset into the file.
+        uint64_t offset;
+
+        uint64_t bytes;
+    };
+
+    memory_t &kern_data_;
+
+    memory_t &user_data_;
+
+    /// Image file, -1 if none is open.
+    int fd_ = -1;
+
+    /// Size of the image file.
+    uint64_t sector_count_ = 0;
+
+    /// Registers, accessed by the cpu only.
+    uint32_t sector_ = 0;
+    uint32_t addr_ = 0;
+    uint16_t count_ = 0;
+
+    /// DISK_STATUS_* bits, written by the cpu and the worker.
+    atomic<uint16_t> status_{0};
+
+    mutex lock_;
+
+    condition_variable requested_;
+
+    /// The transfer to run, guarded by lock_.
+    optional<request_t> request_;
+
+    /// Whether the worker should exit, guarded by lock_.
+    bool stopping_ = false;
+
+    thread worker_;
+
+  public:
+    /// @param kern_data
+    /// @param user_data
+    io_disk_interface_t(memory_t &kern_data, memory_t &user_data);
+
+    /// Wait for a running transfer, stop the worker and close the file.
+    ~io_disk_interface_t();
+
+    /// Attach an image file, whose size is rounded down to whole sectors,
+    /// and start the worker. Without one, every command fails.
+    /// @param path
+    /// @returns False if the file cannot be opened for reading and writing.
+    bool open(const string &path);
+
+    /// @param reg
+    /// @returns The register at reg, 0 for unknown registers.
+    uint16_t mmio_load(const uint32_t reg);
+
+    /// @param reg
+    /// @param value Ignored for read-only and unknown registers.
+    void mmio_store(const uint32_t reg, const uint16_t value);
+
+    /// @returns True once a transfer completed until the guest acknowledged
+    /// it.
+    bool irq_requested() const;
+
+    /// @returns True while a transfer runs.
+    bool may_raise_event() const;
+
+  private:
+    /// Check a command and hand its transfer to the worker, or fail it.
+    /// @param command
+    void start(const uint16_t command);
+
+    /// Complete a transfer, requesting the interrupt.
+    /// @param ok
+    void finish(const bool ok);
+
+    /// Worker thread: run transfers until stopping_.
+    void loop();
+
+    /// @param request
+    /// @returns False on a host I/O error or end of file.
+    bool transfer(const request_t &request);
+};
+
+} // namespace mpce
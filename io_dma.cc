@@ -0,0 +1,241 @@
+#include "io_dma.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace mpce
+{
+
+using namespace std;
+
+/// @param kern_data
+/// @param user_data
+io_dma_interface_t::io_dma_interface_t(memory_t &kern_data,
+                                       memory_t &user_data)
+    : kern_data_(kern_data), user_data_(user_data)
+{
+}
+
+/// @param mmu
+void io_dma_interface_t::set_mmu(const mmu_t *mmu)
+{
+    mmu_ = mmu;
+}
+
+/// @param reg
+uint16_t io_dma_interface_t::mmio_load(const uint32_t reg)
+{
+    switch (reg)
+    {
+    case DMA_REG_SRC_LOW:
+        return src_ & 0xffff;
+    case DMA_REG_SRC_HIGH:
+        return src_ >> 16;
+    case DMA_REG_DST_LOW:
+        return dst_ & 0xffff;
+    case DMA_REG_DST_HIGH:
+        return dst_ >> 16;
+    case DMA_REG_LENGTH:
+        return length_;
+    case DMA_REG_FILL:
+        return fill_;
+    case DMA_REG_PTB:
+        return ptb_;
+    case DMA_REG_STATUS:
+        return status_.load(memory_order_acquire);
+    default:
+        return 0;
+    }
+}
+
+/// @param reg
+/// @param value
+void io_dma_interface_t::mmio_store(const uint32_t reg, const uint16_t value)
+{
+    TRACE << "io_dma store: reg=" << reg << ", value=" << value;
+
+    switch (reg)
+    {
+    case DMA_REG_SRC_LOW:
+        src_ = (src_ & 0xffff'0000) | value;
+        break;
+    case DMA_REG_SRC_HIGH:
+        src_ = (src_ & 0xffff) | value << 16;
+        break;
+    case DMA_REG_DST_LOW:
+        dst_ = (dst_ & 0xffff'0000) | value;
+        break;
+    case DMA_REG_DST_HIGH:
+        dst_ = (dst_ & 0xffff) | value << 16;
+        break;
+    case DMA_REG_LENGTH:
+        length_ = value;
+        break;
+    case DMA_REG_FILL:
+        fill_ = value;
+        break;
+    case DMA_REG_PTB:
+        ptb_ = value;
+        break;
+    case DMA_REG_COMMAND:
+        start(value);
+        break;
+    case DMA_REG_STATUS:
+        // Acknowledge the completion, which lowers the request line.
+        status_.store(0, memory_order_release);
+        break;
+    default:
+        break;
+    }
+}
+
+/// @returns
+bool io_dma_interface_t::irq_requested() const
+{
+    return status_.load(memory_order_acquire) & DMA_STATUS_DONE;
+}
+
+/// @param command
+void io_dma_interface_t::start(const uint16_t command)
+{
+    const uint16_t operation = command & ~DMA_COMMAND_FLAGS;
+
+    if ((operation != DMA_COMMAND_COPY && operation != DMA_COMMAND_FILL) ||
+        !plan(command))
+    {
+        status_.store(DMA_STATUS_DONE | DMA_STATUS_ERROR, memory_order_release);
+        raise_event();
+        return;
+    }
+
+    // Like memmove, copy back to front if the destination follows the
+    // source, so that an overlapping copy loads every word before storing to
+    // it. Overlapping virtual ranges share the pages of the overlap, so this
+    // holds across the spans too.
+    if (dst_ > src_)
+    {
+        reverse(spans_.begin(), spans_.end());
+    }
+
+    // Spans are as long as the pages allow, so the library copies and fills
+    // whole runs of words with vector instructions.
+    for (const span_t &span : spans_)
+    {
+        // Save and log the words like stores by the cpu, now that the whole
+        // transfer is known to succeed.
+        span.dst_memory->dma_words(span.dst_addr, span.words, true);
+
+        if (span.src)
+        {
+            memmove(span.dst, span.src, span.words * sizeof(uint16_t));
+        }
+        else
+        {
+            fill_n(span.dst, span.words, fill_);
+        }
+    }
+
+    status_.store(DMA_STATUS_DONE, memory_order_release);
+    raise_event();
+}
+
+/// @param command
+bool io_dma_interface_t::plan(const uint16_t command)
+{
+    const bool is_fill = (command & ~DMA_COMMAND_FLAGS) == DMA_COMMAND_FILL;
+    const bool is_virt = command & DMA_COMMAND_VIRT;
+
+    uint32_t src = src_;
+    uint32_t dst = dst_;
+    uint32_t remaining = length_;
+
+    spans_.clear();
+
+    // Each span ends at the next page boundary of either virtual range.
+    while (remaining)
+    {
+        const bool dst_user = command & DMA_COMMAND_DST_USER;
+
+        uint32_t words = 0;
+        uint32_t dst_addr = 0;
+        uint16_t *dst_words = translate(dst, remaining, dst_user, is_virt,
+                                        true, words, dst_addr);
+
+        if (!dst_words)
+        {
+            return false;
+        }
+
+        const uint16_t *src_words = nullptr;
+
+        if (!is_fill)
+        {
+            uint32_t src_addr = 0;
+            src_words = translate(src, words, command & DMA_COMMAND_SRC_USER,
+                                  is_virt, false, words, src_addr);
+
+            if (!src_words)
+            {
+                return false;
+            }
+        }
+
+        spans_.push_back({src_words, dst_words, words,
+                          dst_user ? &user_data_ : &kern_data_, dst_addr});
+
+        src += words * sizeof(uint16_t);
+        dst += words * sizeof(uint16_t);
+        remaining -= words;
+    }
+
+    return true;
+}
+
+/// @param addr
+/// @param remaining
+/// @param is_user
+/// @param is_virt
+/// @param is_store
+/// @param words
+/// @param word_addr
+uint16_t *io_dma_interface_t::translate(const uint32_t addr,
+                                        const uint32_t remaining,
+                                        const bool is_user, const bool is_virt,
+                                        const bool is_store, uint32_t &words,
+                                        uint32_t &word_addr)
+{
+    if (addr & 1)
+    {
+        return nullptr;
+    }
+
+    uint32_t phys_addr = addr;
+    words = remaining;
+
+    if (is_user && is_virt)
+    {
+        // Translate once per page, the rest of the page follows physically.
+        if (!mmu_ || addr > UINT16_MAX ||
+            !mmu_->lookup(addr, ptb_, true, is_store, phys_addr))
+        {
+            return nullptr;
+        }
+
+        const uint32_t page_bytes = VIRT_PAGE_OFFSET(UINT16_MAX) + 1;
+
+        const uint32_t page_words =
+            (page_bytes - VIRT_PAGE_OFFSET(addr)) / sizeof(uint16_t);
+
+        words = min(remaining, page_words);
+    }
+
+    // Data memories are byte addressed. Stores are saved and logged only
+    // once the whole transfer is planned, see start.
+    memory_t &memory = is_user ? user_data_ : kern_data_;
+    word_addr = phys_addr >> 1;
+
+    return memory.dma_words(word_addr, words, false);
+}
+
+}; // namespace mpce
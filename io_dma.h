@@ -0,0 +1,150 @@
+#pragma once
+
+#include "interrupt.h"
+#include "io.h"
+#include "memory.h"
+#include "mmu.h"
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+// Registers, by offset from the start of the dma range. Addresses are split
+// into 16-bit halves.
+#define DMA_REG_SRC_LOW 0x0
+#define DMA_REG_SRC_HIGH 0x1
+#define DMA_REG_DST_LOW 0x2
+#define DMA_REG_DST_HIGH 0x3
+#define DMA_REG_LENGTH 0x4
+#define DMA_REG_FILL 0x5
+#define DMA_REG_PTB 0x6
+#define DMA_REG_COMMAND 0x7
+#define DMA_REG_STATUS 0x8
+#define DMA_REG_NUM 0x9
+
+// Commands, stored to DMA_REG_COMMAND. Fill ignores the source.
+#define DMA_COMMAND_COPY 0x01
+#define DMA_COMMAND_FILL 0x02
+
+/// Flag of a command whose source is in user data memory instead of kernel
+/// data memory.
+#define DMA_COMMAND_SRC_USER 0x10
+
+/// Flag of a command whose destination is in user data memory.
+#define DMA_COMMAND_DST_USER 0x20
+
+/// Flag of a command whose user addresses are virtual, translated through
+/// the data page table with DMA_REG_PTB. Kernel addresses are physical. The
+/// device cannot tell which cpu stored the command, so virtual commands fail
+/// while several cpus share it.
+#define DMA_COMMAND_VIRT 0x40
+
+#define DMA_COMMAND_FLAGS                                                      \
+    (DMA_COMMAND_SRC_USER | DMA_COMMAND_DST_USER | DMA_COMMAND_VIRT)
+
+// Status bits, loaded from DMA_REG_STATUS. Any store to it clears DONE and
+// ERROR.
+#define DMA_STATUS_DONE 0x02
+#define DMA_STATUS_ERROR 0x04
+
+namespace mpce
+{
+
+using namespace std;
+
+/// Copy and fill engine for data memory. The guest sets the byte addresses
+/// of a word aligned source and destination, the length in words and the
+/// fill value, then stores a command. The transfer runs on the host before
+/// the store returns, a page at a time for virtual addresses and in one
+/// piece otherwise, and the device requests its interrupt until the guest
+/// acknowledges completion. A command fails without storing anything if
+/// any page of either range is not RAM, or unmapped or, for the
+/// destination, read only. Overlapping ranges copy like memmove, whether
+/// physical or virtual.
+class io_dma_interface_t : public io_interface_t
+{
+  private:
+    /// A part of a transfer that lies within one page of either range.
+    struct span_t
+    {
+        /// nullptr for a fill.
+        const uint16_t *src;
+
+        uint16_t *dst;
+
+        uint32_t words;
+
+        /// Memory and word address of dst, which saves and logs the words
+        /// just before they are stored to.
+        memory_t *dst_memory;
+        uint32_t dst_addr;
+    };
+
+    memory_t &kern_data_;
+
+    memory_t &user_data_;
+
+    /// Page tables of virtual addresses, nullptr until set and while several
+    /// cpus share the device.
+    const mmu_t *mmu_ = nullptr;
+
+    /// Registers, accessed by the cpus only.
+    uint32_t src_ = 0;
+    uint32_t dst_ = 0;
+    uint16_t length_ = 0;
+    uint16_t fill_ = 0;
+    uint16_t ptb_ = 0;
+
+    /// DMA_STATUS_* bits, polled by every cpu for the request line.
+    atomic<uint16_t> status_{0};
+
+    /// The spans of the current transfer, kept to reuse their storage.
+    vector<span_t> spans_;
+
+  public:
+    /// @param kern_data
+    /// @param user_data
+    io_dma_interface_t(memory_t &kern_data, memory_t &user_data);
+
+    /// @param mmu Translates virtual addresses, must outlive the device.
+    /// nullptr fails every virtual transfer.
+    void set_mmu(const mmu_t *mmu);
+
+    /// @param reg
+    /// @returns The register at reg, 0 for unknown registers.
+    uint16_t mmio_load(const uint32_t reg);
+
+    /// @param reg
+    /// @param value Ignored for unknown registers.
+    void mmio_store(const uint32_t reg, const uint16_t value);
+
+    /// @returns True once a transfer completed until the guest acknowledged
+    /// it.
+    bool irq_requested() const;
+
+  private:
+    /// Run a command and complete it.
+    /// @param command
+    void start(const uint16_t command);
+
+    /// Split the transfer of command into spans_, checking both ranges without
+    /// storing anything.
+    /// @param command
+    /// @returns False if a page of either range cannot be transferred.
+    bool plan(const uint16_t command);
+
+    /// @param addr Byte address.
+    /// @param remaining Words left in the range.
+    /// @param is_user
+    /// @param is_virt
+    /// @param is_store Whether the page must be writable.
+    /// @param words Set to the words available at addr, up to remaining.
+    /// @param word_addr Set to the word address of addr in its memory.
+    /// @returns The words at addr, nullptr if they cannot be transferred.
+    uint16_t *translate(const uint32_t addr, const uint32_t remaining,
+                        const bool is_user, const bool is_virt,
+                        const bool is_store, uint32_t &words,
+                        uint32_t &word_addr);
+};
+
+} // namespace mpce
@@ -1,20 +1,63 @@
 #include "io_serial.h"
+#include "trace.h"
+
+#include <cerrno>
+#include <functional>
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
 
 namespace mpce
 {
 
 using namespace std;
 
+io_serial_interface_t::io_serial_interface_t()
+    : out_event_fd_(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)),
+      stop_fd_(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK))
+{
+}
+
+io_serial_interface_t::~io_serial_interface_t()
+{
+    stop_console();
+
+    if (console_in_thread_.joinable() || console_out_thread_.joinable())
+    {
+        join_console();
+    }
+
+    close(out_event_fd_);
+    close(stop_fd_);
+}
+
+/// @param reg
+uint16_t io_serial_interface_t::mmio_load(const uint32_t reg)
+{
+    return reg == 0 ? mmio_read() : mmio_buffer_nonempty();
+}
+
+/// @param reg
+/// @param value
+void io_serial_interface_t::mmio_store(const uint32_t reg,
+                                       const uint16_t value)
+{
+    if (reg == 0)
+    {
+        mmio_write(value);
+    }
+}
+
 /// @returns
 uint16_t io_serial_interface_t::mmio_read()
 {
-    scoped_lock<mutex> lock(mutex_mmio_in_);
+    uint8_t value = 0;
 
-    const uint8_t value = mmio_in_buffer_.front();
-    mmio_in_buffer_.pop();
+    mmio_in_buffer_.pop(value);
 
-    LOG(INFO) << "io_serial read " << value << ", '" << static_cast<char>(value)
-              << "'";
+    TRACE << "io_serial read " << value << ", '" << static_cast<char>(value)
+          << "'";
 
     return value;
 }
@@ -22,48 +65,55 @@ uint16_t io_serial_interface_t::mmio_read()
 /// @param byte
 void io_serial_interface_t::mmio_write(const uint16_t byte)
 {
-    scoped_lock<mutex> lock(mutex_mmio_out_);
+    TRACE << "io_serial write " << byte << ", '" << static_cast<char>(byte)
+          << "'";
+
+    while (!mmio_out_buffer_.push(byte))
+    {
+        // Without a console nothing drains the buffer, drop the byte.
+        if (!running_)
+        {
+            return;
+        }
 
-    LOG(INFO) << "io_serial write " << byte << ", '" << static_cast<char>(byte)
-              << "'";
+        notify_out();
+        this_thread::yield();
+    }
 
-    mmio_out_buffer_.push(byte);
+    notify_out();
 }
 
 /// @returns
 uint16_t io_serial_interface_t::mmio_buffer_nonempty()
 {
-    bool in_buffer_nonempty;
-
-    {
-        scoped_lock<mutex> lock(mutex_mmio_in_);
-        in_buffer_nonempty = mmio_in_buffer_.size();
-    }
-
-    return in_buffer_nonempty ? 1 : 0;
+    return mmio_in_buffer_.empty() ? 0 : 1;
 }
 
-/// @param interrupt
-void io_serial_interface_t::mmio_irq_notify(interrupt_t &interrupt)
+/// @returns
+bool io_serial_interface_t::irq_requested() const
 {
-    bool in_buffer_nonempty;
-
-    {
-        scoped_lock<mutex> lock(mutex_mmio_in_);
-        in_buffer_nonempty = mmio_in_buffer_.size();
-    }
+    return !mmio_in_buffer_.empty();
+}
 
-    if (in_buffer_nonempty)
-    {
-        interrupt.signal(IRQ1);
-    }
+/// @returns
+bool io_serial_interface_t::may_raise_event() const
+{
+    return running_;
 }
 
-///
-void io_serial_interface_t::start_console()
+/// @param in_fd
+/// @param out_fd
+void io_serial_interface_t::start_console(const int in_fd, const int out_fd)
 {
+    in_fd_ = in_fd;
+    out_fd_ = out_fd;
     running_ = true;
 
+    // Clear a stop request of a previous console.
+    uint64_t count;
+    [[maybe_unused]] const ssize_t bytes_read =
+        read(stop_fd_, &count, sizeof(count));
+
     // Console input thread, for reading in keystrokes and queueing them in
     // the MMIO.
     console_in_thread_ = thread(bind(&io_serial_interface_t::loop_in, this));
@@ -84,54 +134,203 @@ void io_serial_interface_t::join_console()
 void io_serial_interface_t::stop_console()
 {
     running_ = false;
+
+    const uint64_t one = 1;
+    [[maybe_unused]] const ssize_t written = write(stop_fd_, &one, sizeof(one));
+}
+
+/// @param bytes
+/// @param size
+size_t io_serial_interface_t::queue_input(const uint8_t *bytes,
+                                          const size_t size)
+{
+    size_t queued = 0;
+
+    while (queued < size && mmio_in_buffer_.push(bytes[queued]))
+    {
+        queued++;
+    }
+
+    if (queued)
+    {
+        raise_event();
+    }
+
+    return queued;
+}
+
+/// @param out
+void io_serial_interface_t::take_output(string &out)
+{
+    out_buffer_t::span_t spans[2];
+    const size_t size = mmio_out_buffer_.readable(spans);
+
+    out.append(spans[0].first, spans[0].first + spans[0].second);
+    out.append(spans[1].first, spans[1].first + spans[1].second);
+
+    mmio_out_buffer_.consume(size);
 }
 
 ///
 void io_serial_interface_t::loop_out()
 {
-    while (running_)
+    while (true)
     {
-        optional<uint8_t> byte_out = nullopt;
+        out_buffer_t::span_t spans[2];
+        const size_t size = mmio_out_buffer_.readable(spans);
 
+        if (size)
         {
-            scoped_lock<mutex> lock(mutex_mmio_out_);
+            write_out(spans);
+            mmio_out_buffer_.consume(size);
+            continue;
+        }
 
-            if (mmio_out_buffer_.size())
-            {
-                byte_out = mmio_out_buffer_.front();
-                mmio_out_buffer_.pop();
-            }
+        // Output written before stopping has been drained above.
+        if (!running_)
+        {
+            break;
         }
 
-        if (byte_out)
+        // Announce the wait before checking the buffer again, so that
+        // mmio_write either sees out_waiting_ or its byte is seen here.
+        out_waiting_ = true;
+        atomic_thread_fence(memory_order_seq_cst);
+
+        if (mmio_out_buffer_.empty() && wait_readable(out_event_fd_))
         {
-            LOG(INFO) << static_cast<char>(*byte_out) << flush;
+            uint64_t count;
+            [[maybe_unused]] const ssize_t bytes_read =
+                read(out_event_fd_, &count, sizeof(count));
         }
 
-        this_thread::sleep_for(sleep_duration_);
+        out_waiting_ = false;
     }
 }
 
 ///
 void io_serial_interface_t::loop_in()
 {
+    uint8_t buffer[SERIAL_READ_SIZE];
+
+    while (running_ && wait_readable(in_fd_))
+    {
+        const ssize_t count = read(in_fd_, buffer, sizeof(buffer));
+
+        if (count < 0 && (errno == EINTR || errno == EAGAIN))
+        {
+            continue;
+        }
+        else if (count <= 0)
+        {
+            // End of input.
+            break;
+        }
+
+        for (ssize_t i = 0; i < count; i++)
+        {
+            while (!mmio_in_buffer_.push(buffer[i]) && running_)
+            {
+                raise_event();
+                this_thread::yield();
+            }
+
+            if (buffer[i] == 'Q')
+            {
+                stop_console();
+            }
+        }
+
+        raise_event();
+    }
+}
+
+void io_serial_interface_t::notify_out()
+{
+    atomic_thread_fence(memory_order_seq_cst);
+
+    if (out_waiting_.load(memory_order_relaxed) && out_waiting_.exchange(false))
+    {
+        const uint64_t one = 1;
+        [[maybe_unused]] const ssize_t written =
+            write(out_event_fd_, &one, sizeof(one));
+    }
+}
+
+/// @param fd
+bool io_serial_interface_t::wait_readable(const int fd)
+{
+    pollfd fds[2] = {{fd, POLLIN, 0}, {stop_fd_, POLLIN, 0}};
+
     while (running_)
     {
-        uint8_t byte_in;
+        if (poll(fds, 2, -1) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            return false;
+        }
+
+        if (fds[0].revents)
+        {
+            return true;
+        }
+
+        if (fds[1].revents)
+        {
+            return false;
+        }
+    }
 
-        /// Read a byte from stdin, including whitespace (noskipws).
-        cin >> noskipws >> byte_in;
+    return false;
+}
+
+/// @param spans
+void io_serial_interface_t::write_out(const out_buffer_t::span_t (&spans)[2])
+{
+    iovec iov[2] = {
+        {const_cast<uint8_t *>(spans[0].first), spans[0].second},
+        {const_cast<uint8_t *>(spans[1].first), spans[1].second}};
+
+    iovec *begin = iov;
+    int iov_count = spans[1].second ? 2 : 1;
 
+    while (iov_count)
+    {
+        const ssize_t written = writev(out_fd_, begin, iov_count);
+
+        if (written < 0)
         {
-            scoped_lock<mutex> lock(mutex_mmio_in_);
-            mmio_in_buffer_.push(byte_in);
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            // The output is gone, drop the batch.
+            LOG(WARNING) << "io_serial: cannot write console output";
+            return;
         }
 
-        if (byte_in == 'Q')
-            running_ = false;
+        // Skip what was written, which may end inside an iovec.
+        size_t remaining = written;
 
-        this_thread::sleep_for(sleep_duration_);
+        while (iov_count && remaining >= begin->iov_len)
+        {
+            remaining -= begin->iov_len;
+            begin++;
+            iov_count--;
+        }
+
+        if (iov_count)
+        {
+            begin->iov_base =
+                static_cast<uint8_t *>(begin->iov_base) + remaining;
+            begin->iov_len -= remaining;
+        }
     }
 }
 
-}; // namespace mpce
\ No newline at end of file
+}; // namespace mpce
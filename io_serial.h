@@ -2,40 +2,75 @@
 
 #include "interrupt.h"
 #include "io.h"
+#include "spsc_ring.h"
 
 #include <atomic>
 #include <cstdint>
 #include <iostream>
-#include <mutex>
-#include <optional>
-#include <queue>
+#include <string>
 #include <thread>
 
+#include <unistd.h>
+
+#define SERIAL_OUT_RING_SIZE 0x1'0000
+#define SERIAL_IN_RING_SIZE 0x1000
+#define SERIAL_READ_SIZE 0x1000
+
 namespace mpce
 {
 
 using namespace std;
 
+/// Serial console. The cpu and the console threads exchange bytes through
+/// lock-free rings; the console threads block on their file descriptors and
+/// an eventfd instead of polling, and output is written in batches.
 class io_serial_interface_t : public io_interface_t
 {
   private:
-    queue<uint8_t> mmio_out_buffer_;
-
-    queue<uint8_t> mmio_in_buffer_;
+    using out_buffer_t = spsc_ring_t<uint8_t, SERIAL_OUT_RING_SIZE>;
 
-    mutex mutex_mmio_in_;
+    /// Written by the cpu, read by the output thread.
+    out_buffer_t mmio_out_buffer_;
 
-    mutex mutex_mmio_out_;
+    /// Written by the input thread, read by the cpu.
+    spsc_ring_t<uint8_t, SERIAL_IN_RING_SIZE> mmio_in_buffer_;
 
     thread console_in_thread_;
 
     thread console_out_thread_;
 
-    atomic<bool> running_;
+    atomic<bool> running_{false};
+
+    /// Whether the output thread waits for out_event_fd_.
+    atomic<bool> out_waiting_{false};
+
+    /// Wakes the output thread when output is available.
+    int out_event_fd_ = -1;
 
-    const chrono::milliseconds sleep_duration_{5};
+    /// Readable once the console is stopped.
+    int stop_fd_ = -1;
+
+    int in_fd_ = STDIN_FILENO;
+
+    int out_fd_ = STDOUT_FILENO;
 
   public:
+    io_serial_interface_t();
+
+    /// Stop and join the console threads if still running.
+    ~io_serial_interface_t();
+
+    /// Load a register: the next input byte at 0x0, or whether input is
+    /// buffered at 0x1.
+    /// @param reg
+    /// @returns
+    uint16_t mmio_load(const uint32_t reg);
+
+    /// Store a register: an output byte to 0x0. Stores to 0x1 are ignored.
+    /// @param reg
+    /// @param value
+    void mmio_store(const uint32_t reg, const uint16_t value);
+
     /// @returns
     uint16_t mmio_read();
 
@@ -45,11 +80,16 @@ class io_serial_interface_t : public io_interface_t
     /// @returns
     uint16_t mmio_buffer_nonempty();
 
-    /// @param interrupt
-    void mmio_irq_notify(interrupt_t &interrupt);
+    /// @returns True while input is buffered.
+    bool irq_requested() const;
 
-    ///
-    void start_console();
+    /// @returns True while the console input thread runs.
+    bool may_raise_event() const;
+
+    /// @param in_fd Console input, read until end of file or 'Q'.
+    /// @param out_fd Console output.
+    void start_console(const int in_fd = STDIN_FILENO,
+                       const int out_fd = STDOUT_FILENO);
 
     ///
     void join_console();
@@ -57,12 +97,42 @@ class io_serial_interface_t : public io_interface_t
     ///
     void stop_console();
 
+    /// Queue input as if typed on the console, for runs without one.
+    /// @param bytes
+    /// @param size
+    /// @returns The number of bytes queued, less than size once the input
+    /// buffer is full.
+    size_t queue_input(const uint8_t *bytes, const size_t size);
+
+    /// Move buffered output to the end of out, for runs without a console.
+    /// Output is dropped once SERIAL_OUT_RING_SIZE bytes are buffered.
+    /// @param out
+    void take_output(string &out);
+
+    /// @returns True if take_output would take anything.
+    bool has_output() const
+    {
+        return !mmio_out_buffer_.empty();
+    }
+
   private:
     ///
     void loop_out();
 
     ///
     void loop_in();
+
+    /// Wake the output thread if it waits for output.
+    void notify_out();
+
+    /// Block until fd is readable or the console is stopped.
+    /// @param fd
+    /// @returns False if the console was stopped.
+    bool wait_readable(const int fd);
+
+    /// Write spans to out_fd_ completely.
+    /// @param spans
+    void write_out(const out_buffer_t::span_t (&spans)[2]);
 };
 
-} // namespace mpce
\ No newline at end of file
+} // namespace mpce
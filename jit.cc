@@ -0,0 +1,995 @@
+#include "jit.h"
+#include "mmu.h"
+#include "trace.h"
+
+#include <cstddef>
+#include <cstring>
+#include <optional>
+
+#include <glog/logging.h>
+
+#if defined(__x86_64__) && defined(__linux__)
+#define MPCE_JIT_X86_64
+#include <sys/mman.h>
+#endif
+
+namespace mpce
+{
+
+using namespace std;
+
+namespace
+{
+
+/// Host registers, by encoding.
+enum host_reg_t : uint8_t
+{
+    EAX = 0,
+    ECX = 1,
+    EDX = 2,
+};
+
+/// Appends x86-64 instructions to a byte buffer. Cpu state operands are
+/// always [rbx + disp32], where rbx holds the cpu_state_t pointer. Guest
+/// memory is accessed as [rdx + rax], a page and a byte offset into it.
+class x86_64_emitter_t
+{
+  public:
+    /// push rbx; mov rbx, rdi
+    void prologue()
+    {
+        emit({0x53, 0x48, 0x89, 0xfb});
+    }
+
+    /// mov eax, count; pop rbx; ret
+    /// @param count
+    void epilogue(const uint32_t count)
+    {
+        emit({0xb8});
+        emit32(count);
+        emit({0x5b, 0xc3});
+    }
+
+    /// add qword [rbx + disp], value
+    /// @param disp
+    /// @param value
+    void add64(const ptrdiff_t disp, const int32_t value)
+    {
+        emit({0x48, 0x81, 0x83});
+        emit32(disp);
+        emit32(value);
+    }
+
+    /// mov ecx, value; mov word [rbx + disp], cx. Unlike a 16-bit immediate
+    /// store, this does not stall the decoder on a length changing prefix.
+    /// @param disp
+    /// @param value
+    void store16(const ptrdiff_t disp, const uint16_t value)
+    {
+        mov_imm(ECX, value);
+        store_reg16(disp, ECX);
+    }
+
+    /// mov word [rbx + disp], reg
+    /// @param disp
+    /// @param reg
+    void store_reg16(const ptrdiff_t disp, const host_reg_t reg)
+    {
+        emit({0x66, 0x89, modrm_rbx(reg)});
+        emit32(disp);
+    }
+
+    /// mov rax, value; mov qword [rbx + disp], rax
+    /// @param disp
+    /// @param value
+    void store64(const ptrdiff_t disp, const uint64_t value)
+    {
+        emit({0x48, 0xb8});
+        emit64(value);
+        emit({0x48, 0x89, 0x83});
+        emit32(disp);
+    }
+
+    /// mov reg, value
+    /// @param reg
+    /// @param value
+    void mov_imm(const host_reg_t reg, const uint32_t value)
+    {
+        emit({static_cast<uint8_t>(0xb8 + reg)});
+        emit32(value);
+    }
+
+    /// movzx reg, word [rbx + disp]
+    /// @param reg
+    /// @param disp
+    void load16(const host_reg_t reg, const ptrdiff_t disp)
+    {
+        emit({0x0f, 0xb7, modrm_rbx(reg)});
+        emit32(disp);
+    }
+
+    /// add/sub eax, ecx; optionally movzx eax, ax
+    /// @param add
+    /// @param wrap Whether to truncate the result to 16 bits.
+    void add_ecx(const bool add, const bool wrap)
+    {
+        emit({static_cast<uint8_t>(add ? 0x01 : 0x29), 0xc8});
+
+        if (wrap)
+        {
+            emit({0x0f, 0xb7, 0xc0});
+        }
+    }
+
+    /// test byte [rbx + disp], mask; jnz/jz rel32
+    /// @param disp
+    /// @param mask
+    /// @param jump_if_zero
+    /// @returns Position of the jump displacement, for patch.
+    size_t test8_jump(const ptrdiff_t disp, const uint8_t mask,
+                      const bool jump_if_zero)
+    {
+        emit({0xf6, 0x83});
+        emit32(disp);
+        emit({mask, 0x0f, static_cast<uint8_t>(jump_if_zero ? 0x84 : 0x85)});
+        emit32(0);
+
+        return code_.size();
+    }
+
+    /// Translate the virtual address in eax through a TLB like
+    /// mmu_t::resolve, leaving the physical address in eax. Jumps if the
+    /// entry is not cached, or the page is unmapped or read only for a
+    /// write.
+    /// @param tlb
+    /// @param ptb
+    /// @param is_write
+    /// @param jumps Receives the positions of the jump displacements.
+    void translate(const ptrdiff_t tlb, const uint8_t ptb, const bool is_write,
+                   vector<size_t> &jumps)
+    {
+        static_assert(sizeof(tlb_entry_t) == 8);
+        static_assert(offsetof(tlb_entry_t, tag) == 0);
+        static_assert(offsetof(tlb_entry_t, page_table_entry) == 4);
+
+        // ecx <- PTE_LOOKUP_INDEX: mov ecx, eax; shr ecx, 9; or ecx, ptb << 7
+        emit({0x89, 0xc1, 0xc1, 0xe9, 0x09, 0x81, 0xc9});
+        emit32(uint32_t{ptb} << 7);
+
+        // edx <- TLB_INDEX: mov edx, ecx; shr edx, 10; xor edx, ecx;
+        // and edx, TLB_SIZE - 1
+        emit({0x89, 0xca, 0xc1, 0xea, 0x0a, 0x31, 0xca, 0x81, 0xe2});
+        emit32(TLB_SIZE - 1);
+
+        // cmp dword [rbx + rdx * 8 + tlb], ecx; jne
+        emit({0x39, 0x8c, 0xd3});
+        emit32(tlb);
+        jumps.push_back(jump_if(0x85));
+
+        // movzx edx, word [rbx + rdx * 8 + tlb + 4]; test edx, flags; jnz
+        emit({0x0f, 0xb7, 0x94, 0xd3});
+        emit32(tlb + 4);
+        emit({0xf7, 0xc2});
+        emit32(is_write ? 0xc000 : 0x8000);
+        jumps.push_back(jump_if(0x85));
+
+        // PHYS_ADDR: and eax, 0x1ff; and edx, 0x1fff; shl edx, 14;
+        // or eax, edx
+        emit({0x25});
+        emit32(0x01ff);
+        emit({0x81, 0xe2});
+        emit32(0x1fff);
+        emit({0xc1, 0xe2, 0x0e, 0x09, 0xd0});
+    }
+
+    /// Translate a constant virtual address like translate, leaving the
+    /// physical address in eax.
+    /// @param tlb
+    /// @param lookup_index PTE_LOOKUP_INDEX of the address.
+    /// @param offset VIRT_PAGE_OFFSET of the address.
+    /// @param is_write
+    /// @param jumps Receives the positions of the jump displacements.
+    void translate_constant(const ptrdiff_t tlb, const uint32_t lookup_index,
+                            const uint32_t offset, const bool is_write,
+                            vector<size_t> &jumps)
+    {
+        const ptrdiff_t entry = tlb + TLB_INDEX(lookup_index) * 8;
+
+        // cmp dword [rbx + entry], lookup_index; jne
+        emit({0x81, 0xbb});
+        emit32(entry);
+        emit32(lookup_index);
+        jumps.push_back(jump_if(0x85));
+
+        // movzx edx, word [rbx + entry + 4]; test edx, flags; jnz
+        emit({0x0f, 0xb7, 0x93});
+        emit32(entry + 4);
+        emit({0xf7, 0xc2});
+        emit32(is_write ? 0xc000 : 0x8000);
+        jumps.push_back(jump_if(0x85));
+
+        // mov eax, offset; and edx, 0x1fff; shl edx, 14; or eax, edx
+        mov_imm(EAX, offset);
+        emit({0x81, 0xe2});
+        emit32(0x1fff);
+        emit({0xc1, 0xe2, 0x0e, 0x09, 0xd0});
+    }
+
+    /// Find the page of a constant physical address like find_page, which
+    /// the caller checked is below the page count.
+    /// @param memory
+    /// @param phys_addr
+    /// @param byte
+    /// @param is_store
+    /// @param jumps Receives the positions of the jump displacements.
+    void find_page_constant(const jit_memory_t &memory,
+                            const uint32_t phys_addr, const bool byte,
+                            const bool is_store, vector<size_t> &jumps)
+    {
+        const uint8_t shift = memory.byte_addressible;
+        const uint32_t word_addr = phys_addr >> shift;
+        const page_descriptor_t &page =
+            memory.pages[MEMORY_PAGE_NUM(word_addr)];
+        const void *member = is_store ? static_cast<const void *>(&page.store)
+                                      : &page.load;
+
+        // mov rax, member; mov rdx, [rax]; test rdx, rdx; jz
+        emit({0x48, 0xb8});
+        emit64(reinterpret_cast<uint64_t>(member));
+        emit({0x48, 0x8b, 0x10, 0x48, 0x85, 0xd2});
+        jumps.push_back(jump_if(0x84));
+
+        const uint32_t offset =
+            shift && byte ? phys_addr & (MEMORY_PAGE_SIZE * 2 - 1)
+                          : MEMORY_PAGE_OFFSET(word_addr) * sizeof(uint16_t);
+
+        mov_imm(EAX, offset);
+    }
+
+    /// Find the physical address in eax through the page descriptors of
+    /// memory, leaving the page in rdx and the byte offset into it in rax.
+    /// Jumps if the page has no descriptor for the access.
+    /// @param memory
+    /// @param byte Whether the access is a single byte.
+    /// @param is_store
+    /// @param jumps Receives the positions of the jump displacements.
+    void find_page(const jit_memory_t &memory, const bool byte,
+                   const bool is_store, vector<size_t> &jumps)
+    {
+        static_assert(sizeof(page_descriptor_t) == 16);
+        static_assert(offsetof(page_descriptor_t, load) == 0);
+        static_assert(offsetof(page_descriptor_t, store) == 8);
+
+        const uint8_t shift = memory.byte_addressible;
+
+        // mov ecx, eax; shr ecx, bits; cmp ecx, page_count; jae
+        emit({0x89, 0xc1, 0xc1, 0xe9,
+              static_cast<uint8_t>(MEMORY_PAGE_BITS + shift), 0x81, 0xf9});
+        emit32(memory.page_count);
+        jumps.push_back(jump_if(0x83));
+
+        // shl ecx, 4; mov rsi, pages; mov rdx, [rsi + rcx + member];
+        // test rdx, rdx; jz
+        emit({0xc1, 0xe1, 0x04, 0x48, 0xbe});
+        emit64(reinterpret_cast<uint64_t>(memory.pages));
+        emit({0x48, 0x8b, 0x54, 0x0e,
+              static_cast<uint8_t>(is_store ? 8 : 0), 0x48, 0x85, 0xd2});
+        jumps.push_back(jump_if(0x84));
+
+        // Words are little-endian, so the odd byte is the high one. Word
+        // accesses ignore the low address bit of byte addressed memory.
+        static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__);
+
+        const uint32_t page_bytes = MEMORY_PAGE_SIZE * sizeof(uint16_t);
+
+        // and eax, mask; for word addresses also add eax, eax
+        emit({0x25});
+
+        if (shift)
+        {
+            emit32(byte ? page_bytes - 1 : page_bytes - 2);
+        }
+        else
+        {
+            emit32(MEMORY_PAGE_SIZE - 1);
+            emit({0x01, 0xc0});
+        }
+    }
+
+    /// movzx eax, byte/word [rdx + rax]
+    /// @param byte
+    void load_page(const bool byte)
+    {
+        emit({0x0f, static_cast<uint8_t>(byte ? 0xb6 : 0xb7), 0x04, 0x02});
+    }
+
+    /// mov byte/word [rdx + rax], cl/cx
+    /// @param byte
+    void store_page(const bool byte)
+    {
+        if (byte)
+        {
+            emit({0x88, 0x0c, 0x02});
+        }
+        else
+        {
+            emit({0x66, 0x89, 0x0c, 0x02});
+        }
+    }
+
+    /// xchg byte [rdx + rax], cl; movzx eax, cl. The exchange is locked, so
+    /// it is a full barrier.
+    void exchange_page8()
+    {
+        emit({0x86, 0x0c, 0x02, 0x0f, 0xb6, 0xc1});
+    }
+
+    /// mov rdi, rbx; mov rsi, arg; mov rax, fn; call rax; test al, al; jz rel32
+    /// @param fn
+    /// @param arg
+    /// @returns Position of the jump displacement, for patch.
+    size_t call_jump_if_false(const void *fn, const void *arg)
+    {
+        emit({0x48, 0x89, 0xdf, 0x48, 0xbe});
+        emit64(reinterpret_cast<uint64_t>(arg));
+        emit({0x48, 0xb8});
+        emit64(reinterpret_cast<uint64_t>(fn));
+        emit({0xff, 0xd0, 0x84, 0xc0});
+
+        return jump_if(0x84);
+    }
+
+    /// jmp rel32 to a position patched later.
+    /// @returns Position of the jump displacement, for patch.
+    size_t jump()
+    {
+        emit({0xe9});
+        emit32(0);
+
+        return code_.size();
+    }
+
+    /// jmp rel32 to target.
+    /// @param target A position in the code.
+    void jump(const size_t target)
+    {
+        emit({0xe9});
+        emit32(static_cast<ptrdiff_t>(target) -
+               static_cast<ptrdiff_t>(code_.size() + 4));
+    }
+
+    /// Point the rel32 jump ending at jump_end to the current position.
+    /// @param jump_end
+    void patch(const size_t jump_end)
+    {
+        const int32_t rel = static_cast<int32_t>(code_.size() - jump_end);
+        memcpy(&code_[jump_end - 4], &rel, sizeof(rel));
+    }
+
+    /// @returns The current position in the code.
+    size_t position() const
+    {
+        return code_.size();
+    }
+
+    /// @returns The generated code.
+    const vector<uint8_t> &code() const
+    {
+        return code_;
+    }
+
+  private:
+    /// @param reg
+    /// @returns The ModRM byte of reg and [rbx + disp32].
+    static uint8_t modrm_rbx(const host_reg_t reg)
+    {
+        return 0x83 | reg << 3;
+    }
+
+    /// jcc rel32 to a position patched later.
+    /// @param opcode Second byte of the condition code, such as 0x85 for jnz.
+    /// @returns Position of the jump displacement, for patch.
+    size_t jump_if(const uint8_t opcode)
+    {
+        emit({0x0f, opcode});
+        emit32(0);
+
+        return code_.size();
+    }
+
+    /// @param bytes
+    void emit(initializer_list<uint8_t> bytes)
+    {
+        code_.insert(code_.end(), bytes);
+    }
+
+    /// @param value
+    void emit32(const ptrdiff_t value)
+    {
+        const int32_t value32 = static_cast<int32_t>(value);
+        const uint8_t *bytes = reinterpret_cast<const uint8_t *>(&value32);
+        code_.insert(code_.end(), bytes, bytes + sizeof(value32));
+    }
+
+    /// @param value
+    void emit64(const uint64_t value)
+    {
+        const uint8_t *bytes = reinterpret_cast<const uint8_t *>(&value);
+        code_.insert(code_.end(), bytes, bytes + sizeof(value));
+    }
+
+    vector<uint8_t> code_;
+};
+
+/// Where an inline instruction calls back into the interpreter, emitted
+/// after the block.
+struct slow_path_t
+{
+    /// Positions of the jumps to the slow path.
+    vector<size_t> jumps;
+
+    const decoded_inst_t *inst;
+
+    /// Address of the instruction.
+    uint16_t pc_addr;
+
+    /// Instructions executed but not yet counted before the instruction.
+    uint32_t deferred_cycles;
+
+    /// The immediate register before the instruction, if it is not stored.
+    optional<uint16_t> deferred_imm;
+
+    /// Instructions executed including this one.
+    uint32_t executed;
+
+    /// Where the fast path continues.
+    size_t resume;
+};
+
+/// Compiles one block. PC is a constant at every instruction of a block,
+/// since only the last instruction may branch, so reads of PC are constants
+/// and PC is only stored before the last instruction and before calls into
+/// the interpreter. Executed instructions are counted, and immediates
+/// loaded by inline instructions are stored, at the same points.
+class block_compiler_t
+{
+  private:
+    const block_t &block_;
+
+    const vector<jit_op_t> &ops_;
+
+    const jit_layout_t &layout_;
+
+    x86_64_emitter_t &emitter_;
+
+    /// Page table base of the block, part of its key in user mode.
+    const uint8_t ptb_;
+
+    /// Instructions executed since the cycle count was last stored.
+    uint32_t deferred_cycles_ = 0;
+
+    /// The immediate register, if known at this point of the block.
+    optional<uint16_t> imm_;
+
+    /// Whether imm_ is not stored yet.
+    bool imm_deferred_ = false;
+
+    vector<slow_path_t> slow_paths_;
+
+  public:
+    /// @param block
+    /// @param ops
+    /// @param layout
+    /// @param emitter
+    block_compiler_t(const block_t &block, const vector<jit_op_t> &ops,
+                     const jit_layout_t &layout, x86_64_emitter_t &emitter)
+        : block_(block), ops_(ops), layout_(layout), emitter_(emitter),
+          ptb_(static_cast<uint8_t>(block.key >> 16))
+    {
+    }
+
+    /// Generate code that behaves like cpu_state_t::exec_block for the block.
+    void compile()
+    {
+        uint16_t pc_addr = static_cast<uint16_t>(block_.key);
+
+        emitter_.prologue();
+
+        for (size_t i = 0; i < block_.insts.size(); i++)
+        {
+            const decoded_inst_t &inst = block_.insts[i];
+            const jit_op_t &op = ops_[i];
+            const uint32_t executed = i + 1;
+            const bool last = executed == block_.insts.size();
+
+            // PC after fetching the instruction and its immediate.
+            const uint16_t next_pc = pc_addr + (op.load_imm ? 2 : 1);
+
+            if (!is_inline(inst, op))
+            {
+                sync(pc_addr);
+
+                const size_t jump = emitter_.call_jump_if_false(
+                    reinterpret_cast<const void *>(layout_.exec_inst), &inst);
+                emitter_.epilogue(executed);
+                emitter_.patch(jump);
+
+                pc_addr = next_pc;
+                continue;
+            }
+
+            // The last instruction may branch, so it sees PC in memory.
+            if (last)
+            {
+                emitter_.store16(layout_.registers[PC], next_pc);
+            }
+
+            slow_path_t slow_path{{},
+                                  &inst,
+                                  pc_addr,
+                                  deferred_cycles_,
+                                  imm_deferred_ ? imm_ : nullopt,
+                                  executed,
+                                  0};
+
+            if (op.load_imm)
+            {
+                imm_ = inst.imm;
+                imm_deferred_ = true;
+            }
+
+            if (op.inline_alu)
+            {
+                emit_alu(inst, op, next_pc);
+            }
+            else if (op.inline_mem)
+            {
+                emit_mem(inst, op, next_pc, slow_path.jumps);
+            }
+            else
+            {
+                emit_ats(inst, slow_path.jumps);
+            }
+
+            if (!slow_path.jumps.empty())
+            {
+                slow_path.resume = emitter_.position();
+                slow_paths_.push_back(move(slow_path));
+            }
+
+            // Inline instructions never raise a signal, so the signal state
+            // is still clear from the previous instruction.
+            deferred_cycles_++;
+
+            if (last)
+            {
+                emit_exit_state(inst, op, pc_addr);
+            }
+
+            pc_addr = next_pc;
+        }
+
+        emitter_.epilogue(block_.insts.size());
+
+        for (const slow_path_t &slow_path : slow_paths_)
+        {
+            emit_slow_path(slow_path);
+        }
+    }
+
+  private:
+    /// @param inst
+    /// @param op
+    /// @returns Whether the instruction is emitted inline.
+    bool is_inline(const decoded_inst_t &inst, const jit_op_t &op) const
+    {
+        if (op.inline_alu)
+        {
+            return true;
+        }
+
+        // User mode accesses to kernel memory are illegal.
+        if (op.inline_mem)
+        {
+            return op.inst_mode || !block_.user_mode;
+        }
+
+        // op_ats reads its address registers before loading the immediate,
+        // when PC and the immediate register are not constants.
+        return op.inline_ats && block_.user_mode && inst.y != PC &&
+               inst.y != IMM && inst.z != PC && inst.z != IMM;
+    }
+
+    /// Store the immediate register if it is deferred.
+    void store_imm()
+    {
+        if (imm_deferred_)
+        {
+            emitter_.store16(layout_.registers[IMM], *imm_);
+            imm_deferred_ = false;
+        }
+    }
+
+    /// Store PC and the deferred state, before calling the interpreter for
+    /// the instruction at pc_addr, which may change the immediate register.
+    /// @param pc_addr
+    void sync(const uint16_t pc_addr)
+    {
+        if (deferred_cycles_)
+        {
+            emitter_.add64(layout_.cycle_count, deferred_cycles_);
+            deferred_cycles_ = 0;
+        }
+
+        store_imm();
+        imm_ = nullopt;
+
+        emitter_.store16(layout_.registers[PC], pc_addr);
+    }
+
+    /// @param index
+    /// @param next_pc
+    /// @returns The value of register index if it is a constant at the
+    /// instruction.
+    optional<uint16_t> constant(const uint8_t index,
+                                const uint16_t next_pc) const
+    {
+        switch (index)
+        {
+        case R0:
+            return 0;
+        case PC:
+            return next_pc;
+        case IMM:
+            return imm_;
+        default:
+            return nullopt;
+        }
+    }
+
+    /// @param reg
+    /// @param index
+    /// @param next_pc
+    void load_register(const host_reg_t reg, const uint8_t index,
+                       const uint16_t next_pc)
+    {
+        const optional<uint16_t> value = constant(index, next_pc);
+
+        if (value)
+        {
+            emitter_.mov_imm(reg, *value);
+        }
+        else
+        {
+            emitter_.load16(reg, layout_.registers[index]);
+        }
+    }
+
+    /// Store eax to register x of an instruction. r0 is hard wired to zero.
+    /// @param x
+    void store_register(const uint8_t x)
+    {
+        if (x == IMM)
+        {
+            store_imm();
+            imm_ = nullopt;
+        }
+
+        if (x != R0)
+        {
+            emitter_.store_reg16(layout_.registers[x], EAX);
+        }
+    }
+
+    /// @param inst
+    /// @param next_pc
+    /// @param add
+    /// @returns The sum or difference of y and z of inst, if both are
+    /// constants.
+    optional<uint16_t> combine_constant(const decoded_inst_t &inst,
+                                        const uint16_t next_pc,
+                                        const bool add) const
+    {
+        const optional<uint16_t> y = constant(inst.y, next_pc);
+        const optional<uint16_t> z = constant(inst.z, next_pc);
+
+        if (!y || !z)
+        {
+            return nullopt;
+        }
+
+        return add ? *y + *z : *y - *z;
+    }
+
+    /// Load y and z of inst into eax and ecx, and combine them into eax.
+    /// @param inst
+    /// @param next_pc
+    /// @param add
+    /// @param wrap Whether to truncate the result to 16 bits.
+    void combine_yz(const decoded_inst_t &inst, const uint16_t next_pc,
+                    const bool add, const bool wrap)
+    {
+        load_register(EAX, inst.y, next_pc);
+        load_register(ECX, inst.z, next_pc);
+        emitter_.add_ecx(add, wrap);
+    }
+
+    /// @param inst
+    /// @param op
+    /// @param next_pc
+    void emit_alu(const decoded_inst_t &inst, const jit_op_t &op,
+                  const uint16_t next_pc)
+    {
+        if (inst.x == R0)
+        {
+            return;
+        }
+
+        // The immediate register keeps its value if the operation is
+        // skipped.
+        if (inst.x == IMM)
+        {
+            store_imm();
+        }
+
+        // Skip the operation unless the status condition is satisfied.
+        const size_t skip =
+            emitter_.test8_jump(layout_.status, op.cond, op.status_invert);
+
+        const optional<uint16_t> value =
+            combine_constant(inst, next_pc, op.add);
+
+        if (value)
+        {
+            emitter_.mov_imm(EAX, *value);
+        }
+        else
+        {
+            combine_yz(inst, next_pc, op.add, false);
+        }
+
+        store_register(inst.x);
+        emitter_.patch(skip);
+    }
+
+    /// @param inst
+    /// @param op
+    /// @param next_pc
+    /// @param jumps Receives the jumps to the slow path.
+    void emit_mem(const decoded_inst_t &inst, const jit_op_t &op,
+                  const uint16_t next_pc, vector<size_t> &jumps)
+    {
+        const jit_memory_t &memory = layout_.memories[op.inst_mode][op.is_data];
+        const bool byte = op.byte && memory.byte_addressible;
+        const optional<uint16_t> virt_addr =
+            combine_constant(inst, next_pc, true);
+
+        if (virt_addr && !block_.user_mode)
+        {
+            // Addresses beyond the memory are left to the interpreter.
+            const uint32_t word_addr =
+                *virt_addr >> memory.byte_addressible;
+
+            if (MEMORY_PAGE_NUM(word_addr) >= memory.page_count)
+            {
+                jumps.push_back(emitter_.jump());
+
+                if (!op.is_store && inst.x == IMM)
+                {
+                    imm_ = nullopt;
+                    imm_deferred_ = false;
+                }
+
+                return;
+            }
+
+            emitter_.find_page_constant(memory, *virt_addr, byte, op.is_store,
+                                        jumps);
+        }
+        else
+        {
+            if (virt_addr)
+            {
+                emitter_.translate_constant(
+                    layout_.tlb[op.is_data],
+                    PTE_LOOKUP_INDEX(ptb_, VIRT_PAGE_NUM(*virt_addr), false),
+                    VIRT_PAGE_OFFSET(*virt_addr), op.is_store, jumps);
+            }
+            else
+            {
+                combine_yz(inst, next_pc, true, true);
+
+                if (block_.user_mode)
+                {
+                    emitter_.translate(layout_.tlb[op.is_data], ptb_,
+                                       op.is_store, jumps);
+                }
+            }
+
+            emitter_.find_page(memory, byte, op.is_store, jumps);
+        }
+
+        if (op.is_store)
+        {
+            load_register(ECX, inst.x, next_pc);
+            emitter_.store_page(byte);
+        }
+        else
+        {
+            emitter_.load_page(byte);
+            store_register(inst.x);
+        }
+    }
+
+    /// @param inst
+    /// @param jumps Receives the jumps to the slow path.
+    void emit_ats(const decoded_inst_t &inst, vector<size_t> &jumps)
+    {
+        // The address registers are not constants, see is_inline.
+        combine_yz(inst, 0, true, true);
+
+        emitter_.translate(layout_.tlb[true], ptb_, true, jumps);
+        emitter_.find_page(layout_.memories[true][true], true, true, jumps);
+
+        // Exchange the low byte of the immediate with memory.
+        emitter_.mov_imm(ECX, inst.imm);
+        emitter_.exchange_page8();
+        store_register(inst.x);
+    }
+
+    /// Count the instructions of the block and leave the cpu state as the
+    /// interpreter would after the last instruction.
+    /// @param inst
+    /// @param op
+    /// @param pc_addr Address of the instruction.
+    void emit_exit_state(const decoded_inst_t &inst, const jit_op_t &op,
+                         const uint16_t pc_addr)
+    {
+        const bool user_mode = block_.user_mode;
+
+        emitter_.add64(layout_.cycle_count, deferred_cycles_);
+        store_imm();
+
+        // The last word fetched, the immediate if there is one.
+        if (user_mode)
+        {
+            emitter_.store16(layout_.exc_addr, pc_addr + (op.load_imm ? 1 : 0));
+            emitter_.store16(layout_.eret, pc_addr + 1);
+        }
+
+        emitter_.store16(layout_.inst, inst.word);
+
+        uint64_t words[2];
+        static_assert(sizeof(words) == sizeof(decoded_inst_t));
+        memcpy(words, &inst, sizeof(words));
+
+        emitter_.store64(layout_.decoded_inst, words[0]);
+        emitter_.store64(layout_.decoded_inst + 8, words[1]);
+    }
+
+    /// Run the instruction through the interpreter, then leave the block or
+    /// continue after the fast path.
+    /// @param slow_path
+    void emit_slow_path(const slow_path_t &slow_path)
+    {
+        for (const size_t jump : slow_path.jumps)
+        {
+            emitter_.patch(jump);
+        }
+
+        if (slow_path.deferred_cycles)
+        {
+            emitter_.add64(layout_.cycle_count, slow_path.deferred_cycles);
+        }
+
+        if (slow_path.deferred_imm)
+        {
+            emitter_.store16(layout_.registers[IMM], *slow_path.deferred_imm);
+        }
+
+        emitter_.store16(layout_.registers[PC], slow_path.pc_addr);
+
+        const size_t jump = emitter_.call_jump_if_false(
+            reinterpret_cast<const void *>(layout_.exec_inst), slow_path.inst);
+        emitter_.epilogue(slow_path.executed);
+        emitter_.patch(jump);
+
+        // The fast path counts the instructions up to this one later, and
+        // may store the immediate register again.
+        emitter_.add64(layout_.cycle_count,
+                       -static_cast<int32_t>(slow_path.deferred_cycles + 1));
+        emitter_.jump(slow_path.resume);
+    }
+};
+
+} // namespace
+
+jit_t::jit_t() = default;
+
+jit_t::~jit_t()
+{
+#ifdef MPCE_JIT_X86_64
+    if (code_)
+    {
+        munmap(code_, JIT_CODE_CAPACITY);
+    }
+#endif
+}
+
+/// @returns
+bool jit_t::supported()
+{
+#ifdef MPCE_JIT_X86_64
+    return true;
+#else
+    return false;
+#endif
+}
+
+/// @param block
+/// @param ops
+/// @param layout
+jit_t::block_fn jit_t::compile(const block_t &block,
+                               const vector<jit_op_t> &ops,
+                               const jit_layout_t &layout)
+{
+#ifdef MPCE_JIT_X86_64
+    if (!code_)
+    {
+        void *code = mmap(nullptr, JIT_CODE_CAPACITY, PROT_READ | PROT_EXEC,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        if (code == MAP_FAILED)
+        {
+            LOG(WARNING) << "jit: cannot map code buffer";
+            return nullptr;
+        }
+
+        code_ = static_cast<uint8_t *>(code);
+    }
+
+    x86_64_emitter_t emitter;
+    block_compiler_t(block, ops, layout, emitter).compile();
+
+    const vector<uint8_t> &code = emitter.code();
+
+    if (code_size_ + code.size() > JIT_CODE_CAPACITY)
+    {
+        full_ = true;
+        return nullptr;
+    }
+
+    // Keep the buffer executable or writable, never both.
+    if (mprotect(code_, JIT_CODE_CAPACITY, PROT_READ | PROT_WRITE))
+    {
+        return nullptr;
+    }
+
+    uint8_t *fn = code_ + code_size_;
+    memcpy(fn, code.data(), code.size());
+    code_size_ += (code.size() + 15) & ~size_t{15};
+
+    mprotect(code_, JIT_CODE_CAPACITY, PROT_READ | PROT_EXEC);
+
+    TRACE << "jit: compiled block at pc=" << (block.key & 0xffff) << " to "
+          << code.size() << " bytes";
+
+    return reinterpret_cast<block_fn>(fn);
+#else
+    return nullptr;
+#endif
+}
+
+void jit_t::reset()
+{
+    code_size_ = 0;
+    full_ = false;
+}
+
+/// @returns
+bool jit_t::full() const
+{
+    return full_;
+}
+
+}; // namespace mpce
@@ -0,0 +1,138 @@
+#pragma once
+
+#include "block_cache.h"
+#include "memory.h"
+#include "register.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#define JIT_DEFAULT_THRESHOLD 32
+#define JIT_CODE_CAPACITY 0x40'0000
+
+namespace mpce
+{
+
+using namespace std;
+
+struct cpu_state_t;
+
+/// How the JIT may implement one instruction. Instructions that are none of
+/// inline_alu, inline_mem and inline_ats are executed by calling
+/// layout.exec_inst.
+struct jit_op_t
+{
+    /// Whether the instruction is an op_alu form the JIT emits directly.
+    bool inline_alu = false;
+
+    /// Addition if true, otherwise subtraction.
+    bool add = false;
+
+    bool load_imm = false;
+
+    /// Status condition, see op_alu.
+    uint8_t cond = 0xff;
+
+    bool status_invert = false;
+
+    /// Whether the instruction is an op_mem form the JIT emits directly, with
+    /// the parameters below.
+    bool inline_mem = false;
+
+    bool byte = false;
+
+    bool inst_mode = false;
+
+    bool is_data = false;
+
+    bool is_store = false;
+
+    /// Whether the instruction is op_ats, which the JIT emits as an exchange.
+    bool inline_ats = false;
+};
+
+/// A memory as generated code accesses it.
+struct jit_memory_t
+{
+    const page_descriptor_t *pages = nullptr;
+
+    uint32_t page_count = 0;
+
+    bool byte_addressible = false;
+};
+
+/// Where generated code finds the cpu state, as byte offsets from the
+/// cpu_state_t pointer it is called with.
+struct jit_layout_t
+{
+    ptrdiff_t cycle_count;
+    ptrdiff_t registers[REGISTER_FILE_SIZE];
+    ptrdiff_t status;
+    ptrdiff_t exc_addr;
+    ptrdiff_t eret;
+    ptrdiff_t inst;
+    ptrdiff_t decoded_inst;
+
+    /// The code and data TLBs of the mmu, indexed by is_data.
+    ptrdiff_t tlb[2];
+
+    /// Memories, indexed by inst_mode and is_data.
+    jit_memory_t memories[2][2];
+
+    /// Executes one instruction of a block through the interpreter.
+    /// @returns True if the block must be left after the instruction.
+    bool (*exec_inst)(cpu_state_t &, const decoded_inst_t &);
+};
+
+/// Compiles hot blocks to x86-64 machine code. ALU and conditional branch
+/// forms are emitted inline. Loads, stores and op_ats are emitted inline for
+/// TLB hits on RAM pages that take stores, and call back into the
+/// interpreter for TLB misses, faults, MMIO and write protected pages, like
+/// every other instruction. PC, the cycle count and loaded immediates are
+/// constants within a block and only written back at calls and exits. On
+/// other hosts compile always fails and blocks stay interpreted.
+class jit_t
+{
+  public:
+    /// Native code for a block. Returns the number of instructions executed,
+    /// which is less than the block size if an instruction left the block.
+    using block_fn = uint64_t (*)(cpu_state_t *);
+
+    jit_t();
+
+    ~jit_t();
+
+    jit_t(const jit_t &) = delete;
+
+    jit_t &operator=(const jit_t &) = delete;
+
+    /// @returns True if this host can run generated code.
+    static bool supported();
+
+    /// @param block
+    /// @param ops How to implement each instruction of block.
+    /// @param layout
+    /// @returns Native code for block, or nullptr if the code buffer is full
+    /// or the host is not supported.
+    block_fn compile(const block_t &block, const vector<jit_op_t> &ops,
+                     const jit_layout_t &layout);
+
+    /// Release all generated code. Previously compiled functions must not be
+    /// called afterwards.
+    void reset();
+
+    /// @returns True if the last compile failed for lack of space.
+    bool full() const;
+
+  private:
+    /// Executable code buffer, mapped on first compile.
+    uint8_t *code_ = nullptr;
+
+    /// Bytes of code_ in use.
+    size_t code_size_ = 0;
+
+    bool full_ = false;
+};
+
+} // namespace mpce
@@ -0,0 +1,112 @@
+#include "machine.h"
+
+#include <algorithm>
+#include <exception>
+#include <thread>
+
+namespace mpce
+{
+
+using namespace std;
+
+/// @param core_count
+machine_t::machine_t(const uint32_t core_count)
+{
+    for (uint32_t i = 0; i < max(core_count, 1u); i++)
+    {
+        cores_.push_back(make_unique<cpu_state_t>(mmio_, i));
+    }
+}
+
+/// @returns
+uint32_t machine_t::core_count() const
+{
+    return cores_.size();
+}
+
+/// @param index
+cpu_state_t &machine_t::core(const uint32_t index)
+{
+    return *cores_.at(index);
+}
+
+/// @returns
+MMIO &machine_t::mmio()
+{
+    return mmio_;
+}
+
+/// @returns
+perf_counters_t machine_t::perf_counters() const
+{
+    perf_counters_t counters = mmio_.perf_counters();
+
+    for (const unique_ptr<cpu_state_t> &core : cores_)
+    {
+        counters.add(core->perf_counters());
+    }
+
+    return counters;
+}
+
+/// @param path
+bool machine_t::load_image(const string &path)
+{
+    // Every core maps the memory sections again, which is cheap, and loads
+    // its own page tables.
+    for (const unique_ptr<cpu_state_t> &core : cores_)
+    {
+        if (!core->load_image(path))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/// @param max_cycles
+uint64_t machine_t::run(const uint64_t max_cycles)
+{
+    vector<thread> threads;
+    vector<uint64_t> cycles(cores_.size());
+    vector<exception_ptr> exceptions(cores_.size());
+
+    for (size_t i = 0; i < cores_.size(); i++)
+    {
+        threads.emplace_back([&, i] {
+            try
+            {
+                cycles[i] = cores_[i]->run(max_cycles);
+            }
+            catch (...)
+            {
+                exceptions[i] = current_exception();
+            }
+        });
+    }
+
+    for (thread &core_thread : threads)
+    {
+        core_thread.join();
+    }
+
+    for (const exception_ptr &exception : exceptions)
+    {
+        if (exception)
+        {
+            rethrow_exception(exception);
+        }
+    }
+
+    uint64_t total = 0;
+
+    for (const uint64_t core_cycles : cycles)
+    {
+        total += core_cycles;
+    }
+
+    return total;
+}
+
+}; // namespace mpce
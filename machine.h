@@ -0,0 +1,74 @@
+#pragma once
+
+#include "cpu_state.h"
+#include "mmio.h"
+#include "perf_counters.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace mpce
+{
+
+using namespace std;
+
+/// A multi-core machine. Every core has its own registers, special registers,
+/// interrupts and mmu_t with page tables and TLB; all cores share the code and
+/// data memories and the devices of one MMIO, and each runs on its own host
+/// thread.
+///
+/// Memory model: plain loads and stores of a core are seen by the other cores
+/// eventually and in no particular order. Byte and word stores never touch
+/// other bytes, so stores by different cores to neighbouring bytes are never
+/// lost. op_ats is an atomic exchange and a full barrier: accesses before it
+/// in program order are seen by every core before it, and accesses after it
+/// after it. Device accesses are serialized, as are stores saved for a
+/// snapshot or logged, and device interrupts go to the first core that polls
+/// the device.
+class machine_t
+{
+  private:
+    MMIO mmio_;
+
+    vector<unique_ptr<cpu_state_t>> cores_;
+
+  public:
+    /// @param core_count At least 1.
+    explicit machine_t(const uint32_t core_count);
+
+    machine_t(const machine_t &) = delete;
+
+    machine_t &operator=(const machine_t &) = delete;
+
+    /// @returns
+    uint32_t core_count() const;
+
+    /// @param index
+    /// @returns
+    cpu_state_t &core(const uint32_t index);
+
+    /// @returns
+    MMIO &mmio();
+
+    /// @returns The events counted by all cores and the shared MMIO. Must
+    /// not be called while run is running.
+    perf_counters_t perf_counters() const;
+
+    /// Load a guest image into the shared memories and the page tables of
+    /// every core, and start every core at its entry point. Core i starts
+    /// with i in R1.
+    /// @param path
+    /// @returns False if the image cannot be loaded.
+    bool load_image(const string &path);
+
+    /// Run every core for max_cycles instructions, each on its own host
+    /// thread, and wait for all of them. Rethrows the exception of the
+    /// lowest numbered core that raised one.
+    /// @param max_cycles Instructions per core.
+    /// @returns The number of instructions executed by all cores.
+    uint64_t run(const uint64_t max_cycles);
+};
+
+} // namespace mpce
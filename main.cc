@@ -1,24 +1,255 @@
 #include "cpu_state.h"
 #include "io_serial.h"
+#include "machine.h"
+#include "profiler.h"
+#include "trace_recorder.h"
 
+#include <algorithm>
 #include <cstdio>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
 #include <stack>
+#include <string>
+#include <vector>
 
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 
 using namespace std;
 
+DEFINE_string(image, "",
+              "Guest image to load instead of the built-in demo program.");
+DEFINE_uint64(cycles, 3, "Number of instructions to execute.");
+DEFINE_uint32(cores, 1,
+              "Cores sharing memory and devices, each on its own thread. "
+              "Requires --image.");
+DEFINE_string(disk, "",
+              "Image file of the virtual block device, read and written in "
+              "place.");
+
+DEFINE_bool(perf_counters, false,
+            "Write the performance counters to stderr at exit. Only builds "
+            "with MPCE_COUNTERS, such as mpce_counters, count events.");
+DEFINE_uint64(perf_counters_interval, 0,
+              "Also write the performance counters every this many "
+              "instructions per core, 0 for only at exit.");
+
+DEFINE_string(profile, "",
+              "Write a sampling profile of the guest to this file, as folded "
+              "stacks for flamegraphs.");
+DEFINE_uint64(profile_period, 10000,
+              "Instructions between profile samples of each core.");
+DEFINE_string(profile_symbols, "",
+              "Guest symbol file for --profile, with one \"kern|user <hex "
+              "address> <name>\" line per symbol. Defaults to the image path "
+              "with .sym appended, if that exists.");
+
+DEFINE_string(trace, "",
+              "Record every instruction, register write, memory access and "
+              "interrupt to this file, for mpce_trace_decode. With several "
+              "cores, each core records to the path with .<core> appended.");
+
+/// Attach --disk to the block device of mmio, if set.
+/// @param mmio
+/// @returns False if it cannot be opened.
+bool open_disk(mpce::MMIO &mmio)
+{
+    return FLAGS_disk.empty() || mmio.disk_interface().open(FLAGS_disk);
+}
+
+/// Attach a profiler to every core if --profile is set.
+/// @param cores
+/// @returns The profilers, empty if not profiling.
+vector<unique_ptr<mpce::profiler_t>>
+start_profilers(const vector<mpce::cpu_state_t *> &cores)
+{
+    vector<unique_ptr<mpce::profiler_t>> profilers;
+
+    if (FLAGS_profile.empty())
+    {
+        return profilers;
+    }
+
+    const bool default_symbols = FLAGS_profile_symbols.empty();
+    const string symbol_path =
+        default_symbols && !FLAGS_image.empty() ? FLAGS_image + ".sym"
+                                                : FLAGS_profile_symbols;
+    mpce::symbol_map_t symbols;
+
+    if (!symbol_path.empty() && !symbols.load(symbol_path))
+    {
+        symbols = {};
+        LOG_IF(WARNING, !default_symbols)
+            << "cannot read symbols from " << symbol_path;
+    }
+
+    for (mpce::cpu_state_t *core : cores)
+    {
+        profilers.push_back(
+            make_unique<mpce::profiler_t>(FLAGS_profile_period, symbols));
+        core->set_profiler(profilers.back().get());
+    }
+
+    return profilers;
+}
+
+/// Attach a trace recorder to every core if --trace is set. Cores run
+/// their blocks through the interpreter while recording.
+/// @param cores
+/// @returns The recorders, which write the rest of the trace when destroyed,
+/// empty if not tracing.
+vector<unique_ptr<mpce::trace_recorder_t>>
+start_trace_recorders(const vector<mpce::cpu_state_t *> &cores)
+{
+    vector<unique_ptr<mpce::trace_recorder_t>> recorders;
+
+    if (FLAGS_trace.empty())
+    {
+        return recorders;
+    }
+
+    for (size_t i = 0; i < cores.size(); i++)
+    {
+        const string path =
+            cores.size() > 1 ? FLAGS_trace + "." + to_string(i) : FLAGS_trace;
+
+        recorders.push_back(make_unique<mpce::trace_recorder_t>(path));
+        cores[i]->set_trace_recorder(recorders.back().get());
+    }
+
+    return recorders;
+}
+
+/// Write the samples of profilers to --profile, under a frame per core if
+/// there are several.
+/// @param profilers
+void write_profiles(const vector<unique_ptr<mpce::profiler_t>> &profilers)
+{
+    if (profilers.empty())
+    {
+        return;
+    }
+
+    ofstream out(FLAGS_profile);
+
+    for (size_t i = 0; i < profilers.size(); i++)
+    {
+        profilers[i]->write_folded(
+            out, profilers.size() > 1 ? "core" + to_string(i) : "");
+    }
+
+    LOG_IF(ERROR, !out) << "cannot write profile to " << FLAGS_profile;
+}
+
+/// Run --cycles instructions, in slices of --perf_counters_interval if set,
+/// and write the performance counters as requested.
+/// @param run Runs the given number of instructions.
+/// @param perf_counters
+void run_counted(const function<void(uint64_t)> &run,
+                 const function<mpce::perf_counters_t()> &perf_counters)
+{
+    const bool write_counters =
+        FLAGS_perf_counters || FLAGS_perf_counters_interval;
+
+    if (write_counters && !mpce::COUNTERS_ENABLED)
+    {
+        LOG(WARNING) << "built without MPCE_COUNTERS, all counters are zero";
+    }
+
+    uint64_t remaining = FLAGS_cycles;
+
+    while (remaining)
+    {
+        const uint64_t interval = FLAGS_perf_counters_interval;
+        const uint64_t slice = interval ? min(remaining, interval) : remaining;
+
+        run(slice);
+        remaining -= slice;
+
+        if (FLAGS_perf_counters_interval && remaining)
+        {
+            perf_counters().write(cerr);
+        }
+    }
+
+    if (write_counters)
+    {
+        perf_counters().write(cerr);
+    }
+}
+
 int main(int argc, char *argv[])
 {
+    gflags::ParseCommandLineFlags(&argc, &argv, true);
     google::InitGoogleLogging(argv[0]);
 
     FLAGS_logtostderr = 1;
     FLAGS_stderrthreshold = 0;
     FLAGS_minloglevel = 0;
 
+    if (FLAGS_cores > 1)
+    {
+        mpce::machine_t machine(FLAGS_cores);
+
+        if (FLAGS_image.empty() || !machine.load_image(FLAGS_image))
+        {
+            LOG(ERROR) << "--cores requires a loadable --image";
+            return 1;
+        }
+
+        if (!open_disk(machine.mmio()))
+        {
+            return 1;
+        }
+
+        vector<mpce::cpu_state_t *> cores;
+
+        for (uint32_t i = 0; i < machine.core_count(); i++)
+        {
+            cores.push_back(&machine.core(i));
+        }
+
+        const auto profilers = start_profilers(cores);
+        const auto recorders = start_trace_recorders(cores);
+
+        run_counted([&](uint64_t cycles) { machine.run(cycles); },
+                    [&] { return machine.perf_counters(); });
+        write_profiles(profilers);
+        return 0;
+    }
+
     mpce::cpu_state_t cpu_state;
 
+    if (!open_disk(cpu_state.mmio()))
+    {
+        return 1;
+    }
+
+    const auto run = [&](uint64_t cycles) { cpu_state.run(cycles); };
+    const auto perf_counters = [&] {
+        mpce::perf_counters_t counters = cpu_state.perf_counters();
+        counters.add(cpu_state.mmio().perf_counters());
+
+        return counters;
+    };
+
+    if (!FLAGS_image.empty())
+    {
+        if (!cpu_state.load_image(FLAGS_image))
+        {
+            return 1;
+        }
+
+        const auto profilers = start_profilers({&cpu_state});
+        const auto recorders = start_trace_recorders({&cpu_state});
+
+        run_counted(run, perf_counters);
+        write_profiles(profilers);
+        return 0;
+    }
+
     // Load immediate to r7:
     // 32   x <- y ^ z, imm
     uint16_t inst_load_imm = 0x3200 | 1 | 7 << 3;
@@ -37,8 +268,9 @@ int main(int argc, char *argv[])
     cpu_state.mmio().get_code(false).store(4, inst_ats);
     cpu_state.mmio().get_code(false).store(5, 1);
 
-    for (int i = 0; i < 3; i++)
-    {
-        cpu_state.cycle();
-    }
+    const auto profilers = start_profilers({&cpu_state});
+    const auto recorders = start_trace_recorders({&cpu_state});
+
+    run_counted(run, perf_counters);
+    write_profiles(profilers);
 }
\ No newline at end of file
@@ -1,102 +1,495 @@
 #include "memory.h"
+#include "io_bus.h"
+
+#include <algorithm>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 namespace mpce
 {
 using namespace std;
 
-/// @param mapped_io_begin
-/// @param mapped_io_load
-/// @param mapped_io_store
-void memory_t::map_io(uint32_t mapped_io_begin,
-                      function<uint16_t(uint32_t)> mapped_io_load,
-                      function<void(uint32_t, uint16_t)> mapped_io_store)
+/// @param capacity
+memory_arena_t::memory_arena_t(const size_t capacity) : capacity_(capacity)
 {
-    mapped_io_begin_ = mapped_io_begin;
-    mapped_io_load_ = mapped_io_load;
-    mapped_io_store_ = mapped_io_store;
+    void *words = mmap(nullptr, capacity_ * sizeof(uint16_t),
+                       PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+    if (words == MAP_FAILED)
+    {
+        LOG(FATAL) << "cannot map memory arena of " << capacity_ << " words";
+        return;
+    }
+
+    words_ = static_cast<uint16_t *>(words);
 }
 
-/// @param name
-/// @param capacity
-word_addressible_memory_t::word_addressible_memory_t(const string name,
-                                                     const uint32_t capacity)
-    : memory_(capacity, 0), name_(name)
+memory_arena_t::~memory_arena_t()
 {
+    if (words_)
+    {
+        munmap(words_, capacity_ * sizeof(uint16_t));
+    }
 }
 
+/// @param words
+uint16_t *memory_arena_t::allocate(const size_t words)
+{
+    // Keep every memory host page aligned, so files can be mapped into it.
+    const size_t aligned_words =
+        (words + MEMORY_PAGE_SIZE - 1) & ~size_t{MEMORY_PAGE_SIZE - 1};
+
+    if (allocated_ + aligned_words > capacity_)
+    {
+        LOG(FATAL) << "memory arena of " << capacity_ << " words exhausted";
+        return nullptr;
+    }
+
+    uint16_t *begin = words_ + allocated_;
+    allocated_ += aligned_words;
+
+    return begin;
+}
+
+/// @param begin
+/// @param words
+void memory_arena_t::release(uint16_t *begin, const size_t words)
+{
+    // Mapping fresh anonymous pages over the range drops both committed
+    // pages and file mappings, which MADV_DONTNEED would restore instead.
+    if (mmap(begin, words * sizeof(uint16_t), PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1,
+             0) == MAP_FAILED)
+    {
+        LOG(WARNING) << "cannot release memory arena pages, zeroing them";
+        fill_n(begin, words, 0);
+    }
+}
+
+/// @param arena
 /// @param name
 /// @param capacity
-byte_addressible_memory_t::byte_addressible_memory_t(string name,
-                                                     uint32_t capacity)
-    : memory_{name, capacity}
+/// @param byte_addressible
+memory_t::memory_t(memory_arena_t &arena, const string name,
+                   const uint32_t capacity, const bool byte_addressible)
+    : pages_(MEMORY_PAGE_NUM(capacity + MEMORY_PAGE_SIZE - 1)), arena_(arena),
+      words_(arena.allocate(capacity)), capacity_(capacity),
+      addr_shift_(byte_addressible ? 1 : 0), name_(name),
+      snapshot_saved_(pages_.size()), dirty_(pages_.size())
 {
+    // Pages partially beyond the capacity stay on the slow path.
+    for (uint32_t page_num = 0; page_num < pages_.size(); page_num++)
+    {
+        if ((page_num + 1) * MEMORY_PAGE_SIZE <= capacity_)
+        {
+            uint16_t *page = words_ + page_num * MEMORY_PAGE_SIZE;
+            pages_[page_num] = {page, page};
+        }
+    }
+}
+
+/// @param io_begin
+/// @param io_bus
+void memory_t::map_io(const uint32_t io_begin, io_bus_t &io_bus)
+{
+    io_begin_ = io_begin;
+    io_bus_ = &io_bus;
+
+    // Send every page that contains an io address to the slow path.
+    const uint32_t first_page = MEMORY_PAGE_NUM(io_begin >> addr_shift_);
+
+    for (uint32_t page_num = first_page; page_num < pages_.size(); page_num++)
+    {
+        pages_[page_num] = {};
+    }
 }
 
 /// @param phys_addr
-uint16_t byte_addressible_memory_t::load_word(const uint32_t phys_addr) const
+/// @param value
+/// @param byte
+uint16_t memory_t::exchange(const uint32_t phys_addr, const uint16_t value,
+                            const bool byte)
 {
-    if (phys_addr >= capacity())
+    const uint32_t word_addr = phys_addr >> addr_shift_;
+    const uint32_t page_num = MEMORY_PAGE_NUM(word_addr);
+
+    if (page_num >= pages_.size() || !pages_[page_num].load)
     {
-        // Error condition.
-        return 0;
+        const uint16_t previous = load_slow(phys_addr, byte);
+        store_slow(phys_addr, value, byte);
+        return previous;
+    }
+
+    // The page may be write protected for a snapshot or store logging.
+    if (!pages_[page_num].store)
+    {
+        prepare_slow_store(word_addr);
+    }
+
+    uint16_t *word = words_ + word_addr;
+
+    if (byte && addr_shift_)
+    {
+        // Words are little-endian, so the odd byte is the high one.
+        static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__);
+
+        uint8_t *bytes = reinterpret_cast<uint8_t *>(word);
+        return __atomic_exchange_n(&bytes[phys_addr & 1],
+                                   static_cast<uint8_t>(value),
+                                   __ATOMIC_SEQ_CST);
     }
 
-    return get_word(phys_addr);
+    return __atomic_exchange_n(word, value, __ATOMIC_SEQ_CST);
 }
 
-/// @param phys_addr
-uint8_t byte_addressible_memory_t::load_byte(const uint32_t phys_addr) const
+/// @param word_addr
+/// @param words
+/// @param is_store
+uint16_t *memory_t::dma_words(const uint32_t word_addr, const uint32_t words,
+                              const bool is_store)
 {
-    const uint16_t entry = get_word(phys_addr);
-    const uint8_t byte_offset = phys_addr % 2;
+    if (!words || word_addr >= capacity_ || words > capacity_ - word_addr)
+    {
+        return nullptr;
+    }
+
+    const uint32_t end = word_addr + words;
+
+    // Only RAM pages have load descriptors.
+    for (uint32_t page_num = MEMORY_PAGE_NUM(word_addr);
+         page_num <= MEMORY_PAGE_NUM(end - 1); page_num++)
+    {
+        if (!pages_[page_num].load)
+        {
+            return nullptr;
+        }
+    }
+
+    if (is_store && (snapshot_taken_ || log_stores_))
+    {
+        for (uint32_t addr = word_addr; addr < end; addr++)
+        {
+            prepare_slow_store(addr);
+        }
+    }
 
-    return byte_offset ? high_byte(entry) : low_byte(entry);
+    return words_ + word_addr;
 }
 
-/// @param phys_addr
-/// @param woru
-void byte_addressible_memory_t::store_word(const uint32_t phys_addr,
-                                           const uint16_t word)
+/// @param word_addr
+/// @param words
+/// @param fd
+/// @param offset
+bool memory_t::map_file(const uint32_t word_addr, const uint64_t words,
+                        const int fd, const uint64_t offset)
 {
-    set_word(phys_addr, word);
+    if (word_addr > capacity_ || words > capacity_ - word_addr)
+    {
+        return false;
+    }
+
+    uint8_t *begin = reinterpret_cast<uint8_t *>(words_ + word_addr);
+    const uint64_t bytes = words * sizeof(uint16_t);
+    const uint64_t host_page_size = sysconf(_SC_PAGESIZE);
+
+    uint64_t mapped = 0;
+
+    if (reinterpret_cast<uintptr_t>(begin) % host_page_size == 0 &&
+        offset % host_page_size == 0)
+    {
+        // Pages past the end of the file would fault on first touch, those
+        // are left to pread to report.
+        struct stat file_stat;
+        const uint64_t file_size =
+            fstat(fd, &file_stat) < 0 ? 0 : file_stat.st_size;
+
+        mapped = file_size > offset ? min(bytes, file_size - offset) : 0;
+        mapped -= mapped % host_page_size;
+
+        if (mapped &&
+            mmap(begin, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+                 fd, offset) == MAP_FAILED)
+        {
+            mapped = 0;
+        }
+    }
+
+    // Read what could not be mapped.
+    while (mapped < bytes)
+    {
+        const ssize_t count =
+            pread(fd, begin + mapped, bytes - mapped, offset + mapped);
+
+        if (count <= 0)
+        {
+            return false;
+        }
+
+        mapped += count;
+    }
+
+    return true;
 }
 
-/// @param phys_addr
-/// @param value
-void byte_addressible_memory_t::store_byte(const uint32_t phys_addr,
-                                           const uint8_t value)
+void memory_t::clear()
 {
-    const uint16_t entry = get_word(phys_addr);
-    const uint16_t word = phys_addr % 2 ? (entry & 0x00ff) | (value << 8)
-                                        : (entry & 0xff00) | (value & 0xff);
+    arena_.release(words_, pages_.size() * MEMORY_PAGE_SIZE);
+
+    snapshot_taken_ = false;
+    snapshot_saved_.assign(pages_.size(), false);
+    snapshot_page_nums_.clear();
+    snapshot_words_.clear();
 
-    set_word(phys_addr, word);
+    for (uint32_t page_num = 0; page_num < pages_.size(); page_num++)
+    {
+        update_store_page(page_num);
+    }
 }
 
-/// @param entry
-uint8_t byte_addressible_memory_t::high_byte(const uint16_t entry)
+void memory_t::take_snapshot()
 {
-    return (entry & 0xff00) >> 8 + 0;
+    snapshot_taken_ = true;
+    snapshot_saved_.assign(pages_.size(), false);
+    snapshot_page_nums_.clear();
+    snapshot_words_.clear();
+
+    for (page_descriptor_t &page : pages_)
+    {
+        if (page.load)
+        {
+            page.store = nullptr;
+        }
+    }
 }
 
-/// @param entry
-uint8_t byte_addressible_memory_t::low_byte(const uint16_t entry)
+/// @returns
+uint32_t memory_t::restore_snapshot()
 {
-    return entry & 0xff;
+    for (size_t i = 0; i < snapshot_page_nums_.size(); i++)
+    {
+        const uint32_t page_num = snapshot_page_nums_[i];
+
+        copy_n(&snapshot_words_[i * MEMORY_PAGE_SIZE], MEMORY_PAGE_SIZE,
+               words_ + page_num * MEMORY_PAGE_SIZE);
+
+        snapshot_saved_[page_num] = false;
+        pages_[page_num].store = nullptr;
+    }
+
+    const uint32_t restored = snapshot_page_nums_.size();
+
+    // Keep the capacity, so that later restores do not allocate.
+    snapshot_page_nums_.clear();
+    snapshot_words_.clear();
+
+    return restored;
 }
 
-/// @param entry
-uint16_t byte_addressible_memory_t::get_word(const uint32_t phys_addr) const
+/// @param page_num
+void memory_t::save_snapshot_page(const uint32_t page_num)
 {
-    return memory_.load(phys_addr >> 1);
+    if (snapshot_saved_[page_num])
+    {
+        return;
+    }
+
+    const uint16_t *page = words_ + page_num * MEMORY_PAGE_SIZE;
+
+    snapshot_saved_[page_num] = true;
+    snapshot_page_nums_.push_back(page_num);
+    snapshot_words_.insert(snapshot_words_.end(), page,
+                           page + MEMORY_PAGE_SIZE);
+
+    update_store_page(page_num);
+}
+
+/// @param word_addr
+void memory_t::prepare_slow_store(const uint32_t word_addr)
+{
+    // Other cpus may save the same page or log at the same time.
+    unique_lock<mutex> guard(slow_store_lock_, defer_lock);
+
+    if (shared_)
+    {
+        guard.lock();
+    }
+
+    if (snapshot_taken_)
+    {
+        save_snapshot_page(MEMORY_PAGE_NUM(word_addr));
+    }
+
+    if (log_stores_)
+    {
+        stored_words_.push_back(word_addr);
+    }
+
+    const uint32_t page_num = MEMORY_PAGE_NUM(word_addr);
+
+    if (track_dirty_ && !dirty_[page_num])
+    {
+        dirty_[page_num] = true;
+        dirty_pages_.push_back(page_num);
+        update_store_page(page_num);
+    }
+}
+
+/// @param page_num
+void memory_t::update_store_page(const uint32_t page_num)
+{
+    page_descriptor_t &page = pages_[page_num];
+
+    uint16_t *store = page.load && !log_stores_ &&
+                              (!snapshot_taken_ || snapshot_saved_[page_num]) &&
+                              (!track_dirty_ || dirty_[page_num])
+                          ? words_ + page_num * MEMORY_PAGE_SIZE
+                          : nullptr;
+
+    // Publish the saved page before stores skip the slow path, which other
+    // cpus may be taking at the same time.
+    __atomic_store_n(&page.store, store, __ATOMIC_RELEASE);
+}
+
+/// @param enabled
+void memory_t::set_store_logging(const bool enabled)
+{
+    log_stores_ = enabled;
+    stored_words_.clear();
+
+    for (uint32_t page_num = 0; page_num < pages_.size(); page_num++)
+    {
+        update_store_page(page_num);
+    }
+}
+
+/// @param enabled
+void memory_t::set_dirty_tracking(const bool enabled)
+{
+    track_dirty_ = enabled;
+    dirty_.assign(pages_.size(), false);
+    dirty_pages_.clear();
+
+    for (uint32_t page_num = 0; page_num < pages_.size(); page_num++)
+    {
+        update_store_page(page_num);
+    }
+}
+
+/// @param out
+void memory_t::take_dirty_pages(vector<uint32_t> &out)
+{
+    unique_lock<mutex> guard(slow_store_lock_, defer_lock);
+
+    if (shared_)
+    {
+        guard.lock();
+    }
+
+    out.clear();
+    out.swap(dirty_pages_);
+
+    for (const uint32_t page_num : out)
+    {
+        dirty_[page_num] = false;
+        update_store_page(page_num);
+    }
+}
+
+/// @param shared
+void memory_t::set_shared(const bool shared)
+{
+    shared_ = shared;
+}
+
+/// @param phys_addr
+/// @param byte
+uint16_t memory_t::load_slow(const uint32_t phys_addr, const bool byte) const
+{
+    if (io_bus_ && phys_addr >= io_begin_)
+    {
+        TRACE << "rerouting load to io, phys_addr=" << phys_addr;
+        return io_bus_->load(phys_addr - io_begin_);
+    }
+
+    const uint32_t word_addr = phys_addr >> addr_shift_;
+
+    TRACE << "mem " << name_ << ": loading " << (byte ? "byte" : "word")
+          << " from addr " << phys_addr;
+
+    if (word_addr >= capacity_)
+    {
+        return 0;
+    }
+
+    const uint16_t word = words_[word_addr];
+
+    if (byte && addr_shift_)
+    {
+        return phys_addr & 1 ? word >> 8 : word & 0xff;
+    }
+
+    return word;
 }
 
 /// @param phys_addr
 /// @param value
-void byte_addressible_memory_t::set_word(const uint32_t phys_addr,
-                                         const uint16_t value)
+/// @param byte
+void memory_t::store_slow(const uint32_t phys_addr, const uint16_t value,
+                          const bool byte)
+{
+    if (io_bus_ && phys_addr >= io_begin_)
+    {
+        TRACE << "rerouting store to io, phys_addr=" << phys_addr;
+        io_bus_->store(phys_addr - io_begin_, value);
+        return;
+    }
+
+    const uint32_t word_addr = phys_addr >> addr_shift_;
+
+    TRACE << "mem " << name_ << ": storing " << (byte ? "byte" : "word") << " "
+          << value << " to addr " << phys_addr;
+
+    if (word_addr >= capacity_)
+    {
+        return;
+    }
+
+    prepare_slow_store(word_addr);
+
+    uint16_t &word = words_[word_addr];
+
+    // Like store, without touching the other byte of the word.
+    if (byte && addr_shift_)
+    {
+        reinterpret_cast<uint8_t *>(&word)[phys_addr & 1] =
+            static_cast<uint8_t>(value);
+        return;
+    }
+
+    word = value;
+}
+
+/// @param arena
+/// @param name
+/// @param capacity
+word_addressible_memory_t::word_addressible_memory_t(memory_arena_t &arena,
+                                                     const string name,
+                                                     const uint32_t capacity)
+    : memory_t(arena, name, capacity, false)
+{
+}
+
+/// @param arena
+/// @param name
+/// @param capacity
+byte_addressible_memory_t::byte_addressible_memory_t(memory_arena_t &arena,
+                                                     const string name,
+                                                     const uint32_t capacity)
+    : memory_t(arena, name, capacity, true)
 {
-    memory_.store(phys_addr >> 1, value);
 }
 
-}; // namespace mpce
\ No newline at end of file
+}; // namespace mpce
@@ -1,184 +1,407 @@
 #pragma once
 
-#include <functional>
+#include "trace.h"
+
+#include <cstdint>
 #include <iostream>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <vector>
 
-#include <glog/logging.h>
+#define MEMORY_PAGE_BITS 11
+#define MEMORY_PAGE_SIZE (1u << MEMORY_PAGE_BITS)
+#define MEMORY_PAGE_NUM(word_addr) ((word_addr) >> MEMORY_PAGE_BITS)
+#define MEMORY_PAGE_OFFSET(word_addr) ((word_addr) & (MEMORY_PAGE_SIZE - 1))
 
 using namespace std;
 
 namespace mpce
 {
 
-class memory_t
+class io_bus_t;
+
+/// One contiguous anonymous host mapping that memories take their words from,
+/// so that all guest physical memory lives in a single arena. The mapping
+/// reserves address space without commit charge: host pages are committed on
+/// the first store to them, and loads from untouched pages read the host's
+/// shared zero page, so an instance costs memory only for the pages its
+/// guest writes.
+class memory_arena_t
 {
   private:
-    ///
-    optional<function<uint16_t(uint32_t)>> mapped_io_load_;
+    uint16_t *words_ = nullptr;
 
-    ///
-    optional<function<void(uint32_t, uint16_t)>> mapped_io_store_;
+    /// Capacity in words.
+    size_t capacity_;
 
-    ///
-    uint32_t mapped_io_begin_;
+    /// Words handed out by allocate.
+    size_t allocated_ = 0;
 
   public:
-    /// @param phys_addr
-    /// @param byte
-    ///@returns description of the return value
-    virtual uint16_t load(uint32_t phys_addr, bool byte = false) const
-    {
-        if (mapped_io_load_ && phys_addr > mapped_io_begin_)
-        {
-            LOG(INFO) << "rerouting load to io, phys_addr=" << phys_addr;
-            return (*mapped_io_load_)(phys_addr - mapped_io_begin_ - 1);
-        }
+    /// @param capacity Total words of all memories in the arena.
+    explicit memory_arena_t(const size_t capacity);
 
-        return do_load(phys_addr, byte);
-    }
+    ~memory_arena_t();
 
-    /// @param phys_addr
-    /// @param value
-    /// @param byte
-    virtual void store(uint32_t phys_addr, uint16_t value, bool byte = false)
-    {
-        if (mapped_io_store_ && phys_addr > mapped_io_begin_)
-        {
-            LOG(INFO) << "rerouting store to io, phys_addr=" << phys_addr;
-            (*mapped_io_store_)(phys_addr - mapped_io_begin_ - 1, value);
-            return;
-        }
+    memory_arena_t(const memory_arena_t &) = delete;
 
-        do_store(phys_addr, value, byte);
-    };
+    memory_arena_t &operator=(const memory_arena_t &) = delete;
 
-    /// @returns
-    virtual uint32_t capacity() const = 0;
+    /// @param words
+    /// @returns Zeroed storage for words words, valid as long as the arena.
+    /// The storage starts on a MEMORY_PAGE_SIZE boundary.
+    uint16_t *allocate(const size_t words);
 
-    /// @param mapped_io_begin
-    /// @param mapped_io_load
-    /// @param mapped_io_store
-    void map_io(uint32_t mapped_io_begin,
-                function<uint16_t(uint32_t)> mapped_io_load,
-                function<void(uint32_t, uint16_t)> mapped_io_store);
+    /// Zero words words at begin and return their host pages to the
+    /// untouched state, dropping any file mapped over them.
+    /// @param begin Storage returned by allocate.
+    /// @param words A multiple of MEMORY_PAGE_SIZE.
+    void release(uint16_t *begin, const size_t words);
+};
 
-  protected:
-    virtual void do_store(uint32_t, uint16_t, bool) = 0;
+/// Where the words of one MEMORY_PAGE_SIZE page of a memory are stored.
+struct page_descriptor_t
+{
+    /// Words of the page for loads, nullptr if loads take the slow path.
+    const uint16_t *load = nullptr;
 
-    virtual uint16_t do_load(uint32_t, bool) const = 0;
+    /// Words of the page for stores, nullptr if stores take the slow path.
+    uint16_t *store = nullptr;
 };
 
-class word_addressible_memory_t : public memory_t
+/// A physical memory, made of pages in a memory_arena_t. Loads and stores to
+/// RAM pages are resolved inline through the page descriptors; only pages
+/// overlapping the mapped io region and addresses beyond the capacity take
+/// the slow path.
+class memory_t
 {
   private:
     ///
-    vector<uint16_t> memory_;
+    vector<page_descriptor_t> pages_;
+
+    ///
+    memory_arena_t &arena_;
+
+    /// Storage of all pages.
+    uint16_t *words_;
+
+    /// Capacity in words.
+    uint32_t capacity_;
+
+    /// 1 if addresses are byte addresses, 0 if they are word addresses.
+    uint32_t addr_shift_;
 
     ///
     string name_;
 
+    /// Devices of the mapped io region, nullptr if there is none.
+    io_bus_t *io_bus_ = nullptr;
+
+    /// First address of the mapped io region.
+    uint32_t io_begin_ = UINT32_MAX;
+
+    /// Whether stores save the pages they touch first for restore_snapshot.
+    bool snapshot_taken_ = false;
+
+    /// Whether each page is saved in snapshot_words_.
+    vector<bool> snapshot_saved_;
+
+    /// Page numbers of the saved pages.
+    vector<uint32_t> snapshot_page_nums_;
+
+    /// Contents of the saved pages at the time of the snapshot, one
+    /// MEMORY_PAGE_SIZE run per entry of snapshot_page_nums_.
+    vector<uint16_t> snapshot_words_;
+
+    /// Whether stores append their word address to stored_words_.
+    bool log_stores_ = false;
+
+    /// Word addresses of the RAM stores since the last take_stored_words.
+    vector<uint32_t> stored_words_;
+
+    /// Whether the first store to a page since the last take_dirty_pages
+    /// takes the slow path to add it to dirty_pages_.
+    bool track_dirty_ = false;
+
+    /// Whether each page is in dirty_pages_.
+    vector<bool> dirty_;
+
+    /// Page numbers of the pages stored to since the last take_dirty_pages.
+    vector<uint32_t> dirty_pages_;
+
+    /// Serializes saving and logging on the slow path once several cpus
+    /// share the memory.
+    mutex slow_store_lock_;
+
+    bool shared_ = false;
+
   public:
+    /// @param arena
     /// @param name
-    /// @param capacity
-    word_addressible_memory_t(const string name, const uint32_t capacity);
+    /// @param capacity In words.
+    /// @param byte_addressible Whether addresses are byte addresses.
+    memory_t(memory_arena_t &arena, const string name, const uint32_t capacity,
+             const bool byte_addressible);
 
-    /// @returns The number of words that this memory holds.
-    uint32_t capacity() const override
+    memory_t(const memory_t &) = delete;
+
+    memory_t &operator=(const memory_t &) = delete;
+
+    /// @param phys_addr
+    /// @param byte Load a single byte. Ignored by word addressible memory.
+    /// @returns The word or zero extended byte at phys_addr.
+    uint16_t load(const uint32_t phys_addr, const bool byte = false) const
     {
-        return memory_.capacity();
+        const uint32_t word_addr = phys_addr >> addr_shift_;
+        const uint32_t page_num = MEMORY_PAGE_NUM(word_addr);
+
+        if (page_num < pages_.size() && pages_[page_num].load)
+        {
+            const uint16_t word =
+                pages_[page_num].load[MEMORY_PAGE_OFFSET(word_addr)];
+
+            if (byte && addr_shift_)
+            {
+                return phys_addr & 1 ? word >> 8 : word & 0xff;
+            }
+
+            return word;
+        }
+
+        return load_slow(phys_addr, byte);
     }
 
-  protected:
     /// @param phys_addr
-    /// @param byte
-    uint16_t do_load(uint32_t phys_addr, bool byte = false) const override
+    /// @param value
+    /// @param byte Store the low byte of value only. Ignored by word
+    /// addressible memory.
+    void store(const uint32_t phys_addr, const uint16_t value,
+               const bool byte = false)
     {
-        LOG(INFO) << "mem " << name_ << ": loading " << (byte ? "byte" : "word")
-                  << " from addr " << phys_addr;
+        const uint32_t word_addr = phys_addr >> addr_shift_;
+        const uint32_t page_num = MEMORY_PAGE_NUM(word_addr);
+
+        // Another cpu may set the pointer once it saved the page, see
+        // update_store_page.
+        uint16_t *page = page_num < pages_.size()
+                             ? __atomic_load_n(&pages_[page_num].store,
+                                               __ATOMIC_ACQUIRE)
+                             : nullptr;
 
-        return memory_.at(phys_addr);
+        if (page)
+        {
+            uint16_t &word = page[MEMORY_PAGE_OFFSET(word_addr)];
+
+            // Store the byte alone, so that a concurrent store by another
+            // cpu to the other byte of the word is not lost. Words are
+            // little-endian, so the odd byte is the high one.
+            if (byte && addr_shift_)
+            {
+                reinterpret_cast<uint8_t *>(&word)[phys_addr & 1] =
+                    static_cast<uint8_t>(value);
+                return;
+            }
+
+            word = value;
+            return;
+        }
+
+        store_slow(phys_addr, value, byte);
     }
 
+    /// Atomically replace the word or byte at phys_addr, as a full barrier
+    /// for the accesses of every cpu sharing this memory. Mapped io and
+    /// addresses beyond the capacity are not atomic.
     /// @param phys_addr
     /// @param value
-    void do_store(uint32_t phys_addr, uint16_t value,
-                  bool byte = false) override
+    /// @param byte Exchange the low byte of value only. Ignored by word
+    /// addressible memory.
+    /// @returns The previous word or zero extended byte.
+    uint16_t exchange(const uint32_t phys_addr, const uint16_t value,
+                      const bool byte = false);
+
+    /// @param word_addr Below the capacity.
+    /// @returns The word at word_addr, bypassing mapped io.
+    uint16_t word(const uint32_t word_addr) const
     {
-        LOG(INFO) << "mem " << name_ << ": storing " << (byte ? "byte" : "word")
-                  << " " << value << " to addr " << phys_addr;
+        return words_[word_addr];
+    }
 
-        memory_.at(phys_addr) = value;
+    /// @param page_num Below page_count.
+    /// @returns The words of the page, bypassing mapped io. Words beyond the
+    /// capacity are not part of the memory.
+    const uint16_t *page_words(const uint32_t page_num) const
+    {
+        return words_ + page_num * MEMORY_PAGE_SIZE;
     }
-};
 
-class byte_addressible_memory_t : public memory_t
-{
-  private:
-    /// Todo: The state in memory_ should be inherited from memory_t by both
-    /// word_addressible_memory_t and byte_addressible_memory_t.
+    /// Hand words words from word_addr to a device that accesses them
+    /// directly, possibly from another thread. Words a device stores to are
+    /// saved for restore_snapshot and logged first, as if stored by the cpu.
+    /// @param word_addr
+    /// @param words
+    /// @param is_store Whether the device stores to the words.
+    /// @returns The words, nullptr if the range is empty, exceeds the
+    /// capacity or overlaps mapped io.
+    uint16_t *dma_words(const uint32_t word_addr, const uint32_t words,
+                        const bool is_store);
 
-    /// Word addressible base memory.
-    word_addressible_memory_t memory_;
+    /// @returns The number of words that this memory holds.
+    uint32_t capacity() const
+    {
+        return capacity_;
+    }
 
-  public:
-    /// @param name
-    /// @param capacity
-    byte_addressible_memory_t(string name, uint32_t capacity);
+    /// @returns Whether addresses are byte addresses.
+    bool byte_addressible() const
+    {
+        return addr_shift_;
+    }
 
-    /// @returns memory_t capacity in words.
-    uint32_t capacity() const override
+    /// @returns The page descriptors, for generated code. They stay in place
+    /// for the lifetime of the memory.
+    const page_descriptor_t *page_descriptors() const
     {
-        return memory_.capacity();
+        return pages_.data();
     }
 
-  protected:
-    uint16_t do_load(const uint32_t phys_addr, bool byte) const override
+    /// @returns The number of page descriptors.
+    uint32_t page_count() const
     {
-        return byte ? load_byte(phys_addr) : load_word(phys_addr);
+        return pages_.size();
     }
 
-    void do_store(const uint32_t phys_addr, uint16_t value, bool byte) override
+    /// Fill words words starting at word_addr from fd at offset, a file of
+    /// little-endian words. Whole host pages are mapped copy-on-write straight
+    /// from the file when word_addr and offset allow it, so they are read on
+    /// first touch and never written back; the rest, including any pages past
+    /// the end of the file, is read immediately. The words are not saved for
+    /// restore_snapshot.
+    /// @param word_addr
+    /// @param words
+    /// @param fd
+    /// @param offset In bytes.
+    /// @returns False if the range exceeds the capacity or fd cannot be read.
+    bool map_file(const uint32_t word_addr, const uint64_t words, const int fd,
+                  const uint64_t offset);
+
+    /// Zero all words and release their host pages, so that the memory costs
+    /// nothing until it is touched again. Drops the snapshot.
+    void clear();
+
+    /// Remember the current contents for restore_snapshot, replacing any
+    /// previous snapshot. Nothing is copied: RAM page descriptors lose their
+    /// store pointers, and the first store to each page saves its contents
+    /// before restoring the pointer.
+    void take_snapshot();
+
+    /// Return to the contents at take_snapshot, copying back only the pages
+    /// stored to since. The snapshot stays valid for further restores.
+    /// @returns The number of pages restored.
+    uint32_t restore_snapshot();
+
+    /// Log the word address of every RAM store and exchange, or stop
+    /// logging. While logging, RAM page descriptors lose their store
+    /// pointers, so stores take the slow path; memories that do not log pay
+    /// nothing.
+    /// @param enabled
+    void set_store_logging(const bool enabled);
+
+    /// Move the word addresses logged since the last call to out, replacing
+    /// its contents. Addresses stored to repeatedly appear repeatedly.
+    /// @param out
+    void take_stored_words(vector<uint32_t> &out)
     {
-        if (byte)
+        unique_lock<mutex> guard(slow_store_lock_, defer_lock);
+
+        if (shared_)
         {
-            store_byte(phys_addr, value);
+            guard.lock();
         }
-        else
+
+        // Swapping keeps the capacity of both, so that logging does not
+        // allocate once warmed up.
+        out.clear();
+
+        if (!stored_words_.empty())
         {
-            store_word(phys_addr, value);
+            out.swap(stored_words_);
         }
     }
 
-  private:
-    /// @param phys_addr
-    uint16_t load_word(const uint32_t phys_addr) const;
-
-    /// @param phys_addr
-    uint8_t load_byte(const uint32_t phys_addr) const;
+    /// Track the pages stored to, or stop tracking. Unlike store logging,
+    /// only the first store to a page since the last take_dirty_pages takes
+    /// the slow path, so inline and generated stores keep their speed.
+    /// @param enabled
+    void set_dirty_tracking(const bool enabled);
+
+    /// Move the numbers of the pages stored to since the last call to out,
+    /// replacing its contents, and send their next store to the slow path
+    /// again.
+    /// @param out
+    void take_dirty_pages(vector<uint32_t> &out);
+
+    /// Serialize the saving and logging of stores, for memories shared by
+    /// several cpus. Fast path stores are not affected.
+    /// @param shared
+    void set_shared(const bool shared);
+
+    /// Route accesses to addresses from io_begin on to io_bus, at their
+    /// offset from io_begin.
+    /// @param io_begin
+    /// @param io_bus Must outlive the memory.
+    void map_io(const uint32_t io_begin, io_bus_t &io_bus);
 
+  private:
+    /// Access mapped io, or RAM of a page without descriptor. Loads beyond
+    /// the capacity return 0, stores beyond it are dropped.
     /// @param phys_addr
-    /// @param woru
-    void store_word(const uint32_t phys_addr, const uint16_t word);
+    /// @param byte
+    uint16_t load_slow(const uint32_t phys_addr, const bool byte) const;
 
     /// @param phys_addr
     /// @param value
-    void store_byte(const uint32_t phys_addr, const uint8_t value);
-
-    /// @param entry
-    static inline uint8_t high_byte(const uint16_t entry);
-
-    /// @param entry
-    static inline uint8_t low_byte(const uint16_t entry);
+    /// @param byte
+    void store_slow(const uint32_t phys_addr, const uint16_t value,
+                    const bool byte);
+
+    /// Save page_num for restore_snapshot unless already saved, and make
+    /// stores to it take the fast path again unless logging stores.
+    /// @param page_num
+    void save_snapshot_page(const uint32_t page_num);
+
+    /// Snapshot and log a RAM store to word_addr on the slow path.
+    /// @param word_addr Below the capacity.
+    void prepare_slow_store(const uint32_t word_addr);
+
+    /// Give a RAM page its store pointer back, unless it awaits saving for
+    /// a snapshot or stores are logged.
+    /// @param page_num
+    void update_store_page(const uint32_t page_num);
+};
 
-    /// @param entry
-    uint16_t get_word(const uint32_t phys_addr) const;
+/// Memory addressed in words.
+class word_addressible_memory_t : public memory_t
+{
+  public:
+    /// @param arena
+    /// @param name
+    /// @param capacity
+    word_addressible_memory_t(memory_arena_t &arena, const string name,
+                              const uint32_t capacity);
+};
 
-    /// @param phys_addr
-    /// @param value
-    void set_word(const uint32_t phys_addr, const uint16_t value);
+/// Memory addressed in bytes, with word accesses reading the word that
+/// contains the byte.
+class byte_addressible_memory_t : public memory_t
+{
+  public:
+    /// @param arena
+    /// @param name
+    /// @param capacity In words.
+    byte_addressible_memory_t(memory_arena_t &arena, const string name,
+                              const uint32_t capacity);
 };
 
-} // namespace mpce
\ No newline at end of file
+} // namespace mpce
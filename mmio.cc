@@ -5,28 +5,28 @@ namespace mpce
 
 ///
 MMIO::MMIO()
-    : mapped_io_load_{mapped_io_size_}, mapped_io_store_{mapped_io_size_}
 {
-    using namespace placeholders;
-
-    LOG(INFO) << "initializing mmio\n";
-
-    kern_data_.map_io(mapped_io_begin_, bind(&MMIO::io_load, this, _1),
-                      bind(&MMIO::io_store, this, _1, _2));
-
-    /// register_t the mapped IO handlers for the serial console.
-
-    mapped_io_load_.at(0x00) =
-        bind(&io_serial_interface_t::mmio_read, &serial_interface_);
-
-    mapped_io_store_.at(0x00) =
-        bind(&io_serial_interface_t::mmio_write, &serial_interface_, _1);
-
-    mapped_io_store_.at(0x01) =
-        bind(&io_serial_interface_t::mmio_buffer_nonempty, &serial_interface_);
-
-    irq_notifiers_.push_back(
-        bind(&io_serial_interface_t::mmio_irq_notify, &serial_interface_, _1));
+    TRACE << "initializing mmio";
+
+    kern_data_.map_io(MMIO_IO_BEGIN, io_bus_);
+
+    // The serial console requests IRQ1 while input is buffered.
+    io_bus_.attach(serial_interface_, IRQ1);
+    io_bus_.map<io_serial_interface_t, &io_serial_interface_t::mmio_load,
+                &io_serial_interface_t::mmio_store>(serial_interface_,
+                                                    SERIAL_IO_OFFSET, 2);
+
+    // The disk requests IRQ2 once a transfer completed.
+    io_bus_.attach(disk_interface_, IRQ2);
+    io_bus_.map<io_disk_interface_t, &io_disk_interface_t::mmio_load,
+                &io_disk_interface_t::mmio_store>(
+        disk_interface_, DISK_IO_OFFSET, DISK_REG_NUM);
+
+    // The dma engine requests IRQ3 once a transfer completed.
+    io_bus_.attach(dma_interface_, IRQ3);
+    io_bus_.map<io_dma_interface_t, &io_dma_interface_t::mmio_load,
+                &io_dma_interface_t::mmio_store>(dma_interface_, DMA_IO_OFFSET,
+                                                 DMA_REG_NUM);
 }
 
 /// @param is_user_mode
@@ -47,29 +47,71 @@ io_serial_interface_t &MMIO::serial_interface()
     return serial_interface_;
 }
 
+/// @returns
+io_disk_interface_t &MMIO::disk_interface()
+{
+    return disk_interface_;
+}
+
+/// @returns
+io_dma_interface_t &MMIO::dma_interface()
+{
+    return dma_interface_;
+}
+
+/// @returns
+io_bus_t &MMIO::io_bus()
+{
+    return io_bus_;
+}
+
 /// @param interrupt
 void MMIO::irq_notify(interrupt_t &interrupt)
 {
-    for (auto notify : irq_notifiers_)
-    {
-        notify(interrupt);
-    }
+    io_bus_.irq_notify(interrupt);
+}
+
+/// @returns
+bool MMIO::take_device_event()
+{
+    return io_bus_.take_event();
+}
+
+/// @returns
+bool MMIO::devices_may_raise_event() const
+{
+    return io_bus_.may_raise_event();
+}
+
+/// @param seen
+/// @param timeout
+bool MMIO::wait_device_event(const uint64_t seen,
+                             const chrono::nanoseconds timeout)
+{
+    return io_bus_.wait_event(seen, timeout);
 }
 
-/// @param offset
 /// @returns
-uint16_t MMIO::io_load(const uint32_t offset)
+perf_counters_t MMIO::perf_counters() const
 {
-    LOG(INFO) << "mapped io_load: offset=" << offset;
-    return mapped_io_load_.at(offset)();
+    return io_bus_.perf_counters();
 }
 
-/// @param offset
-/// @param value
-void MMIO::io_store(const uint32_t offset, const uint16_t value)
+/// @param mmu
+void MMIO::attach_cpu(const mmu_t &mmu)
 {
-    LOG(INFO) << "mapped io_store: offset=" << offset << ", value=" << value;
-    return mapped_io_store_.at(offset)(value);
+    cpu_count_++;
+    io_bus_.set_shared(cpu_count_ > 1);
+
+    for (const bool user_mode : {false, true})
+    {
+        get_code(user_mode).set_shared(cpu_count_ > 1);
+        get_data(user_mode).set_shared(cpu_count_ > 1);
+    }
+
+    // Virtual transfers would need the page tables of the cpu storing the
+    // command, which the device cannot tell apart.
+    dma_interface_.set_mmu(cpu_count_ == 1 ? &mmu : nullptr);
 }
 
 }; // namespace mpce
\ No newline at end of file
@@ -1,10 +1,28 @@
 #pragma once
 
 #include "interrupt.h"
+#include "io_bus.h"
+#include "io_disk.h"
+#include "io_dma.h"
 #include "io_serial.h"
 #include "memory.h"
+#include "mmu.h"
+#include "perf_counters.h"
 
-#include <functional>
+#include <atomic>
+#include <chrono>
+
+/// Kernel data address of the first mapped io register.
+#define MMIO_IO_BEGIN (0x1'0000 - IO_BUS_SIZE)
+
+/// Offset of the serial data and status registers.
+#define SERIAL_IO_OFFSET 0x000
+
+/// Offset of the disk registers, see DISK_REG_SECTOR_LOW.
+#define DISK_IO_OFFSET 0x010
+
+/// Offset of the dma registers, see DMA_REG_SRC_LOW.
+#define DMA_IO_OFFSET 0x020
 
 namespace mpce
 {
@@ -13,28 +31,33 @@ using namespace std;
 
 class MMIO
 {
+    /// Physical memory of all segments.
+    memory_arena_t arena_{2 * 0x1'0000 + 2 * 0x80'0000};
+
     /// memory_t segments for KERN mode.
-    word_addressible_memory_t kern_code_{"kern_code", 0x1'0000};
-    byte_addressible_memory_t kern_data_{"kern_data", 0x1'0000};
+    word_addressible_memory_t kern_code_{arena_, "kern_code", 0x1'0000};
+    byte_addressible_memory_t kern_data_{arena_, "kern_data", 0x1'0000};
 
     /// memory_t segments for USER mode.
-    word_addressible_memory_t user_code_{"user_code", 0x80'0000};
-    byte_addressible_memory_t user_data_{"user_data", 0x80'0000};
+    word_addressible_memory_t user_code_{arena_, "user_code", 0x80'0000};
+    byte_addressible_memory_t user_data_{arena_, "user_data", 0x80'0000};
 
-    /// The mapped io region is pow(2, 12) in size.
-    const uint32_t mapped_io_size_ = 0x1000;
+    /// Devices of the mapped io region.
+    io_bus_t io_bus_;
 
-    /// The last address directly before the beginning of the mapped io region,
-    /// the address preceding 0xf000 is 0xefff.
-    const uint32_t mapped_io_begin_ = 0x1'0000 - mapped_io_size_ - 1;
+    io_serial_interface_t serial_interface_;
 
-    vector<function<uint16_t()>> mapped_io_load_;
+    /// Transfers to and from the data memories above, so declared after
+    /// them to stop first.
+    io_disk_interface_t disk_interface_{kern_data_, user_data_};
 
-    vector<function<void(uint16_t)>> mapped_io_store_;
+    io_dma_interface_t dma_interface_{kern_data_, user_data_};
 
-    io_serial_interface_t serial_interface_;
+    /// Cpus constructed with this MMIO.
+    uint32_t cpu_count_ = 0;
 
-    vector<function<void(interrupt_t &)>> irq_notifiers_;
+    /// Stores to code memory by all cpus sharing this MMIO.
+    atomic<uint64_t> code_generation_{0};
 
   public:
     ///
@@ -49,16 +72,68 @@ class MMIO
     /// @returns
     io_serial_interface_t &serial_interface();
 
+    /// @returns The block device, requesting IRQ2.
+    io_disk_interface_t &disk_interface();
+
+    /// @returns The copy and fill engine, requesting IRQ3.
+    io_dma_interface_t &dma_interface();
+
+    /// @returns The bus of the mapped io region, to add devices to. Devices
+    /// must be added before any cpu runs.
+    io_bus_t &io_bus();
+
     /// @param interrupt
     void irq_notify(interrupt_t &interrupt);
 
-  private:
-    /// @param offset
-    /// @returns
-    uint16_t io_load(const uint32_t offset);
-
-    /// @param offset
-    /// @param value
-    void io_store(const uint32_t offset, const uint16_t value);
+    /// @returns True if any device raised an event since the last call, in
+    /// which case irq_notify must be called to pick up its request lines.
+    bool take_device_event();
+
+    /// @returns The number of device events so far, for wait_device_event.
+    uint64_t device_event_count() const
+    {
+        return io_bus_.event_count();
+    }
+
+    /// @returns Whether a device can raise an event while no cpu accesses
+    /// it. Otherwise device state only changes through the cpus.
+    bool devices_may_raise_event() const;
+
+    /// Block until a device raises an event after device_event_count returned
+    /// seen.
+    /// @param seen
+    /// @param timeout
+    /// @returns False if timeout passed first.
+    bool wait_device_event(const uint64_t seen,
+                           const chrono::nanoseconds timeout);
+
+    /// @returns The mapped io loads and stores of all cpus so far.
+    perf_counters_t perf_counters() const;
+
+    /// Register a cpu that uses this MMIO. Must be called before any cpu
+    /// runs. The dma engine translates virtual addresses through the page
+    /// tables of the only cpu, and fails them once a second one attaches.
+    /// @param mmu
+    void attach_cpu(const mmu_t &mmu);
+
+    /// @returns The number of cpus attached.
+    uint32_t cpu_count() const
+    {
+        return cpu_count_;
+    }
+
+    /// @returns The number of stores to code memory so far. A cpu that sees
+    /// it change drops its translations of code memory.
+    uint64_t code_generation() const
+    {
+        return code_generation_.load(memory_order_acquire);
+    }
+
+    /// Count a store to code memory, after it was made.
+    /// @returns The new code generation.
+    uint64_t code_stored()
+    {
+        return code_generation_.fetch_add(1, memory_order_acq_rel) + 1;
+    }
 };
 } // namespace mpce
\ No newline at end of file
@@ -6,28 +6,60 @@ uint32_t mmu_t::resolve(const uint16_t virt_addr, uint8_t ptb,
                         const bool use_data_page_table, const bool is_write,
                         interrupt_t &interrupt)
 {
-    const word_addressible_memory_t &page_table =
-        use_data_page_table ? page_table_data_ : page_table_code_;
-
     const uint32_t offset = VIRT_PAGE_OFFSET(virt_addr);
     const uint32_t page_number = VIRT_PAGE_NUM(virt_addr);
     const uint32_t pte_lookup_index = PTE_LOOKUP_INDEX(ptb, page_number, false);
 
-    const uint16_t page_table_entry = page_table.load(pte_lookup_index);
+    const uint16_t page_table_entry =
+        load_page_table_entry(use_data_page_table, pte_lookup_index);
 
     if (IS_PTE_UNMAPPED(page_table_entry))
     {
         interrupt.signal(PG_FAULT);
+
+        if (COUNTERS_ENABLED)
+        {
+            page_faults_++;
+        }
     }
 
     if (IS_PTE_READ_ONLY(page_table_entry) && is_write)
     {
         interrupt.signal(RO_FAULT);
+
+        if (COUNTERS_ENABLED)
+        {
+            read_only_faults_++;
+        }
     }
 
     return PHYS_ADDR(page_table_entry, offset);
 }
 
+bool mmu_t::lookup(const uint16_t virt_addr, uint8_t ptb,
+                   const bool use_data_page_table, const bool is_write,
+                   uint32_t &phys_addr) const
+{
+    const word_addressible_memory_t &page_table =
+        use_data_page_table ? page_table_data_ : page_table_code_;
+
+    const uint32_t offset = VIRT_PAGE_OFFSET(virt_addr);
+    const uint32_t page_number = VIRT_PAGE_NUM(virt_addr);
+    const uint32_t pte_lookup_index = PTE_LOOKUP_INDEX(ptb, page_number, false);
+
+    const uint16_t page_table_entry = page_table.load(pte_lookup_index);
+
+    if (IS_PTE_UNMAPPED(page_table_entry) ||
+        (IS_PTE_READ_ONLY(page_table_entry) && is_write))
+    {
+        return false;
+    }
+
+    phys_addr = PHYS_ADDR(page_table_entry, offset);
+
+    return true;
+}
+
 word_addressible_memory_t &mmu_t::page_table(bool is_data)
 {
     if (is_data)
@@ -40,6 +72,73 @@ word_addressible_memory_t &mmu_t::page_table(bool is_data)
     }
 }
 
+/// @param is_data
+/// @param pte_lookup_index
+/// @param page_table_entry
+void mmu_t::store_page_table_entry(const bool is_data,
+                                   const uint32_t pte_lookup_index,
+                                   const uint16_t page_table_entry)
+{
+    page_table(is_data).store(pte_lookup_index, page_table_entry);
+
+    // Only the entry of this ptb and page changes, entries of other
+    // processes stay cached.
+    tlb_entry_t &entry =
+        (is_data ? data_tlb_ : code_tlb_)[TLB_INDEX(pte_lookup_index)];
+
+    if (entry.tag == pte_lookup_index)
+    {
+        entry.page_table_entry = page_table_entry;
+    }
+}
+
+void mmu_t::flush_tlb()
+{
+    code_tlb_.fill({});
+    data_tlb_.fill({});
+}
+
+/// @returns
+uint64_t mmu_t::tlb_hits() const
+{
+    return tlb_hits_;
+}
+
+/// @returns
+uint64_t mmu_t::tlb_misses() const
+{
+    return tlb_misses_;
+}
+
+/// @param counters
+void mmu_t::add_perf_counters(perf_counters_t &counters) const
+{
+    counters.page_faults += page_faults_;
+    counters.read_only_faults += read_only_faults_;
+}
+
+/// @param is_data
+/// @param pte_lookup_index
+uint16_t mmu_t::load_page_table_entry(const bool is_data,
+                                      const uint32_t pte_lookup_index)
+{
+    tlb_entry_t &entry =
+        (is_data ? data_tlb_ : code_tlb_)[TLB_INDEX(pte_lookup_index)];
+
+    if (entry.tag == pte_lookup_index)
+    {
+        tlb_hits_++;
+        return entry.page_table_entry;
+    }
+
+    tlb_misses_++;
+
+    entry.tag = pte_lookup_index;
+    entry.page_table_entry = page_table(is_data).load(pte_lookup_index);
+
+    return entry.page_table_entry;
+}
+
 /// @returns True if a read only fault has occurred.
 bool mmu_t::read_only_fault()
 {
@@ -2,6 +2,10 @@
 
 #include "interrupt.h"
 #include "memory.h"
+#include "perf_counters.h"
+
+#include <array>
+#include <cstdint>
 
 #define VIRT_PAGE_NUM(a) (static_cast<uint32_t>(((a)&0xfe00) >> 9))
 #define VIRT_PAGE_OFFSET(a) (static_cast<uint32_t>((a)&0x01ff))
@@ -12,15 +16,48 @@
 #define IS_PTE_READ_ONLY(pte) (static_cast<bool>(pte & 0x4000))
 #define IS_PTE_UNMAPPED(pte) (static_cast<bool>((pte)&0x8000))
 
+#define TLB_SIZE 0x400
+#define TLB_INDEX(pte_lookup_index)                                            \
+    (((pte_lookup_index) ^ ((pte_lookup_index) >> 10)) & (TLB_SIZE - 1))
+#define TLB_INVALID UINT32_MAX
+
 namespace mpce
 {
 
+/// A page table entry cached by the TLB.
+struct tlb_entry_t
+{
+    /// PTE_LOOKUP_INDEX of the entry, which includes the ptb, or
+    /// TLB_INVALID.
+    uint32_t tag = TLB_INVALID;
+
+    uint16_t page_table_entry = 0;
+};
+
 class mmu_t
 {
   private:
-    word_addressible_memory_t page_table_code_{"page_table_code", 0x1'0000};
+    memory_arena_t page_table_arena_{2 * 0x1'0000};
+
+    word_addressible_memory_t page_table_code_{page_table_arena_,
+                                               "page_table_code", 0x1'0000};
 
-    word_addressible_memory_t page_table_data_{"page_table_data", 0x1'0000};
+    word_addressible_memory_t page_table_data_{page_table_arena_,
+                                               "page_table_data", 0x1'0000};
+
+    /// Direct mapped TLBs for both page tables. Entries are tagged by ptb, so
+    /// switching processes does not flush them.
+    array<tlb_entry_t, TLB_SIZE> code_tlb_;
+    array<tlb_entry_t, TLB_SIZE> data_tlb_;
+
+    uint64_t tlb_hits_ = 0;
+
+    uint64_t tlb_misses_ = 0;
+
+    /// Faults signalled by resolve, counted if COUNTERS_ENABLED.
+    uint64_t page_faults_ = 0;
+
+    uint64_t read_only_faults_ = 0;
 
     bool read_only_fault_ = false;
 
@@ -37,10 +74,52 @@ class mmu_t
                      const bool use_data_page_table, const bool is_write,
                      interrupt_t &interrupt);
 
+    /// Translate virt_addr like resolve, but without raising faults.
+    /// @param virt_addr
+    /// @param ptb
+    /// @param use_data_page_table
+    /// @param is_write
+    /// @param phys_addr Set to the physical address if the page is mapped.
+    /// @return False if the page is unmapped, or read only and is_write.
+    bool lookup(const uint16_t virt_addr, uint8_t ptb,
+                const bool use_data_page_table, const bool is_write,
+                uint32_t &phys_addr) const;
+
+    /// Page tables can be written through this directly while no cpu runs,
+    /// otherwise use store_page_table_entry or call flush_tlb afterwards.
     /// @param is_data
     /// @return
     word_addressible_memory_t &page_table(bool is_data);
 
+    /// Store a page table entry, updating the TLB.
+    /// @param is_data
+    /// @param pte_lookup_index
+    /// @param page_table_entry
+    void store_page_table_entry(const bool is_data,
+                                const uint32_t pte_lookup_index,
+                                const uint16_t page_table_entry);
+
+    /// Drop all cached page table entries.
+    void flush_tlb();
+
+    /// @returns The number of translations served by the TLB.
+    uint64_t tlb_hits() const;
+
+    /// @returns The number of translations that loaded the page table.
+    uint64_t tlb_misses() const;
+
+    /// @param is_data
+    /// @returns The TLB of a page table, for generated code, which looks up
+    /// entries without counting hits.
+    const tlb_entry_t *tlb(const bool is_data) const
+    {
+        return is_data ? data_tlb_.data() : code_tlb_.data();
+    }
+
+    /// Add the faults signalled by resolve to counters.
+    /// @param counters
+    void add_perf_counters(perf_counters_t &counters) const;
+
     /// @returns True if a read only fault has occurred.
     bool read_only_fault();
 
@@ -52,6 +131,13 @@ class mmu_t
 
     /// Reset fault flags to false.
     void reset_fault();
+
+  private:
+    /// @param is_data
+    /// @param pte_lookup_index
+    /// @returns The page table entry, from the TLB if cached.
+    uint16_t load_page_table_entry(const bool is_data,
+                                   const uint32_t pte_lookup_index);
 };
 
 }; // namespace mpce
\ No newline at end of file
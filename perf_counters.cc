@@ -0,0 +1,124 @@
+#include "perf_counters.h"
+
+#include <iomanip>
+
+namespace mpce
+{
+
+using namespace std;
+
+namespace
+{
+
+const char *const MODE_NAMES[] = {"kern", "user"};
+
+const char *const SIGNAL_NAMES[] = {"IRQ0",     "IRQ1",     "IRQ2",
+                                    "IRQ3",     "TIME_OUT", "RO_FAULT",
+                                    "PG_FAULT", "ILL_INST"};
+
+const char *const REGION_NAMES[] = {"kern_code", "kern_data", "user_code",
+                                    "user_data"};
+
+const char *const ACCESS_NAMES[] = {"load", "store"};
+
+/// @param counts
+/// @param other
+template <typename counts_t>
+void add_counts(counts_t &counts, const counts_t &other)
+{
+    for (size_t i = 0; i < counts.size(); i++)
+    {
+        counts[i] += other[i];
+    }
+}
+
+/// @param counts
+/// @param other
+void add_counts(map<uint32_t, uint64_t> &counts,
+                const map<uint32_t, uint64_t> &other)
+{
+    for (const auto &[key, count] : other)
+    {
+        counts[key] += count;
+    }
+}
+
+/// @param out
+/// @param counts
+/// @param access
+void write_io_counts(ostream &out, const map<uint32_t, uint64_t> &counts,
+                     const char *access)
+{
+    for (const auto &[offset, count] : counts)
+    {
+        out << "io.0x" << hex << setw(3) << setfill('0') << offset << dec
+            << "." << access << " " << count << "\n";
+    }
+}
+
+} // namespace
+
+/// @param other
+void perf_counters_t::add(const perf_counters_t &other)
+{
+    add_counts(retired, other.retired);
+    add_counts(mode_cycles, other.mode_cycles);
+    idle_cycles += other.idle_cycles;
+    add_counts(interrupts, other.interrupts);
+    page_faults += other.page_faults;
+    read_only_faults += other.read_only_faults;
+
+    for (size_t region = 0; region < memory_accesses.size(); region++)
+    {
+        add_counts(memory_accesses[region], other.memory_accesses[region]);
+    }
+
+    add_counts(io_loads, other.io_loads);
+    add_counts(io_stores, other.io_stores);
+}
+
+/// @param out
+void perf_counters_t::write(ostream &out) const
+{
+    for (size_t mode = 0; mode < mode_cycles.size(); mode++)
+    {
+        out << "cycles." << MODE_NAMES[mode] << " " << mode_cycles[mode]
+            << "\n";
+    }
+
+    out << "cycles.idle " << idle_cycles << "\n";
+
+    // Opcodes are named like the instruction listings, by their high byte.
+    for (size_t opcode = 0; opcode < retired.size(); opcode++)
+    {
+        if (retired[opcode])
+        {
+            out << "retired.0x" << hex << setw(2) << setfill('0')
+                << (opcode << 1) << dec << " " << retired[opcode] << "\n";
+        }
+    }
+
+    for (size_t signal = 0; signal < interrupts.size(); signal++)
+    {
+        out << "interrupts." << SIGNAL_NAMES[signal] << " "
+            << interrupts[signal] << "\n";
+    }
+
+    out << "faults.page " << page_faults << "\n";
+    out << "faults.read_only " << read_only_faults << "\n";
+
+    for (size_t region = 0; region < memory_accesses.size(); region++)
+    {
+        for (size_t access = 0; access < 2; access++)
+        {
+            out << "memory." << REGION_NAMES[region] << "."
+                << ACCESS_NAMES[access] << " "
+                << memory_accesses[region][access] << "\n";
+        }
+    }
+
+    write_io_counts(out, io_loads, ACCESS_NAMES[0]);
+    write_io_counts(out, io_stores, ACCESS_NAMES[1]);
+}
+
+}; // namespace mpce
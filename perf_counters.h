@@ -0,0 +1,74 @@
+#pragma once
+
+#include "interrupt.h"
+
+#include <array>
+#include <cstdint>
+#include <map>
+#include <ostream>
+
+/// Index of a memory in perf_counters_t::memory_accesses.
+#define MEMORY_REGION(user_mode, is_data)                                      \
+    (((user_mode) ? 2 : 0) | ((is_data) ? 1 : 0))
+
+namespace mpce
+{
+
+using namespace std;
+
+/// Whether this build counts events into perf_counters_t. Counting is
+/// compiled out unless MPCE_COUNTERS is defined, which the mpce_counters
+/// target does.
+#ifdef MPCE_COUNTERS
+constexpr bool COUNTERS_ENABLED = true;
+#else
+constexpr bool COUNTERS_ENABLED = false;
+#endif
+
+/// Event counts of one cpu or MMIO, or of a whole machine once added up.
+/// Every instance counts into its own plain counters; they are only
+/// aggregated when read.
+struct perf_counters_t
+{
+    /// Instructions executed, by 7-bit opcode.
+    array<uint64_t, 0x80> retired{};
+
+    /// Instructions executed or skipped in kernel mode and in user mode.
+    array<uint64_t, 2> mode_cycles{};
+
+    /// Instructions of idle polling loops that were skipped instead of
+    /// executed. They count for no opcode, memory or io offset.
+    uint64_t idle_cycles = 0;
+
+    /// Interrupts taken, by interrupt_signal_t. An interrupt taken for
+    /// several pending signals counts for each of them.
+    array<uint64_t, 8> interrupts{};
+
+    /// Page faults signalled by address translation.
+    uint64_t page_faults = 0;
+
+    /// Read-only faults signalled by address translation, including ignored
+    /// ones in kernel mode.
+    uint64_t read_only_faults = 0;
+
+    /// Data and code memory loads and stores of instructions, not counting
+    /// instruction fetches, by MEMORY_REGION.
+    array<array<uint64_t, 2>, 4> memory_accesses{};
+
+    /// Mapped io loads by io offset.
+    map<uint32_t, uint64_t> io_loads;
+
+    /// Mapped io stores by io offset.
+    map<uint32_t, uint64_t> io_stores;
+
+    /// Add the counts of other to these.
+    /// @param other
+    void add(const perf_counters_t &other);
+
+    /// Write one "name count" line per counter, leaving out zero counts of
+    /// opcodes and io offsets.
+    /// @param out
+    void write(ostream &out) const;
+};
+
+} // namespace mpce
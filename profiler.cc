@@ -0,0 +1,149 @@
+#include "profiler.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <utility>
+
+#define PROFILE_KEY(user_mode, ptb, pc)                                        \
+    ((static_cast<uint32_t>(user_mode) << 24) |                                \
+     (static_cast<uint32_t>(user_mode ? ptb : 0) << 16) | (pc))
+
+namespace mpce
+{
+
+using namespace std;
+
+/// @param path
+bool symbol_map_t::load(const string &path)
+{
+    ifstream in(path);
+
+    if (!in)
+    {
+        return false;
+    }
+
+    string line;
+
+    while (getline(in, line))
+    {
+        istringstream fields(line);
+        string mode;
+        uint32_t addr;
+        string name;
+
+        if (line.empty() || line[0] == '#')
+        {
+            continue;
+        }
+
+        if (!(fields >> mode >> hex >> addr >> name) || addr > 0xffff ||
+            (mode != "kern" && mode != "user"))
+        {
+            return false;
+        }
+
+        symbols_[mode == "user"][addr] = name;
+    }
+
+    return true;
+}
+
+/// @param user_mode
+/// @param pc
+const string *symbol_map_t::find(const bool user_mode, const uint16_t pc) const
+{
+    const map<uint16_t, string> &symbols = symbols_[user_mode];
+    auto symbol = symbols.upper_bound(pc);
+
+    if (symbol == symbols.begin())
+    {
+        return nullptr;
+    }
+
+    return &(--symbol)->second;
+}
+
+/// @param period
+/// @param symbols
+profiler_t::profiler_t(const uint64_t period, symbol_map_t symbols)
+    : period_(max<uint64_t>(period, 1)), symbols_(move(symbols))
+{
+}
+
+/// @returns
+uint64_t profiler_t::period() const
+{
+    return period_;
+}
+
+/// @param user_mode
+/// @param ptb
+/// @param pc
+void profiler_t::sample(const bool user_mode, const uint8_t ptb,
+                        const uint16_t pc)
+{
+    samples_[PROFILE_KEY(user_mode, ptb, pc)]++;
+}
+
+/// @returns
+uint64_t profiler_t::sample_count() const
+{
+    uint64_t count = 0;
+
+    for (const auto &[key, samples] : samples_)
+    {
+        count += samples;
+    }
+
+    return count;
+}
+
+/// @param out
+/// @param root
+void profiler_t::write_folded(ostream &out, const string &root) const
+{
+    // Samples of PCs in the same symbol merge into one stack.
+    map<string, uint64_t> stacks;
+
+    for (const auto &[key, samples] : samples_)
+    {
+        const bool user_mode = key >> 24;
+        const uint8_t ptb = key >> 16;
+        const uint16_t pc = key;
+        const string *symbol = symbols_.find(user_mode, pc);
+        char frames[32];
+
+        if (user_mode)
+        {
+            snprintf(frames, sizeof(frames), "user;ptb_%02x;", ptb);
+        }
+        else
+        {
+            snprintf(frames, sizeof(frames), "kern;");
+        }
+
+        string stack = root.empty() ? frames : root + ";" + frames;
+
+        if (symbol)
+        {
+            stack += *symbol;
+        }
+        else
+        {
+            snprintf(frames, sizeof(frames), "0x%04x", pc);
+            stack += frames;
+        }
+
+        stacks[stack] += samples;
+    }
+
+    for (const auto &[stack, samples] : stacks)
+    {
+        out << stack << " " << samples << "\n";
+    }
+}
+
+}; // namespace mpce
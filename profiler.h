@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+
+namespace mpce
+{
+
+using namespace std;
+
+/// Names of guest code addresses, read from a text file shipped next to the
+/// guest image. Each line is "kern|user <hex address> <name>", and a symbol
+/// covers its address up to the next symbol of the same mode. User addresses
+/// are virtual, so one symbol map serves every process.
+class symbol_map_t
+{
+  private:
+    /// Symbols by start address, of kernel and of user code.
+    map<uint16_t, string> symbols_[2];
+
+  public:
+    /// Add the symbols of a symbol file.
+    /// @param path
+    /// @returns False if path cannot be read or has a malformed line.
+    bool load(const string &path);
+
+    /// @param user_mode
+    /// @param pc
+    /// @returns The symbol covering pc, nullptr if there is none.
+    const string *find(const bool user_mode, const uint16_t pc) const;
+};
+
+/// Deterministic sampling profiler of guest code. The cpu takes a sample of
+/// its PC, mode and page table base every period instructions, at
+/// instruction counts that are multiples of period, so that repeated runs
+/// give the same profile.
+class profiler_t
+{
+  private:
+    uint64_t period_;
+
+    symbol_map_t symbols_;
+
+    /// Samples by PROFILE_KEY.
+    unordered_map<uint32_t, uint64_t> samples_;
+
+  public:
+    /// @param period Instructions between samples, at least 1.
+    /// @param symbols
+    profiler_t(const uint64_t period, symbol_map_t symbols = {});
+
+    /// @returns
+    uint64_t period() const;
+
+    /// Count a sample of the instruction at pc.
+    /// @param user_mode
+    /// @param ptb Ignored in kernel mode.
+    /// @param pc
+    void sample(const bool user_mode, const uint8_t ptb, const uint16_t pc);
+
+    /// @returns The number of samples taken.
+    uint64_t sample_count() const;
+
+    /// Write the samples as folded stacks for flamegraph.pl and similar tools:
+    /// one "frame;frame;... count" line per stack. Stacks are the mode, the
+    /// page table base in user mode, and the symbol or, without one, the hex
+    /// PC.
+    /// @param out
+    /// @param root Frame to put below all stacks, such as a core name, or
+    /// empty for none.
+    void write_folded(ostream &out, const string &root = "") const;
+};
+
+} // namespace mpce
@@ -1,11 +1,11 @@
 #pragma once
 
+#include "trace.h"
+
 #include <cstdint>
 #include <iostream>
 #include <string>
 
-#include <glog/logging.h>
-
 using namespace std;
 
 namespace mpce
@@ -54,8 +54,8 @@ template <typename dtype_t> class register_t
     /// @return
     dtype_t read() const
     {
-        LOG(INFO) << "reading " << static_cast<uint32_t>(data_)
-                  << " from register " << name_;
+        TRACE << "reading " << static_cast<uint32_t>(data_) << " from register "
+              << name_;
         return data_;
     }
 
@@ -63,11 +63,19 @@ template <typename dtype_t> class register_t
     /// @param data
     void write(const dtype_t &data)
     {
-        LOG(INFO) << "writing " << static_cast<uint32_t>(data)
-                  << " to register " << name_;
+        TRACE << "writing " << static_cast<uint32_t>(data) << " to register "
+              << name_;
         data_ = data & ~mask_;
     }
 
+    /// @brief Storage of the register, for generated code. Writes through it
+    /// bypass the mask.
+    /// @return
+    dtype_t *data()
+    {
+        return &data_;
+    }
+
     /// @brief
     /// @return
     string name() const
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <utility>
+
+namespace mpce
+{
+
+using namespace std;
+
+/// A lock-free ring buffer for exactly one producer thread and one consumer
+/// thread.
+/// @tparam value_t
+/// @tparam capacity A power of two.
+template <typename value_t, size_t capacity> class spsc_ring_t
+{
+    static_assert((capacity & (capacity - 1)) == 0,
+                  "capacity must be a power of two");
+
+  public:
+    /// A contiguous run of values.
+    using span_t = pair<const value_t *, size_t>;
+
+    /// Producer side.
+    /// @param value
+    /// @returns False if the ring is full.
+    bool push(const value_t &value)
+    {
+        const size_t head = head_.load(memory_order_relaxed);
+
+        if (head - tail_.load(memory_order_acquire) == capacity)
+        {
+            return false;
+        }
+
+        values_[head & (capacity - 1)] = value;
+        head_.store(head + 1, memory_order_release);
+
+        return true;
+    }
+
+    /// Consumer side.
+    /// @param value Set to the oldest value if the ring is not empty.
+    /// @returns False if the ring is empty.
+    bool pop(value_t &value)
+    {
+        const size_t tail = tail_.load(memory_order_relaxed);
+
+        if (head_.load(memory_order_acquire) == tail)
+        {
+            return false;
+        }
+
+        value = values_[tail & (capacity - 1)];
+        tail_.store(tail + 1, memory_order_release);
+
+        return true;
+    }
+
+    /// Consumer side. The values stay in the ring until consumed.
+    /// @param spans Set to the readable values, oldest first, as up to two
+    /// runs since they may wrap around the end of the ring.
+    /// @returns The number of readable values.
+    size_t readable(span_t (&spans)[2]) const
+    {
+        const size_t tail = tail_.load(memory_order_relaxed);
+        const size_t size = head_.load(memory_order_acquire) - tail;
+        const size_t begin = tail & (capacity - 1);
+        const size_t first = min(size, capacity - begin);
+
+        spans[0] = {&values_[begin], first};
+        spans[1] = {&values_[0], size - first};
+
+        return size;
+    }
+
+    /// Consumer side. Drop the oldest count values.
+    /// @param count At most the number returned by readable.
+    void consume(const size_t count)
+    {
+        tail_.store(tail_.load(memory_order_relaxed) + count,
+                    memory_order_release);
+    }
+
+    /// @returns True if the ring holds no values.
+    bool empty() const
+    {
+        return head_.load(memory_order_acquire) ==
+               tail_.load(memory_order_acquire);
+    }
+
+  private:
+    array<value_t, capacity> values_;
+
+    /// Values pushed by the producer.
+    alignas(64) atomic<size_t> head_{0};
+
+    /// Values consumed by the consumer.
+    alignas(64) atomic<size_t> tail_{0};
+};
+
+} // namespace mpce
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <glog/logging.h>
+
+/// Per-access and per-instruction logging. It is compiled out unless
+/// MPCE_TRACE is defined, which the mpce_trace target does; production builds
+/// spend no cycles on formatting or level checks.
+#ifdef MPCE_TRACE
+#define TRACE LOG(INFO)
+#else
+#define TRACE                                                                  \
+    while (false)                                                              \
+    LOG(INFO)
+#endif
+
+namespace mpce
+{
+
+/// Whether this build was compiled with tracing.
+#ifdef MPCE_TRACE
+constexpr bool TRACE_ENABLED = true;
+#else
+constexpr bool TRACE_ENABLED = false;
+#endif
+
+} // namespace mpce
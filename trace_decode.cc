@@ -0,0 +1,227 @@
+#include "cpu_state.h"
+#include "trace_recorder.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+using namespace std;
+using namespace mpce;
+
+namespace
+{
+
+const char *const KIND_NAMES[] = {"inst", "reg", "load", "store",
+                                  "interrupt"};
+
+const char *const REGISTER_NAMES[REGISTER_FILE_SIZE] = {
+    "r0", "r1", "r2", "r3", "fp", "sp", "pc", "imm"};
+
+/// Counts collected over a whole trace.
+struct trace_summary_t
+{
+    uint64_t kind_count[TRACE_INTERRUPT + 1] = {};
+    uint64_t user_insts = 0;
+    uint64_t first_cycle = UINT64_MAX;
+    uint64_t last_cycle = 0;
+    map<uint8_t, uint64_t> opcode_count;
+    map<uint16_t, uint64_t> pc_count;
+    map<uint16_t, uint64_t> cause_count;
+};
+
+/// @param record
+void print_record(const trace_record_t &record)
+{
+    const char *mode = record.flags & TRACE_FLAG_USER ? "user" : "kern";
+
+    switch (record.kind)
+    {
+    case TRACE_INST:
+        printf("%10llu %s pc=0x%04x inst=0x%04x op=0x%02x\n",
+               static_cast<unsigned long long>(record.cycle), mode,
+               record.addr, record.value, OPCODE(record.value) << 1);
+        break;
+
+    case TRACE_REG_WRITE:
+        printf("%10s   %s <- 0x%04x\n", "", REGISTER_NAMES[record.addr & 7],
+               record.value);
+        break;
+
+    case TRACE_MEM_LOAD:
+    case TRACE_MEM_STORE:
+        printf("%10s   %s %s %s %s[0x%06x] %s 0x%04x\n", "",
+               KIND_NAMES[record.kind], mode,
+               record.flags & TRACE_FLAG_CODE ? "code" : "data",
+               record.flags & TRACE_FLAG_BYTE ? "byte" : "word", record.addr,
+               record.kind == TRACE_MEM_LOAD ? "->" : "<-", record.value);
+        break;
+
+    case TRACE_INTERRUPT:
+        printf("%10llu %s interrupt at pc=0x%04x cause=0x%02x\n",
+               static_cast<unsigned long long>(record.cycle), mode,
+               record.addr, record.value);
+        break;
+
+    default:
+        printf("%10llu unknown record kind %u\n",
+               static_cast<unsigned long long>(record.cycle), record.kind);
+        break;
+    }
+}
+
+/// @param summary
+/// @param record
+void count_record(trace_summary_t &summary, const trace_record_t &record)
+{
+    if (record.kind > TRACE_INTERRUPT)
+    {
+        return;
+    }
+
+    summary.kind_count[record.kind]++;
+    summary.first_cycle = min(summary.first_cycle, record.cycle);
+    summary.last_cycle = max(summary.last_cycle, record.cycle);
+
+    if (record.kind == TRACE_INST)
+    {
+        summary.user_insts += record.flags & TRACE_FLAG_USER ? 1 : 0;
+        summary.opcode_count[OPCODE(record.value) << 1]++;
+        summary.pc_count[record.addr]++;
+    }
+    else if (record.kind == TRACE_INTERRUPT)
+    {
+        summary.cause_count[record.value]++;
+    }
+}
+
+/// Print the entries of counts with the highest counts first.
+/// @tparam key_t
+/// @param title
+/// @param counts
+/// @param limit
+template <typename key_t>
+void print_top(const char *title, const map<key_t, uint64_t> &counts,
+               const size_t limit)
+{
+    vector<pair<uint64_t, key_t>> sorted;
+
+    for (const auto &[key, count] : counts)
+    {
+        sorted.emplace_back(count, key);
+    }
+
+    sort(sorted.rbegin(), sorted.rend());
+
+    printf("%s:\n", title);
+
+    for (size_t i = 0; i < sorted.size() && i < limit; i++)
+    {
+        printf("  0x%04x %12llu\n", static_cast<uint32_t>(sorted[i].second),
+               static_cast<unsigned long long>(sorted[i].first));
+    }
+}
+
+/// @param summary
+void print_summary(const trace_summary_t &summary)
+{
+    const uint64_t insts = summary.kind_count[TRACE_INST];
+
+    printf("\nrecords:\n");
+
+    for (uint32_t kind = 0; kind <= TRACE_INTERRUPT; kind++)
+    {
+        printf("  %-10s %12llu\n", KIND_NAMES[kind],
+               static_cast<unsigned long long>(summary.kind_count[kind]));
+    }
+
+    if (insts)
+    {
+        printf("cycles %llu..%llu, %llu user and %llu kernel instructions\n",
+               static_cast<unsigned long long>(summary.first_cycle),
+               static_cast<unsigned long long>(summary.last_cycle),
+               static_cast<unsigned long long>(summary.user_insts),
+               static_cast<unsigned long long>(insts - summary.user_insts));
+    }
+
+    print_top("opcodes", summary.opcode_count, 16);
+    print_top("hottest pcs", summary.pc_count, 16);
+    print_top("interrupt causes", summary.cause_count, 8);
+}
+
+} // namespace
+
+/// Decode a trace file written by trace_recorder_t into text.
+/// Usage: mpce_trace_decode [--summary] <trace file>
+/// With --summary, only the summary statistics are printed.
+int main(int argc, char *argv[])
+{
+    bool summary_only = false;
+    const char *path = nullptr;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--summary"))
+        {
+            summary_only = true;
+        }
+        else
+        {
+            path = argv[i];
+        }
+    }
+
+    if (!path)
+    {
+        fprintf(stderr, "usage: %s [--summary] <trace file>\n", argv[0]);
+        return 2;
+    }
+
+    FILE *file = fopen(path, "rb");
+
+    if (!file)
+    {
+        fprintf(stderr, "cannot open %s\n", path);
+        return 1;
+    }
+
+    trace_file_header_t header;
+
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        strncmp(header.magic, TRACE_FILE_MAGIC, sizeof(header.magic)) ||
+        header.version != TRACE_FILE_VERSION ||
+        header.record_size != sizeof(trace_record_t))
+    {
+        fprintf(stderr, "%s is not a version %d trace file\n", path,
+                TRACE_FILE_VERSION);
+        fclose(file);
+        return 1;
+    }
+
+    trace_summary_t summary;
+    vector<trace_record_t> records(0x1000);
+    size_t count;
+
+    while ((count = fread(records.data(), sizeof(trace_record_t),
+                          records.size(), file)) > 0)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            if (!summary_only)
+            {
+                print_record(records[i]);
+            }
+
+            count_record(summary, records[i]);
+        }
+    }
+
+    fclose(file);
+
+    print_summary(summary);
+
+    return 0;
+}
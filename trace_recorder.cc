@@ -0,0 +1,144 @@
+#include "trace_recorder.h"
+
+#include <cstring>
+#include <functional>
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <glog/logging.h>
+
+namespace mpce
+{
+
+using namespace std;
+
+/// @param path
+trace_recorder_t::trace_recorder_t(const string &path)
+    : event_fd_(eventfd(0, EFD_CLOEXEC))
+{
+    file_ = fopen(path.c_str(), "wb");
+
+    if (file_)
+    {
+        trace_file_header_t header = {};
+        strncpy(header.magic, TRACE_FILE_MAGIC, sizeof(header.magic));
+        header.version = TRACE_FILE_VERSION;
+        header.record_size = sizeof(trace_record_t);
+
+        fwrite(&header, sizeof(header), 1, file_);
+    }
+    else
+    {
+        LOG(WARNING) << "trace: cannot open " << path;
+    }
+
+    writer_thread_ = thread(bind(&trace_recorder_t::loop_write, this));
+}
+
+trace_recorder_t::~trace_recorder_t()
+{
+    running_ = false;
+
+    const uint64_t one = 1;
+    [[maybe_unused]] const ssize_t written =
+        write(event_fd_, &one, sizeof(one));
+
+    writer_thread_.join();
+    close(event_fd_);
+
+    if (file_)
+    {
+        fclose(file_);
+    }
+}
+
+/// @returns
+bool trace_recorder_t::is_open() const
+{
+    return file_ != nullptr;
+}
+
+/// @returns
+uint64_t trace_recorder_t::records() const
+{
+    return records_;
+}
+
+/// @returns
+uint64_t trace_recorder_t::full_waits() const
+{
+    return full_waits_;
+}
+
+void trace_recorder_t::loop_write()
+{
+    while (true)
+    {
+        // Check running_ before the ring, so that no record appended before
+        // stopping is missed.
+        const bool running = running_;
+        ring_t::span_t spans[2];
+        const size_t size = ring_.readable(spans);
+
+        if (size)
+        {
+            write_records(spans);
+            ring_.consume(size);
+            continue;
+        }
+
+        if (!running)
+        {
+            break;
+        }
+
+        // Announce the wait before checking the ring again, so that record
+        // either sees writer_waiting_ or its records are seen here.
+        writer_waiting_ = true;
+        atomic_thread_fence(memory_order_seq_cst);
+
+        if (ring_.empty())
+        {
+            uint64_t count;
+            [[maybe_unused]] const ssize_t bytes_read =
+                read(event_fd_, &count, sizeof(count));
+        }
+
+        writer_waiting_ = false;
+    }
+
+    if (file_)
+    {
+        fflush(file_);
+    }
+}
+
+void trace_recorder_t::notify_writer()
+{
+    atomic_thread_fence(memory_order_seq_cst);
+
+    if (writer_waiting_.load(memory_order_relaxed) &&
+        writer_waiting_.exchange(false))
+    {
+        const uint64_t one = 1;
+        [[maybe_unused]] const ssize_t written =
+            write(event_fd_, &one, sizeof(one));
+    }
+}
+
+/// @param spans
+void trace_recorder_t::write_records(const ring_t::span_t (&spans)[2])
+{
+    if (!file_)
+    {
+        return;
+    }
+
+    for (const ring_t::span_t &span : spans)
+    {
+        fwrite(span.first, sizeof(trace_record_t), span.second, file_);
+    }
+}
+
+}; // namespace mpce
@@ -0,0 +1,154 @@
+#pragma once
+
+#include "spsc_ring.h"
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <thread>
+
+#define TRACE_RING_CAPACITY 0x1'0000
+
+/// Records appended between wakeups of the writer thread.
+#define TRACE_WRITE_BATCH 0x1000
+#define TRACE_FILE_MAGIC "MPCETRC"
+#define TRACE_FILE_VERSION 1
+
+#define TRACE_FLAG_USER 0x01
+#define TRACE_FLAG_BYTE 0x02
+#define TRACE_FLAG_CODE 0x04
+
+namespace mpce
+{
+
+using namespace std;
+
+enum trace_kind_t : uint8_t
+{
+    /// addr is the pc, value the instruction word.
+    TRACE_INST,
+
+    /// addr is the register index, value the new register value.
+    TRACE_REG_WRITE,
+
+    /// addr is the physical address, value the loaded word or byte.
+    TRACE_MEM_LOAD,
+
+    /// addr is the physical address, value the stored word or byte.
+    TRACE_MEM_STORE,
+
+    /// addr is the pc of the interrupted instruction, value the cause.
+    TRACE_INTERRUPT
+};
+
+/// One fixed-size trace event, written to trace files as is.
+struct trace_record_t
+{
+    /// Instruction count of the cpu when the event happened.
+    uint64_t cycle;
+
+    uint32_t addr;
+
+    uint16_t value;
+
+    trace_kind_t kind;
+
+    /// TRACE_FLAG_* bits.
+    uint8_t flags;
+};
+
+static_assert(sizeof(trace_record_t) == 16);
+
+/// Header at the start of a trace file, followed by trace_record_t entries.
+struct trace_file_header_t
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+};
+
+/// Records trace events of one cpu into a lock-free single producer, single
+/// consumer ring. A background thread streams the ring to a file, so the cpu
+/// only pays for copying 16 bytes per event. The writer thread blocks on an
+/// eventfd, which the cpu signals once per TRACE_WRITE_BATCH records if the
+/// thread waits. The cpu waits when the ring is full rather than dropping
+/// events.
+class trace_recorder_t
+{
+  private:
+    using ring_t = spsc_ring_t<trace_record_t, TRACE_RING_CAPACITY>;
+
+    ring_t ring_;
+
+    /// Records appended by the cpu.
+    uint64_t records_ = 0;
+
+    /// Times the cpu found the ring full.
+    uint64_t full_waits_ = 0;
+
+    /// nullptr if the file could not be opened, in which case records are
+    /// discarded.
+    FILE *file_ = nullptr;
+
+    atomic<bool> running_{true};
+
+    /// Whether the writer thread waits for event_fd_.
+    atomic<bool> writer_waiting_{false};
+
+    /// Wakes the writer thread when records are available or it is stopped.
+    int event_fd_ = -1;
+
+    thread writer_thread_;
+
+  public:
+    /// Open path for writing and start the writer thread.
+    /// @param path
+    explicit trace_recorder_t(const string &path);
+
+    /// Write all remaining records and close the file.
+    ~trace_recorder_t();
+
+    trace_recorder_t(const trace_recorder_t &) = delete;
+
+    trace_recorder_t &operator=(const trace_recorder_t &) = delete;
+
+    /// @returns False if the trace file could not be opened.
+    bool is_open() const;
+
+    /// Append a record. Must only be called from a single thread.
+    /// @param record
+    void record(const trace_record_t &record)
+    {
+        while (!ring_.push(record))
+        {
+            full_waits_++;
+            notify_writer();
+            this_thread::yield();
+        }
+
+        if (++records_ % TRACE_WRITE_BATCH == 0)
+        {
+            notify_writer();
+        }
+    }
+
+    /// @returns The number of records appended.
+    uint64_t records() const;
+
+    /// @returns The number of times record waited for the writer thread.
+    uint64_t full_waits() const;
+
+  private:
+    /// Write consumed records to file_ until stopped and drained.
+    void loop_write();
+
+    /// Wake the writer thread if it waits for records.
+    void notify_writer();
+
+    /// Write spans to file_.
+    /// @param spans
+    void write_records(const ring_t::span_t (&spans)[2]);
+};
+
+} // namespace mpce
@@ -0,0 +1,373 @@
+#include "validator.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <utility>
+
+namespace mpce
+{
+
+using namespace std;
+
+namespace
+{
+
+/// Names of the memories in validator_t::fast_memories_, in order.
+const char *const MEMORY_NAMES[] = {"kern code", "user code",
+                                    "kern data", "user data",
+                                    "code page table", "data page table"};
+
+/// @param what
+/// @param fast
+/// @param reference
+/// @returns A line of validator_divergence_t::differences.
+string difference(const string &what, const uint64_t fast,
+                  const uint64_t reference)
+{
+    char values[64];
+    snprintf(values, sizeof(values), ": fast 0x%04lx reference 0x%04lx", fast,
+             reference);
+
+    return what + values;
+}
+
+/// @param cpu_mmio
+/// @param cpu_mmu
+/// @returns The memories of a cpu in the order of MEMORY_NAMES.
+vector<memory_t *> memories(MMIO &cpu_mmio, mmu_t &cpu_mmu)
+{
+    return {&cpu_mmio.get_code(false), &cpu_mmio.get_code(true),
+            &cpu_mmio.get_data(false), &cpu_mmio.get_data(true),
+            &cpu_mmu.page_table(false), &cpu_mmu.page_table(true)};
+}
+
+} // namespace
+
+/// @param out
+void validator_divergence_t::write(ostream &out) const
+{
+    out << "divergence at instruction " << cycle << ", last agreed at "
+        << last_agreed_cycle << "\n";
+
+    for (const string &line : differences)
+    {
+        out << "  " << line << "\n";
+    }
+
+    // Instructions since the last agreement are marked, they contain the
+    // divergence.
+    out << "reference trace:\n";
+
+    for (const validator_step_t &step : trace)
+    {
+        char line[80];
+        snprintf(line, sizeof(line), "%c %12lu %s pc 0x%04x inst 0x%04x\n",
+                 step.cycle >= last_agreed_cycle ? '>' : ' ', step.cycle,
+                 step.user_mode ? "user" : "kern", step.pc, step.inst);
+
+        out << line;
+    }
+}
+
+validator_t::validator_t()
+    : fast_memories_(memories(fast_->mmio_, fast_->mmu_)),
+      reference_memories_(memories(reference_->mmio_, reference_->mmu_))
+{
+    for (size_t i = 0; i < fast_memories_.size(); i++)
+    {
+        fast_memories_[i]->set_dirty_tracking(true);
+        reference_memories_[i]->set_store_logging(true);
+    }
+}
+
+/// @param path
+bool validator_t::load_image(const string &path)
+{
+    return fast_->load_image(path) && reference_->load_image(path);
+}
+
+/// @param input
+void validator_t::set_input(const string &input)
+{
+    input_ = input;
+    input_queued_ = 0;
+}
+
+/// @returns
+cpu_state_t &validator_t::fast()
+{
+    return *fast_;
+}
+
+/// @returns
+cpu_state_t &validator_t::reference()
+{
+    return *reference_;
+}
+
+/// @returns
+const string &validator_t::output() const
+{
+    return output_;
+}
+
+/// @param max_cycles
+optional<validator_divergence_t> validator_t::run(const uint64_t max_cycles)
+{
+    divergence_.reset();
+
+    fast_->run_until([this] { return check(); }, max_cycles);
+
+    // run_until does not evaluate the predicate after its last block.
+    if (!divergence_)
+    {
+        check();
+    }
+
+    return divergence_;
+}
+
+bool validator_t::check()
+{
+    const uint64_t cycle = fast_->cycle_count_;
+
+    try
+    {
+        while (reference_->cycle_count_ < cycle)
+        {
+            step_reference();
+        }
+    }
+    catch (const exception &e)
+    {
+        diverge({string("reference raised: ") + e.what()});
+        return true;
+    }
+
+    vector<string> differences;
+
+    compare_state(differences);
+
+    for (size_t i = 0; i < fast_memories_.size(); i++)
+    {
+        compare_stores(MEMORY_NAMES[i], *fast_memories_[i],
+                       *reference_memories_[i], differences);
+    }
+
+    compare_output(differences);
+
+    if (differences.empty())
+    {
+        queue_input(differences);
+    }
+
+    if (!differences.empty())
+    {
+        diverge(move(differences));
+        return true;
+    }
+
+    agreed_cycle_ = cycle;
+    return false;
+}
+
+void validator_t::step_reference()
+{
+    validator_step_t &step = trace_[steps_++ % VALIDATOR_TRACE_SIZE];
+
+    step.cycle = reference_->cycle_count_;
+    step.user_mode = reference_->is_user_mode();
+    step.pc = reference_->register_file_.get(PC).read();
+
+    reference_->cycle();
+
+    step.inst = reference_->inst_.read();
+}
+
+/// @param differences
+void validator_t::queue_input(vector<string> &differences)
+{
+    if (input_queued_ == input_.size())
+    {
+        return;
+    }
+
+    const uint8_t *pending =
+        reinterpret_cast<const uint8_t *>(input_.data()) + input_queued_;
+    const size_t size = input_.size() - input_queued_;
+
+    const size_t fast_queued =
+        fast_->mmio_.serial_interface().queue_input(pending, size);
+    const size_t reference_queued =
+        reference_->mmio_.serial_interface().queue_input(pending, size);
+
+    if (fast_queued != reference_queued)
+    {
+        differences.push_back(difference("console input accepted",
+                                         fast_queued, reference_queued));
+    }
+
+    input_queued_ += min(fast_queued, reference_queued);
+}
+
+/// @param differences
+void validator_t::compare_state(vector<string> &differences)
+{
+    // Names are only built for differences, this runs at every block.
+    const auto compare = [&](const char *what, const uint64_t fast,
+                             const uint64_t reference) {
+        if (fast != reference)
+        {
+            differences.push_back(difference(what, fast, reference));
+        }
+    };
+
+    const auto compare_register = [&](const auto &fast, const auto &reference) {
+        if (fast.read() != reference.read())
+        {
+            differences.push_back(
+                difference(fast.name(), fast.read(), reference.read()));
+        }
+    };
+
+    for (uint8_t i = 0; i < REGISTER_FILE_SIZE; i++)
+    {
+        compare_register(fast_->register_file_.get(i),
+                         reference_->register_file_.get(i));
+    }
+
+    compare_register(fast_->status_, reference_->status_);
+    compare_register(fast_->cause_, reference_->cause_);
+    compare_register(fast_->eret_, reference_->eret_);
+    compare_register(fast_->context_, reference_->context_);
+    compare_register(fast_->timer_, reference_->timer_);
+    compare_register(fast_->isr_, reference_->isr_);
+    compare_register(fast_->ptb_, reference_->ptb_);
+    compare_register(fast_->exc_addr_, reference_->exc_addr_);
+    compare_register(fast_->inst_, reference_->inst_);
+    compare_register(fast_->mode_, reference_->mode_);
+
+    compare("pending signals", fast_->interrupt_.pending_signals(),
+            reference_->interrupt_.pending_signals());
+    compare("timer deadline", fast_->timer_deadline_,
+            reference_->timer_deadline_);
+    compare("timer expired", fast_->timer_expired_,
+            reference_->timer_expired_);
+}
+
+/// @param name
+/// @param fast
+/// @param reference
+/// @param differences
+void validator_t::compare_stores(const char *name, memory_t &fast,
+                                 memory_t &reference,
+                                 vector<string> &differences)
+{
+    fast.take_dirty_pages(fast_dirty_);
+    reference.take_stored_words(reference_stored_);
+
+    if (fast_dirty_.empty() && reference_stored_.empty())
+    {
+        return;
+    }
+
+    const auto compare_word = [&](const uint32_t word_addr) {
+        if (fast.word(word_addr) != reference.word(word_addr))
+        {
+            char what[80];
+            snprintf(what, sizeof(what), "%s word 0x%05x", name, word_addr);
+
+            differences.push_back(difference(what, fast.word(word_addr),
+                                             reference.word(word_addr)));
+        }
+    };
+
+    // The fast cpu does not log its stores, so a store it made and the
+    // reference cpu did not can only be found by comparing whole pages.
+    sort(fast_dirty_.begin(), fast_dirty_.end());
+
+    for (const uint32_t page_num : fast_dirty_)
+    {
+        const uint32_t begin = page_num * MEMORY_PAGE_SIZE;
+        const uint32_t end = min(begin + MEMORY_PAGE_SIZE, fast.capacity());
+
+        // Pages mostly agree, this runs at every block.
+        if (!memcmp(fast.page_words(page_num), reference.page_words(page_num),
+                    (end - begin) * sizeof(uint16_t)))
+        {
+            continue;
+        }
+
+        for (uint32_t word_addr = begin; word_addr < end; word_addr++)
+        {
+            compare_word(word_addr);
+        }
+    }
+
+    // A store missed by the fast cpu shows as the value it left behind.
+    sort(reference_stored_.begin(), reference_stored_.end());
+    reference_stored_.erase(
+        unique(reference_stored_.begin(), reference_stored_.end()),
+        reference_stored_.end());
+
+    for (const uint32_t word_addr : reference_stored_)
+    {
+        if (!binary_search(fast_dirty_.begin(), fast_dirty_.end(),
+                           MEMORY_PAGE_NUM(word_addr)))
+        {
+            compare_word(word_addr);
+        }
+    }
+}
+
+/// @param differences
+void validator_t::compare_output(vector<string> &differences)
+{
+    io_serial_interface_t &fast_serial = fast_->mmio_.serial_interface();
+    io_serial_interface_t &reference_serial =
+        reference_->mmio_.serial_interface();
+
+    if (!fast_serial.has_output() && !reference_serial.has_output())
+    {
+        return;
+    }
+
+    const size_t begin = output_.size();
+    string reference_output;
+
+    fast_serial.take_output(output_);
+    reference_serial.take_output(reference_output);
+
+    if (output_.compare(begin, string::npos, reference_output) != 0)
+    {
+        differences.push_back("console output: fast \"" +
+                              output_.substr(begin) + "\" reference \"" +
+                              reference_output + "\"");
+    }
+}
+
+/// @param differences
+void validator_t::diverge(vector<string> differences)
+{
+    validator_divergence_t divergence;
+
+    divergence.last_agreed_cycle = agreed_cycle_;
+    divergence.cycle = reference_->cycle_count_;
+    divergence.differences = move(differences);
+
+    const uint64_t traced =
+        min<uint64_t>({steps_, VALIDATOR_TRACE_SIZE,
+                       divergence.cycle - agreed_cycle_ +
+                           VALIDATOR_TRACE_CONTEXT});
+
+    for (uint64_t i = steps_ - traced; i < steps_; i++)
+    {
+        divergence.trace.push_back(trace_[i % VALIDATOR_TRACE_SIZE]);
+    }
+
+    divergence_ = move(divergence);
+}
+
+}; // namespace mpce
@@ -0,0 +1,172 @@
+#pragma once
+
+#include "cpu_state.h"
+
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+/// Reference instructions kept for a divergence report, enough for the
+/// largest block and the instructions leading up to it.
+#define VALIDATOR_TRACE_SIZE (2 * BLOCK_MAX_SIZE)
+
+/// Instructions before the last agreement in a divergence report.
+#define VALIDATOR_TRACE_CONTEXT 8
+
+namespace mpce
+{
+
+using namespace std;
+
+/// One instruction executed by the reference cpu.
+struct validator_step_t
+{
+    /// Instruction count before the instruction.
+    uint64_t cycle;
+
+    bool user_mode;
+
+    uint16_t pc;
+
+    /// Instruction word, as fetched into the inst register.
+    uint16_t inst;
+};
+
+/// The first state found to differ between the two cpus.
+struct validator_divergence_t
+{
+    /// Instruction count of the last boundary at which both cpus agreed.
+    uint64_t last_agreed_cycle = 0;
+
+    /// Instruction count at which they differ.
+    uint64_t cycle = 0;
+
+    /// One "<what>: fast <value> reference <value>" line per difference.
+    vector<string> differences;
+
+    /// The reference instructions since the last agreement and a few
+    /// before, up to VALIDATOR_TRACE_SIZE, oldest first.
+    vector<validator_step_t> trace;
+
+    /// Write a human readable report.
+    /// @param out
+    void write(ostream &out) const;
+};
+
+/// Runs a guest on the fast engine, run_until with translated blocks, the
+/// JIT and idle skipping, and on the reference interpreter, cycle, side by
+/// side. At every block boundary of the fast cpu the reference cpu executes
+/// the same number of instructions, and both are compared: general purpose
+/// and special registers, pending interrupts, the timer, the words of every
+/// memory and page table stored to since the previous boundary, and console
+/// output. The reference cpu logs every store. The fast cpu keeps its inline
+/// and generated stores, only tracking the pages it stores to, so whole pages
+/// are compared for the stores it may have made.
+class validator_t
+{
+  private:
+    /// Separate instances with their own MMIO. Large, so kept off the stack.
+    unique_ptr<cpu_state_t> fast_ = make_unique<cpu_state_t>();
+    unique_ptr<cpu_state_t> reference_ = make_unique<cpu_state_t>();
+
+    /// Console input not yet queued to both cpus.
+    string input_;
+
+    size_t input_queued_ = 0;
+
+    /// Console output of the fast cpu, once the reference cpu agreed.
+    string output_;
+
+    /// Code, data and page table memories of both cpus, in the same order.
+    vector<memory_t *> fast_memories_;
+    vector<memory_t *> reference_memories_;
+
+    /// Last reference instructions, a ring indexed by steps_.
+    validator_step_t trace_[VALIDATOR_TRACE_SIZE] = {};
+
+    /// Instructions executed by step_reference.
+    uint64_t steps_ = 0;
+
+    /// Instruction count of the last boundary at which both cpus agreed.
+    uint64_t agreed_cycle_ = 0;
+
+    optional<validator_divergence_t> divergence_;
+
+    /// Scratch buffers of compare_stores.
+    vector<uint32_t> fast_dirty_;
+    vector<uint32_t> reference_stored_;
+
+  public:
+    validator_t();
+
+    validator_t(const validator_t &) = delete;
+
+    validator_t &operator=(const validator_t &) = delete;
+
+    /// Load a guest image into both cpus.
+    /// @param path
+    /// @returns False if the image cannot be loaded.
+    bool load_image(const string &path);
+
+    /// Feed input to the console of both cpus as the guest reads it.
+    /// @param input
+    void set_input(const string &input);
+
+    /// @returns The cpu run by run_until, to configure it before run.
+    cpu_state_t &fast();
+
+    /// @returns The cpu run by cycle.
+    cpu_state_t &reference();
+
+    /// @returns The console output so far.
+    const string &output() const;
+
+    /// Run both cpus for up to max_cycles instructions, stopping at the first
+    /// divergence. Exceptions raised by the fast cpu propagate; the
+    /// reference cpu raising one is a divergence.
+    /// @param max_cycles
+    /// @returns The divergence, if any.
+    optional<validator_divergence_t> run(const uint64_t max_cycles);
+
+  private:
+    /// Bring the reference cpu to the instruction count of the fast cpu and
+    /// compare them. Called at every block boundary.
+    /// @returns True if they diverged.
+    bool check();
+
+    /// Execute one reference instruction and add it to trace_.
+    void step_reference();
+
+    /// Queue as much pending input as fits to both consoles.
+    /// @param differences Gets a line if the consoles accept different
+    /// amounts.
+    void queue_input(vector<string> &differences);
+
+    /// Append the differing architectural state to differences.
+    /// @param differences
+    void compare_state(vector<string> &differences);
+
+    /// Append the differences between the words of one memory stored to by
+    /// the reference cpu, or in the pages stored to by the fast cpu, since the
+    /// last call to differences.
+    /// @param name
+    /// @param fast
+    /// @param reference
+    /// @param differences
+    void compare_stores(const char *name, memory_t &fast, memory_t &reference,
+                        vector<string> &differences);
+
+    /// Append the differing console output since the last call to
+    /// differences.
+    /// @param differences
+    void compare_output(vector<string> &differences);
+
+    /// Record a divergence at the current instruction count.
+    /// @param differences
+    void diverge(vector<string> differences);
+};
+
+} // namespace mpce